@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// IMA ADPCM as stored in WAV files (format tag 0x11), mono. Each block starts with a
+// 4-byte header holding the first sample and the step index, followed by 4-bit codes,
+// low nibble first, so a block of n bytes holds 2 * (n - 4) + 1 samples.
+
+// Decode one block, which may be the shorter final block of a file. Returns the number
+// of samples written.
+size_t adpcmDecodeBlock(const uint8_t *block, size_t blockSize, int16_t *samples);
+
+// Encode count samples (at least one) into one block, the same way the server does.
+// stepIndex carries over from one block to the next; start a file with 0. Returns the
+// block size, 4 + (count - 1) / 2 bytes rounded up.
+size_t adpcmEncodeBlock(const int16_t *samples, size_t count, uint8_t &stepIndex, uint8_t *block);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+
+// Fixed-size audio blocks in DMA-capable RAM, allocated once at boot. Capture, decode,
+// SD and network code pass block pointers along instead of each keeping its own buffer
+// on the stack or the heap. One block holds one I2S DMA buffer of 16-bit mono samples.
+const size_t audioBlockBytes = 2048;
+const size_t audioBlockSamples = audioBlockBytes / sizeof(int16_t);
+const size_t audioPoolBlocks = 8;
+
+struct AudioBlock {
+    uint8_t *data; // audioBlockBytes, word aligned
+    size_t length; // Bytes of valid data
+
+    int16_t *samples() { return (int16_t *)data; }
+};
+
+// Allocate the pool. Call first thing in setup(), before the heap fragments.
+bool audioPoolBegin();
+
+// Take a free block, waiting up to wait ticks for one to be returned. NULL if none came.
+AudioBlock *audioBlockAcquire(TickType_t wait = portMAX_DELAY);
+
+// Hand a block back; NULL is ignored
+void audioBlockRelease(AudioBlock *block);
+
+size_t audioPoolInUse();
+size_t audioPoolPeak(); // Most blocks ever taken at once since boot
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Statistics of the raw microphone samples, gathered block by block while capturing so
+// a clipping, silent or dead microphone shows up in the message and on /metrics without
+// anyone listening to it.
+const int16_t captureClipLevel = 32767;          // Samples this far from zero, either sign, count as clipped
+const uint32_t captureClippedPerMille = 1;       // More clipped samples than this flag the recording
+const float captureSilentDbfs = -60.0f;          // RMS below this is no speech at all
+const uint32_t captureDeadMicRunMs = 50;         // Exact zeros for this long don't come from a working microphone
+const int16_t captureDcOffsetLimit = 1000;       // Mean far enough from zero to eat into headroom
+
+enum CaptureProblem : uint16_t {
+    CAPTURE_CLIPPED = 1 << 0,
+    CAPTURE_SILENT = 1 << 1,
+    CAPTURE_DEAD_MIC = 1 << 2,
+    CAPTURE_DC_OFFSET = 1 << 3,
+};
+
+struct CaptureQuality {
+    uint32_t sampleRate;
+    uint32_t samples;
+    uint32_t clipped;
+    uint32_t longestZeroRun; // In samples
+    uint32_t zeroRun;        // Zeros at the end of the last block, carried into the next
+    uint16_t peak;
+    int64_t sum;             // For the DC offset
+    uint64_t sumSquares;     // For the RMS
+};
+
+void captureQualityBegin(CaptureQuality &quality, uint32_t sampleRate);
+
+// Fold one block of samples in, in a single pass without data-dependent branches
+void captureQualityAdd(CaptureQuality &quality, const int16_t *samples, size_t count);
+
+float captureQualityRmsDbfs(const CaptureQuality &quality);
+float captureQualityPeakDbfs(const CaptureQuality &quality);
+int16_t captureQualityDcOffset(const CaptureQuality &quality);
+uint32_t captureQualityLongestZeroRunMs(const CaptureQuality &quality);
+
+// CaptureProblem bits for what was captured so far
+uint16_t captureQualityProblems(const CaptureQuality &quality);
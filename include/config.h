@@ -0,0 +1,33 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Build-time defaults for the device identity; override per device with
+//   build_flags = '-D BRUSHTALK_DEVICE_ID="kitchen"' '-D BRUSHTALK_PEERS="bathroom,kids"'
+// or at runtime with a config file on the SD card.
+#ifndef BRUSHTALK_DEVICE_ID
+#define BRUSHTALK_DEVICE_ID "device1"
+#endif
+
+#ifndef BRUSHTALK_PEERS
+#define BRUSHTALK_PEERS ""
+#endif
+
+// Optional key=value file on SD, e.g.
+//   id=kitchen
+//   peers=bathroom,kids
+const char *const deviceConfigPath = "/device.cfg";
+
+// Settings defined in main.cpp and shared with the other modules
+extern const String serverURL;
+
+// This device's id, used as X-Device-Type, in uploaded file names and as its inbox name
+// on the server
+extern String deviceName;
+
+// Comma-separated ids this device sends to. Empty means every recipient in the server's
+// routing table for this device.
+extern String devicePeers;
+
+// Read the device config file if there is one. Call after storageBegin().
+void loadDeviceConfig();
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Standard CRC-32 (IEEE 802.3, the one zlib and PNG use). Start with crc = 0 and feed
+// the blocks in order; the result of one call is the input of the next.
+uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t length);
+
+// CRC of A followed by B, given crc(A), crc(B) and the length of B. Lets the recorder
+// prepend the WAV header to an already checksummed data stream without rereading it.
+uint32_t crc32Combine(uint32_t crcA, uint32_t crcB, size_t lengthB);
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiClient.h>
+
+// Minimal HTTP/1.1 client for talking to the BrushTalk server without touching the heap.
+// Requests are formatted into a fixed buffer, response headers are parsed in place and
+// only the few the firmware needs are kept, and the body is read straight from the
+// connection into the caller's buffer. Keep-alive connections are reused between requests.
+const size_t httpBufferSize = 512;       // Request line plus headers, then one response line at a time
+const size_t httpLocationSize = 96;
+const size_t httpAudioFormatSize = 32;
+const unsigned long httpTimeoutMs = 15000; // Longest silence while waiting for the server
+
+// Split serverURL into host, port and base path and prebuild the headers every request
+// carries. Call once at startup.
+bool httpBegin();
+
+// The server as httpBegin() found it, for connections other than plain requests
+const char *httpServerHost();
+uint16_t httpServerPort();
+const char *httpServerBasePath();
+
+// The response headers the firmware uses; everything else is skipped while parsing
+struct HttpResponse {
+    int status;                          // -1 if no response arrived
+    int32_t contentLength;               // -1 if not given
+    long uploadOffset;                   // Upload-Offset, -1 if not given
+    bool hasCrc;
+    uint32_t crc;                        // X-Content-CRC32
+    char location[httpLocationSize];     // Location, empty if not given
+    char audioFormat[httpAudioFormatSize]; // X-Audio-Format, empty if not given
+};
+
+class HttpConnection {
+public:
+    explicit HttpConnection(WiFiClient &client) : client(client) {}
+
+    // Start a request. The path is given in up to four parts, e.g. "/download/", device,
+    // "/", filename, and is appended to the server's base path.
+    void begin(const char *method, const char *path, const char *path2 = "", const char *path3 = "",
+               const char *path4 = "");
+    void header(const char *name, const char *value);
+    void header(const char *name, uint32_t value);
+
+    // Send the request line and headers, connecting first if needed. A body of
+    // bodyLength bytes follows with write().
+    bool send(size_t bodyLength = 0);
+    bool write(const uint8_t *data, size_t length);
+
+    // Wait for the status line and headers. Returns false if none arrived.
+    bool readResponse(HttpResponse &response);
+
+    // Read body bytes into buffer. Returns the count, 0 at the end of the body, or -1 if
+    // the server went quiet or the connection dropped.
+    int read(uint8_t *buffer, size_t size);
+
+    // Skip the rest of the body so the connection can carry the next request
+    void end();
+
+    // Send a request without a body and read its response headers in one go
+    int request(const char *method, HttpResponse &response, const char *path, const char *path2 = "",
+                const char *path3 = "", const char *path4 = "");
+
+private:
+    void append(const char *text);
+    bool readLine();
+    bool nextChunk();
+    void close();
+
+    WiFiClient &client;
+    char buffer[httpBufferSize];
+    size_t length = 0;
+    bool overflow = false;     // Request didn't fit; it is not sent
+    bool bodyMethod = false;   // POST, PUT or PATCH, which always announce a Content-Length
+    bool headRequest = false;
+    bool chunked = false;
+    bool keepAlive = true;
+    bool bodyDone = true;
+    int64_t bodyRemaining = 0; // Of the body, or of the current chunk; -1 until the connection closes
+};
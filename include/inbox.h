@@ -0,0 +1,35 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Downloaded messages are kept in this directory as <id>.wav, on flash or SD depending
+// on their size (see storage.h), and played in arrival order. A short one may instead be
+// held in RAM until it is played (see ram_message.h).
+const char *const inboxDir = "/inbox";
+const size_t inboxCapacity = 16;
+
+// Create the inbox directory and queue the messages left over from a previous boot.
+// Call after messageIndexBegin().
+bool inboxBegin();
+
+size_t inboxCount();
+bool inboxFull();
+
+// Id of the message at position index (0 is the oldest), or 0 if there is none
+uint32_t inboxMessageAt(size_t index);
+
+// Downloads go to a temporary path and are committed once complete, so a broken
+// download never shows up as a playable message. inboxReserveId returns 0 when the
+// message index is full.
+uint32_t inboxReserveId();
+String inboxTempPath(uint32_t id);
+String inboxAudioPath(uint32_t id);
+bool inboxCommit(uint32_t id, size_t size, uint32_t crc);
+void inboxDiscard(uint32_t id);
+
+// Delete the oldest message after it has been played
+void inboxRemoveOldest();
+
+// Move a message held in RAM to storage. Returns true once it is in storage, also if
+// it already was.
+bool inboxStore(uint32_t id);
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Live push-to-talk. While the record button is held, 20 ms frames of IMA ADPCM go out
+// over a WebSocket: straight to the peer's intercom server when it is on the LAN,
+// otherwise through the relay at wss://<server>/intercom/<device>, which every device
+// keeps open to hear about its peers and receive their frames. The receiver holds
+// frames in an adaptive jitter buffer, conceals lost ones and plays them out.
+#ifndef BRUSHTALK_INTERCOM_RELAY
+#define BRUSHTALK_INTERCOM_RELAY 1
+#endif
+
+const uint16_t intercomPort = 4712;          // ws://<device>:4712/intercom
+const uint32_t intercomSampleRate = 16000;
+const size_t intercomFrameSamples = 320;     // 20 ms, coded as one 164-byte ADPCM block
+const unsigned long intercomFrameMs = intercomFrameSamples * 1000 / intercomSampleRate;
+const size_t intercomJitterSlots = 16;
+const size_t intercomMinDepth = 2;           // Frames buffered before playout starts, at least...
+const size_t intercomMaxDepth = 10;          // ...and at most, however bad the jitter gets
+const unsigned long intercomSilenceMs = 400; // A stream with nothing arriving for this long is over
+const unsigned long intercomRelayRetryMs = 10000;
+
+// Start the LAN intercom server, the relay link and the network task. Call once the
+// device id and peers are known. outputDelayMs is how long a frame handed to the
+// output still takes to be heard; it is added to the latency measurements.
+void intercomBegin(unsigned long outputDelayMs);
+
+// Whether the peer to talk to (the first in devicePeers, or anyone on the route if that
+// is empty) is reachable live, on the LAN or through the relay
+bool intercomAvailable();
+
+// Talking: start a stream, send intercomFrameSamples at a time while the button is held,
+// then end it. Frames the network can't keep up with are dropped, never queued up.
+void intercomTalkBegin();
+void intercomSendFrame(const int16_t *samples);
+void intercomTalkEnd();
+
+// Listening: wait until a stream has buffered enough to start playing out
+bool intercomWaitForStream(TickType_t wait);
+
+// The next intercomFrameSamples of the stream, concealed if the frame is missing. Call
+// at the playout rate. Returns false once the stream is over.
+bool intercomNextFrame(int16_t *samples);
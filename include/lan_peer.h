@@ -0,0 +1,30 @@
+#pragma once
+
+#include <Arduino.h>
+#include <IPAddress.h>
+
+// Devices on the same network push messages to each other directly over TCP instead of
+// through the tunnel and server. They find each other with mDNS (_brushtalk._tcp, TXT
+// id=<device id>); the server is only used for peers that can't be reached this way.
+const uint16_t lanPeerPort = 4711;
+const size_t lanPeerCapacity = 8;
+const unsigned long lanPeerCacheMs = 5 * 60 * 1000; // Rediscover peers after this long
+const unsigned long lanPeerRetryMs = 30 * 1000;     // Minimum gap between lookups for a missing peer
+const uint32_t lanPeerConnectTimeoutMs = 1500;
+const unsigned long lanPeerReplyTimeoutMs = 10000;  // Receiver acknowledges once the file is on SD
+const size_t lanReceiveBufferBytes = 8192;          // Incoming bytes on their way to storage; at least one TCP window
+
+// Advertise this device and start accepting transfers. Call after wifiLinkBegin(); the
+// link needn't be up yet.
+void lanPeerBegin();
+
+// Push a stored message to a peer. Blocks until the peer has stored or refused it;
+// returns false if the peer isn't on the LAN or the transfer failed.
+bool lanPeerSend(const char *peerId, const char *filePath, const char *name, uint32_t crc);
+
+// Same for a message held in memory
+bool lanPeerSendBuffer(const char *peerId, const uint8_t *data, size_t size, const char *name, uint32_t crc);
+
+// Address of a peer's device on the LAN, from the discovery cache or a fresh mDNS query
+// (rate-limited like for transfers). Blocks for the length of the query at most.
+bool lanPeerAddress(const char *peerId, IPAddress &ip);
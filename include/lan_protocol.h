@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Wire format of a direct device-to-device transfer. All integers are little-endian:
+//   "BTLK" version(1) senderLength(1) sender nameLength(1) name size(4) crc32(4)
+// followed by size bytes of the message file. Once the file is stored or refused the
+// receiver answers with a single LanStatus byte.
+//
+// Plain C++ without Arduino dependencies, so the same code runs on the device and in
+// the host-native tool (tools/lan_peer_host.cpp).
+const uint8_t lanProtocolVersion = 1;
+const size_t lanMaxIdLength = 32;
+const size_t lanMaxNameLength = 64;
+const size_t lanMaxHeaderSize = 4 + 1 + 1 + lanMaxIdLength + 1 + lanMaxNameLength + 4 + 4;
+const uint32_t lanMaxMessageSize = 16 * 1024 * 1024;
+
+enum LanStatus : uint8_t {
+    LAN_STORED = 'S',         // Message is in the recipient's inbox
+    LAN_BAD_REQUEST = 'B',    // Malformed header
+    LAN_BUSY = 'F',           // Inbox full or another transfer in progress
+    LAN_CRC_MISMATCH = 'C',   // Body didn't match the announced CRC
+    LAN_STORAGE_ERROR = 'E',  // Recipient couldn't store the message
+    LAN_REFUSED = 'R',        // Sender isn't a peer of the recipient
+    LAN_PENDING = 0           // Transfer not finished yet
+};
+
+struct LanHeader {
+    char sender[lanMaxIdLength + 1];
+    char name[lanMaxNameLength + 1];
+    uint32_t size;
+    uint32_t crc;
+};
+
+// Serialize a header. Returns its length, or 0 if a field is too long.
+size_t lanEncodeHeader(const LanHeader &header, uint8_t *out, size_t capacity);
+
+// Where a receiver puts an incoming message
+class LanMessageSink {
+public:
+    virtual ~LanMessageSink() {}
+    // Return LAN_STORED to accept the message, anything else refuses it
+    virtual LanStatus begin(const LanHeader &header) = 0;
+    virtual bool write(const uint8_t *data, size_t length) = 0;
+    // complete is false if the connection dropped or the CRC didn't match; the sink
+    // discards what it has. Returns the status reported to the sender.
+    virtual LanStatus finish(bool complete) = 0;
+};
+
+// Incremental parser for one incoming transfer. Feed it whatever the socket delivers,
+// in pieces of any size; once done() the status byte is ready to send back.
+class LanReceiver {
+public:
+    explicit LanReceiver(LanMessageSink &sink);
+
+    // Consume received bytes. Returns how many were used; bytes after the body are ignored.
+    size_t feed(const uint8_t *data, size_t length);
+    bool done() const { return state == STATE_DONE; }
+    LanStatus status() const { return result; }
+    const LanHeader &header() const { return parsed; }
+
+    // The connection is gone; let the sink discard a partial message
+    void abort();
+
+private:
+    enum State { STATE_HEADER, STATE_BODY, STATE_DONE };
+
+    void complete(LanStatus status);
+
+    LanMessageSink &sink;
+    State state;
+    LanStatus result;
+    LanHeader parsed;
+    uint8_t headerBuffer[lanMaxHeaderSize];
+    size_t headerLength;
+    uint32_t bodyReceived;
+    uint32_t bodyCrc;
+};
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Integrated loudness after ITU-R BS.1770, measured while recording. Samples go through
+// the K-weighting filters (a high shelf for the head, then a high-pass) and their
+// energy is summed in 100 ms steps. Every 400 ms block, overlapping by 75%, goes into a
+// histogram of 0.1 LU bins. At the end the absolute gate at -70 LUFS and the relative
+// gate 10 LU below the absolute-gated loudness are applied to the histogram, so the
+// audio is never read twice and memory doesn't grow with the length.
+//
+// Plain C++ without Arduino dependencies, like the noise suppressor.
+
+const float loudnessTargetLufs = -18.0f;   // Level every message plays at, where its peak allows
+const float loudnessMaxGainDb = 18.0f;     // Most a quiet message is raised; more mostly lifts noise
+const float loudnessMinGainDb = -12.0f;
+const float loudnessPeakCeiling = 0.89f;   // -1 dBFS, the highest a raised peak may reach
+const float loudnessAbsoluteGateLufs = -70.0f;
+const float loudnessRelativeGateLu = -10.0f;
+const float loudnessHistogramTopLufs = 5.0f; // Above a full-scale square wave after K-weighting
+const size_t loudnessHistogramBins = 750;    // 0.1 LU each, from the absolute gate up
+
+// Fixed-point playback gain: samples are multiplied by gainQ12 / 4096
+const int32_t loudnessUnityGainQ12 = 4096;
+
+class LoudnessMeter {
+public:
+    void begin(uint32_t sampleRate);
+    void add(const int16_t *samples, size_t count);
+
+    // False if no 400 ms block got past the gates, e.g. for silence or a very short message
+    bool measured() const;
+
+    // Integrated loudness in LUFS. Only meaningful if measured().
+    float integratedLufs() const;
+
+    // Gain in dB that brings the recording to loudnessTargetLufs, limited so its peak stays
+    // below loudnessPeakCeiling. Zero if nothing was measured.
+    float playbackGainDb() const;
+
+    uint16_t peak() const { return samplePeak; }
+
+private:
+    struct Biquad {
+        float b0, b1, b2, a1, a2;
+        float z1, z2; // Transposed direct form II state
+
+        float run(float x) {
+            float y = b0 * x + z1;
+            z1 = b1 * x - a1 * y + z2;
+            z2 = b2 * x - a2 * y;
+            return y;
+        }
+    };
+
+    Biquad shelf;
+    Biquad highPass;
+    uint32_t stepSamples = 0;  // 100 ms
+    uint32_t stepPosition = 0;
+    float stepEnergy[4];       // Sums of squares of the last four steps, the current one at stepsDone % 4
+    uint32_t stepsDone = 0;
+    uint16_t samplePeak = 0;
+    uint16_t histogram[loudnessHistogramBins];
+};
+
+// Scale samples in place by gainQ12 / 4096, saturating at full scale
+void applyGainQ12(int16_t *samples, size_t count, int32_t gainQ12);
+
+// The Q12 factor for a gain in dB
+int32_t gainDbToQ12(float gainDb);
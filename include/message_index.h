@@ -0,0 +1,69 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "inbox.h"
+#include "outbox.h"
+
+// Persistent state of every message lives in one append-only file of fixed-size records.
+// A state change appends a new record; the last record for a message wins. At boot the
+// file is read once front to back, which replaces walking the inbox/outbox directories.
+const char *const messageIndexPath = "/index.bin";
+const char *const messageIndexTempPath = "/index.tmp";
+// Every queued message in both directions, plus the recording, the server download and
+// the LAN receive that can be in progress at once. New messages are refused beyond that.
+const size_t messageIndexCapacity = inboxCapacity + outboxCapacity + 3;
+
+enum MessageDirection : uint8_t {
+    MESSAGE_OUTBOUND = 1,
+    MESSAGE_INBOUND = 2
+};
+
+enum MessageState : uint8_t {
+    MESSAGE_RECORDING = 1,  // Outbound, capture in progress
+    MESSAGE_QUEUED = 2,     // Outbound, waiting for upload
+    MESSAGE_SENT = 3,       // Outbound, delivered (final)
+    MESSAGE_RECEIVING = 4,  // Inbound, download in progress
+    MESSAGE_UNPLAYED = 5,   // Inbound, waiting for playback
+    MESSAGE_PLAYED = 6,     // Inbound, played and deleted (final)
+    MESSAGE_DELETED = 7     // Dropped without delivery (final)
+};
+
+enum MessageCodec : uint8_t {
+    CODEC_PCM16 = 1,
+    CODEC_IMA_ADPCM = 2
+};
+
+struct MessageRecord {
+    uint16_t magic;
+    uint8_t direction;
+    uint8_t state;
+    uint32_t id;
+    uint32_t size;        // File size in bytes
+    uint32_t crc;         // CRC32 of the file, 0 if not known
+    uint32_t createdAt;   // Seconds since the epoch, or since boot if the clock isn't set
+    uint32_t updatedAt;
+    uint8_t codec;
+    uint8_t reserved;
+    uint16_t attempts;    // Upload attempts for outbound messages
+    uint32_t checksum;    // Over the preceding bytes, detects a torn final write
+};
+
+static_assert(sizeof(MessageRecord) == 32, "MessageRecord must stay 32 bytes");
+
+// Load the index (one sequential read) and compact it if it has grown too much
+bool messageIndexBegin();
+
+// Append a new version of a message record. createdAt is kept from the existing
+// record; updatedAt and the checksum are filled in here.
+bool messageIndexPut(MessageRecord record);
+
+// Same for a message that may not be in the index yet. Returns false, leaving the index
+// unchanged, when it already holds messageIndexCapacity live messages.
+bool messageIndexAdd(MessageRecord record);
+
+bool messageIndexGet(uint8_t direction, uint32_t id, MessageRecord &record);
+bool messageIndexSetState(uint8_t direction, uint32_t id, uint8_t state);
+
+// Ids of the live messages with the given direction and state, oldest first
+size_t messageIndexList(uint8_t direction, uint8_t state, uint32_t *ids, size_t maxIds);
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Counters, latency histograms and gauges, served as a Prometheus text page at
+// http://<device>/metrics. Updates are a few instructions under a spinlock, so they
+// can be called from any task.
+const uint16_t metricsPort = 80;
+// The whole page, about 11 KB with every value at its widest. A page that doesn't fit is
+// cut after its last whole line and counted in brushtalk_metrics_truncated_total.
+const size_t metricsPageSize = 12288;
+
+enum MetricCounter : uint8_t {
+    METRIC_BYTES_RECORDED,
+    METRIC_BYTES_UPLOADED,
+    METRIC_BYTES_DOWNLOADED,
+    METRIC_BYTES_PLAYED,
+    METRIC_UPLOADS_OK,
+    METRIC_UPLOADS_FAILED,
+    METRIC_DOWNLOADS_OK,
+    METRIC_DOWNLOADS_FAILED,
+    METRIC_I2S_RX_OVERRUNS,  // Samples lost because the recorder fell behind
+    METRIC_I2S_TX_UNDERRUNS, // DMA ran dry during playback
+    METRIC_LAN_SENT,
+    METRIC_LAN_RECEIVED,
+    METRIC_WIFI_FAST_CONNECTS,    // Joined the cached access point with the cached IP
+    METRIC_WIFI_FULL_CONNECTS,    // Needed a scan and DHCP
+    METRIC_WIFI_CONNECT_FAILURES,
+    METRIC_RAM_MESSAGES,           // Recorded or downloaded into a RAM slot instead of storage
+    METRIC_RAM_MESSAGES_PERSISTED, // Written to storage after all, because delivery failed
+    METRIC_INTERCOM_SENT,
+    METRIC_INTERCOM_DROPPED,   // Captured but not sent, because the link fell behind
+    METRIC_INTERCOM_RECEIVED,
+    METRIC_INTERCOM_LATE,      // Arrived after its playout time, or skipped to cut the delay
+    METRIC_INTERCOM_CONCEALED, // Missing at playout time and replaced
+    METRIC_NOISE_SUPPRESSION_CPU_US,   // Time spent suppressing noise,
+    METRIC_NOISE_SUPPRESSION_AUDIO_US, // and the length of the audio it covered
+    METRIC_CAPTURE_SAMPLES,            // Microphone samples taken for recordings and live talk
+    METRIC_CAPTURE_CLIPPED_SAMPLES,
+    METRIC_CAPTURE_CLIPPED,    // Recordings or live talks with each CaptureProblem
+    METRIC_CAPTURE_SILENT,
+    METRIC_CAPTURE_DEAD_MIC,
+    METRIC_CAPTURE_DC_OFFSET,
+    METRIC_METRICS_TRUNCATED,  // /metrics renders that didn't fit metricsPageSize
+    METRIC_COUNTER_COUNT
+};
+
+enum MetricStage : uint8_t {
+    STAGE_RECORD_FINALIZE, // Recording stopped -> message queued
+    STAGE_CHECK,           // /check round trip
+    STAGE_DOWNLOAD,        // One message, request to commit
+    STAGE_UPLOAD,          // One upload attempt
+    STAGE_PLAYBACK_START,  // Play button -> first samples handed to I2S
+    STAGE_WIFI_CONNECT,    // Connect attempt -> IP address
+    STAGE_INTERCOM,        // Intercom frame captured -> heard on the other device, if both clocks are set
+    STAGE_COUNT
+};
+
+void metricsAdd(MetricCounter counter, uint32_t amount = 1);
+void metricsObserve(MetricStage stage, uint32_t milliseconds);
+
+// Levels of the most recent recording or live talk, shown as gauges
+void metricsSetCaptureLevels(float rmsDbfs, float peakDbfs, int16_t dcOffset, uint32_t longestZeroRunMs);
+
+// Duration of one SD write; the page shows percentiles over the most recent writes
+void metricsObserveSdWrite(uint32_t microseconds);
+
+// Render the page into buffer. Returns the length, without the terminating zero.
+size_t metricsRender(char *buffer, size_t size);
+
+// Start the HTTP server. Call after wifiLinkBegin(); the link needn't be up yet.
+void metricsBegin();
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Spectral noise suppression for a microphone next to running water or an extractor fan.
+// The signal is cut into half-overlapping frames, windowed with a square-root Hann
+// window and transformed with a fixed-point FFT. Each bin is scaled by a Wiener gain
+// computed from a decision-directed a priori SNR against a running estimate of the
+// noise spectrum, then the frames are transformed back and overlap-added. The noise
+// estimate starts from the first frames, before anyone speaks, and then follows the bins
+// that carry no speech. Output lags input by one frame, two hops.
+//
+// Plain C++ without Arduino dependencies, so the same code runs on the device and in
+// the host reference (tools/noise_suppressor_host.cpp).
+#ifndef BRUSHTALK_NOISE_SUPPRESSION
+#define BRUSHTALK_NOISE_SUPPRESSION 1
+#endif
+
+const size_t noiseMaxFftSize = 1024;    // Two hops of 512 samples, 11.6 ms at 44.1 kHz
+const size_t noiseLearnFrames = 8;      // Frames averaged into the first noise estimate
+const float noiseGainFloor = 0.12f;     // About -18 dB; lower floors leave musical noise
+const float noiseDecisionWeight = 0.98f; // Weight of the previous frame in the a priori SNR
+const float noiseSpeechRatio = 4.0f;    // Bins this far above the noise estimate hold speech
+const float noiseTrackWeight = 0.1f;    // How fast bins without speech update the estimate
+const float noiseCreep = 1.005f;        // Per-hop rise of the estimate under speech, to catch up with louder noise
+
+class NoiseSuppressor {
+public:
+    // Reset for a new recording. The hop is the power of two closest to 10 ms at this rate.
+    void begin(uint32_t sampleRate);
+
+    // Suppress noise in place. Every sample is replaced by the output from latency()
+    // samples earlier, so the stream keeps its length.
+    void process(int16_t *samples, size_t count);
+
+    size_t hopSize() const { return hop; }
+    size_t latency() const { return fftSize; }
+
+private:
+    void processFrame();
+
+    size_t hop = 0;
+    size_t fftSize = 0;
+    unsigned fftBits = 0;
+    size_t position = 0;     // Samples of the current hop taken so far
+    uint32_t framesSeen = 0;
+    int16_t window[noiseMaxFftSize];             // Square-root Hann, Q15
+    int16_t input[noiseMaxFftSize];              // The previous hop, then the one being filled
+    int16_t output[noiseMaxFftSize / 2];         // Finished samples handed out during the next hop
+    int32_t overlap[noiseMaxFftSize / 2];        // Second half of the last frame, added to the next
+    int32_t spectrum[2 * noiseMaxFftSize];       // Interleaved re, im
+    float noisePower[noiseMaxFftSize / 2 + 1];
+    float cleanPower[noiseMaxFftSize / 2 + 1];   // Previous frame's gain^2 * power, for the a priori SNR
+};
+
+// In-place radix-2 FFT on interleaved re, im values with Q30 twiddles. Unscaled: a
+// forward transform of 16-bit samples grows by up to log2(size) bits, and the inverse
+// returns size times the signal. size is a power of two up to noiseMaxFftSize.
+void fixedFft(int32_t *data, size_t size, bool inverse);
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Recordings waiting for upload live in this directory as <id>.wav, on flash or SD by
+// size, with their state in the message index, so nothing is lost across failed uploads,
+// outages or reboots. A short recording is first sent from RAM and only lands here if
+// that fails, the link is down or it can't go out soon (see ram_message.h).
+const char *const outboxDir = "/outbox";
+const size_t outboxCapacity = 64;
+const size_t outboxRecipientsSize = 256; // Comma-separated peer ids a message still has to reach
+
+// Retry schedule for the background uploader: exponential backoff with full jitter
+const unsigned long outboxBackoffBaseMs = 2000;
+const unsigned long outboxBackoffCapMs = 5 * 60 * 1000;
+
+// A recording held in RAM that hasn't gone out this long after it was queued is written
+// to storage, so a reset can't lose it
+const unsigned long outboxRamHoldMs = 10000;
+
+// Create the outbox directory and queue the recordings left over from a previous boot.
+// Call after messageIndexBegin().
+bool outboxBegin();
+
+// Start the background task that drains the outbox whenever Wi-Fi is up
+void outboxStartUploader();
+
+// Reserve a new message id for a recording in the given MessageCodec; ids are persisted
+// so names stay unique across reboots. Returns 0 when the message index is full.
+uint32_t outboxReserveId(uint8_t codec);
+
+// Write where recording id is stored into path, which holds outboxPathSize bytes, and return it
+const size_t outboxPathSize = 32;
+char *outboxAudioPath(uint32_t id, char *path);
+
+// Hand a finished recording and its CRC32 to the uploader. Returns immediately.
+bool outboxEnqueue(uint32_t id, size_t size, uint32_t crc);
+
+size_t outboxPendingCount();
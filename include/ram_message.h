@@ -0,0 +1,44 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Short messages skip storage: a recording that fits is captured into a RAM slot and
+// uploaded from there, and a download that fits is received into one and played from
+// there. A message is only written to flash or SD when it can't be delivered from RAM,
+// i.e. the upload failed or it wasn't played before the next server check.
+// Slots are allocated once at boot from PSRAM, sized for a full-length recording in the
+// largest format. Boards without PSRAM have no slots: internal RAM can't spare room for
+// more than the smallest format, so every message goes through storage there.
+
+// One slot per direction, so a recording waiting for upload never blocks a download
+enum RamSlot : uint8_t {
+    RAM_OUTBOUND,
+    RAM_INBOUND,
+    RAM_SLOT_COUNT
+};
+
+struct RamMessage {
+    uint8_t *data;  // ramMessageCapacity() bytes
+    size_t length;  // Bytes of the message
+    uint32_t id;    // Message id, 0 while the slot is free
+};
+
+// Allocate the slots of slotBytes each. Call early in setup(), next to audioPoolBegin().
+bool ramMessageBegin(size_t slotBytes);
+
+// Largest message a slot holds, 0 if the slots couldn't be allocated
+size_t ramMessageCapacity();
+
+// Take the slot for message id of up to size bytes. NULL if it is in use or too small,
+// in which case the message goes to storage as usual.
+RamMessage *ramMessageClaim(RamSlot slot, uint32_t id, size_t size);
+
+// The slot holding message id, or NULL if the message is in storage
+RamMessage *ramMessageFind(RamSlot slot, uint32_t id);
+
+// Free the slot once its message was delivered or dropped; NULL is ignored
+void ramMessageRelease(RamMessage *message);
+
+// Write the message to path on the tier its size calls for and free the slot. On
+// failure the message stays in RAM.
+bool ramMessagePersist(RamMessage *message, const char *path);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "wav.h"
+
+// The recorder picks the format of each message from the uploader's goodput estimate,
+// so that uploading it is expected to take at most recordingUploadTargetMs. Candidates
+// run from pcm16-44100 down to ima-adpcm-8000; the server transcodes for receivers that
+// want something else.
+const unsigned long recordingUploadTargetMs = 10000;
+
+// Best format whose durationMs of audio uploads within the target at goodputKbps, or the
+// smallest if none does. A negative goodput (nothing measured yet) selects the best.
+WavInfo chooseRecordingFormat(unsigned long durationMs, float goodputKbps);
+
+// Expected file size of durationMs of audio in the given format, header included
+size_t recordingBytes(const WavInfo &format, unsigned long durationMs);
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+
+// How the SD card is wired. With BRUSHTALK_SD_MMC=1 the card sits on the SDMMC slot
+// pins (CLK 14, CMD 15, D0 2, D1 4, D2 12, D3 13) and 4-bit, then 1-bit mode are tried
+// before SPI. SPI uses the VSPI pins and the chip select passed to storageBegin(), at
+// the fastest clock up to BRUSHTALK_SD_SPI_MAX_MHZ that passes the probe.
+// GPIO 12 (D2) is a strapping pin: a pull-up on it keeps the chip from booting unless
+// the flash voltage is fixed with espefuse.py set_flash_voltage 3.3V.
+#ifndef BRUSHTALK_SD_MMC
+#define BRUSHTALK_SD_MMC 0
+#endif
+
+#ifndef BRUSHTALK_SD_SPI_MAX_MHZ
+#define BRUSHTALK_SD_SPI_MAX_MHZ 40
+#endif
+
+// Bytes written and read back to verify each bus setting and measure its throughput
+const size_t storageProbeBytes = 64 * 1024;
+const char *const storageProbePath = "/.probe";
+
+// Two tiers: the LittleFS partition in internal flash holds the message index, the
+// outbox notes and messages up to storageFlashMaxMessage; the SD card holds the rest.
+// Without a card everything goes to flash, so the device keeps working, just with less
+// room. Placement is decided once per file, when it is created.
+const size_t storageFlashMaxMessage = 128 * 1024;
+const size_t storageFlashReserve = 64 * 1024; // Kept free for the index and notes
+
+// The mounted tiers. One that isn't available has no backing filesystem, so every
+// operation on it fails.
+extern fs::FS flashStorage;
+extern fs::FS cardStorage;
+
+// Mount the flash partition, formatting it on first use, and probe the SD buses from
+// fastest to slowest, keeping the first that mounts and passes a write/read-back check.
+// Returns false only if neither tier is usable. Call after audioPoolBegin().
+bool storageBegin(uint8_t csPin);
+
+bool storageHasCard();
+
+// Tier for a new message file of about size bytes
+fs::FS &storageForSize(size_t size);
+
+// Tier that holds an existing file; flash is checked first since it is cheaper to ask
+fs::FS &storageHolding(const char *path);
+
+// Tier for the message index and other small state files
+fs::FS &storageForState();
+
+// Create a directory on every mounted tier
+bool storageMakeDir(const char *path);
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Outcome of one resumable upload, kept for logging and throughput tracking
+struct UploadStats {
+    size_t fileSize = 0;           // Size of the file being uploaded
+    size_t bytesSent = 0;          // Payload bytes put on the wire, including resent ones
+    size_t bytesAcknowledged = 0;  // Bytes the server confirmed during this call, not before it
+    uint32_t retries = 0;          // Failed requests that were retried
+    unsigned long elapsedMs = 0;   // Wall time from first request to completion
+    unsigned long transferMs = 0;  // The same without the pauses between retries
+    float goodputKbps = 0.0f;      // Acknowledged payload rate over transferMs in kbit/s
+};
+
+// Chunk size for PATCH requests. Larger chunks mean fewer round trips through the
+// tunnel, smaller ones mean less data to resend after a drop.
+const size_t uploadChunkSize = 32 * 1024;
+const uint32_t uploadMaxRetries = 8;
+
+// Rolling goodput estimate: upload attempts are folded in with this weight. One only
+// counts if it moved data, and a successful one only if it moved enough to say something
+// about bandwidth rather than round trips; a failed one that got some data through is
+// a sign of a poor link and always counts.
+const float uploadGoodputWeight = 0.3f;
+const size_t uploadEstimateMinBytes = 16 * 1024;
+
+// Upload a file using the server's resumable protocol (POST /uploads to create,
+// PATCH at Upload-Offset to append, HEAD to resync after a failure).
+// sessionLocation is the server path of the upload session ("/uploads/<id>") in a buffer
+// of httpLocationSize bytes. Pass an empty string to start a new session; on return it
+// holds the session used, so a later call can resume where this one stopped. fileCrc is
+// sent along so the server can verify the assembled file; pass 0 if it isn't known.
+// recipients is a comma-separated subset of the sender's route, or empty for all of them.
+bool uploadFileResumable(const char *filePath, const char *remoteName, const char *deviceType,
+                         const char *recipients, uint32_t fileCrc, UploadStats &stats, char *sessionLocation);
+
+// Same for a message held in memory; chunks are sent straight from data
+bool uploadBufferResumable(const uint8_t *data, size_t size, const char *remoteName, const char *deviceType,
+                           const char *recipients, uint32_t fileCrc, UploadStats &stats, char *sessionLocation);
+
+// Recent upload goodput in kbit/s, or -1 before the first upload attempt
+float uploadGoodputEstimateKbps();
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+
+const uint16_t wavFormatPcm = 0x0001;
+const uint16_t wavFormatImaAdpcm = 0x0011;
+
+// Capture statistics of a recording, kept in a 'qlty' chunk for support and the server
+struct WavQuality {
+    uint32_t sampleCount;
+    uint32_t clippedSamples;
+    uint32_t longestZeroRunMs;
+    uint16_t peak;            // Largest magnitude
+    int16_t dcOffset;         // Mean sample value
+    int16_t rmsCentiDbfs;     // RMS level in 0.01 dBFS
+    uint16_t problems;        // CaptureProblem bits
+};
+
+struct WavInfo {
+    uint16_t format;          // wavFormatPcm or wavFormatImaAdpcm
+    uint16_t channels;
+    uint32_t sampleRate;
+    uint16_t bitsPerSample;
+    uint16_t blockAlign;      // Bytes per ADPCM block, or per sample frame for PCM
+    uint16_t samplesPerBlock; // ADPCM only
+    uint32_t dataSize;        // Bytes of audio data
+    bool hasLoudness;         // Whether the file has a loud chunk, or should get one
+    int16_t loudnessCentiLufs; // Integrated loudness measured at record time, in 0.01 LUFS
+    int16_t gainCentiDb;      // Gain that plays the message at the target level, in 0.01 dB
+    uint32_t trailerSize;     // Bytes of chunks after the audio data, counted in the RIFF size
+    bool hasQuality;          // Write a qlty chunk; not read back on the device
+    WavQuality quality;
+};
+
+// Longest header wavWriteHeader() produces: RIFF, fmt with the ADPCM extension, fact,
+// loud, qlty, data
+const size_t wavMaxHeaderBytes = 100;
+
+// Mono 16-bit PCM, or IMA ADPCM with the block size the server's encoder uses
+WavInfo wavPcm16Format(uint32_t sampleRate);
+WavInfo wavImaAdpcmFormat(uint32_t sampleRate);
+
+// Bytes of audio data per second
+uint32_t wavBytesPerSecond(const WavInfo &info);
+
+// Write the header for info, including info.dataSize, into out. Returns its length,
+// which depends only on the format, so a placeholder can be rewritten in place once
+// the size is known.
+size_t wavWriteHeader(const WavInfo &info, uint8_t *out);
+
+// Write a chunk that follows the audio data into out, with the pad byte an odd-sized
+// data chunk needs before it. The body may already lie in out, wavTrailingChunkOffset
+// bytes in, and is moved into place. Returns the chunk's length.
+const size_t wavTrailingChunkOffset = 9;
+size_t wavWriteTrailingChunk(const WavInfo &info, const char *tag, const uint8_t *body, uint32_t bodySize, uint8_t *out);
+
+// Walk the RIFF chunks and leave the file positioned at the first audio byte.
+// Returns false if the file is not a WAV file with a data chunk.
+bool wavReadHeader(File &file, WavInfo &info);
+
+// Same for a message held in memory; dataOffset is set to its first audio byte
+bool wavReadHeader(const uint8_t *data, size_t length, WavInfo &info, size_t &dataOffset);
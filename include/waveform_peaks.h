@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Min/max summary of a recording for previews: one pair of 8-bit values per
+// peakIntervalMs, gathered in the capture loop and stored in a 'peak' chunk after the
+// audio data, so the server can hand out a waveform and the duration for about a
+// kilobyte. When the points run out, neighbours are merged and the interval doubles,
+// so a recording of any length fits.
+//
+// Chunk body, little-endian: sample count (u32), sample rate (u32), interval in ms (u16),
+// point count (u16), then min and max as int8 for every point.
+const uint16_t peakIntervalMs = 10;
+const size_t peakMaxPoints = 512; // 5.12 s at 10 ms
+const size_t peakHeaderBytes = 12;
+
+// Largest chunk WaveformPeaks::write() produces, with its chunk header and a pad byte
+// before it; the full points plus one started point
+const size_t peakMaxChunkBytes = 1 + 8 + peakHeaderBytes + 2 * (peakMaxPoints + 1);
+
+class WaveformPeaks {
+public:
+    void begin(uint32_t sampleRate);
+    void add(const int16_t *samples, size_t count);
+
+    // Write the chunk body, including the last point if it was started. Returns its length.
+    size_t write(uint8_t *out) const;
+
+private:
+    void finishPoint();
+
+    uint32_t rate = 0;
+    uint32_t sampleCount = 0;
+    uint32_t samplesPerPoint = 0;
+    uint32_t pointPosition = 0; // Samples in the point being gathered
+    uint16_t intervalMs = peakIntervalMs;
+    size_t points = 0;
+    int16_t pointMin = 0;
+    int16_t pointMax = 0;
+    int8_t minimum[peakMaxPoints];
+    int8_t maximum[peakMaxPoints];
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiClient.h>
+
+// Minimal RFC 6455 client for the intercom: one connection, small unfragmented messages.
+// Frames are masked as the protocol requires and written straight to the connection;
+// incoming messages are read into the caller's buffer. Pings are answered in poll().
+const unsigned long webSocketTimeoutMs = 5000; // Handshake, and the rest of a frame once it started
+
+class WebSocketClient {
+public:
+    explicit WebSocketClient(WiFiClient &client) : client(client) {}
+
+    // Connect and upgrade. path includes any base path of the server.
+    bool connect(const char *host, uint16_t port, const char *path);
+    bool connect(IPAddress ip, uint16_t port, const char *path);
+    bool connected();
+    void close();
+
+    bool sendBinary(const uint8_t *data, size_t length);
+    bool sendText(const char *text);
+
+    // Read one message if one is waiting. Returns its length, 0 if there is none (or it
+    // didn't fit and was skipped), -1 once the connection is gone.
+    int poll(uint8_t *buffer, size_t size, bool &binary);
+
+private:
+    bool handshake(const char *host, const char *path);
+    bool sendFrame(uint8_t opcode, const uint8_t *data, size_t length);
+    bool readExactly(uint8_t *data, size_t length);
+    bool skip(size_t length);
+
+    WiFiClient &client;
+};
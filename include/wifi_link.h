@@ -0,0 +1,15 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Wi-Fi connection kept up by a background supervisor. The access point (BSSID, channel)
+// and IP settings of the last good connection are cached in RTC memory and NVS, so a
+// reconnect joins that access point directly with a static IP instead of scanning and
+// waiting for DHCP. If that fails the supervisor falls back to a full connect.
+const unsigned long wifiFastConnectTimeoutMs = 1500;
+const unsigned long wifiFullConnectTimeoutMs = 20000;
+const unsigned long wifiRetryCapMs = 60000; // Longest pause between failed attempts
+
+// Bring up the network stack and start the supervisor task, which connects right away
+// and reconnects whenever the link drops. Call before starting any server.
+void wifiLinkBegin(const char *ssid, const char *password);
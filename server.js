@@ -1,9 +1,67 @@
 const express = require('express');
 const path = require('path');
 const fs = require('fs');
+const fsp = fs.promises;
+const crypto = require('crypto');
+const { pipeline, Transform } = require('stream');
+const audio = require('./server/audio');
+const intercom = require('./server/intercom');
 
 const app = express();
-const port = 80; // Port number to listen on
+const port = process.env.PORT || 80; // Port number to listen on
+const uploadsDir = process.env.BRUSHTALK_UPLOADS_DIR || path.join(__dirname, 'uploads');
+const routesPath = process.env.BRUSHTALK_ROUTES || path.join(__dirname, 'routes.json');
+
+// CRC-32 (IEEE, same as zlib) so stored files can be checked against what the device recorded
+const crc32Table = new Int32Array(256).map((_, i) => {
+    let value = i;
+    for (let bit = 0; bit < 8; bit++) {
+        value = (value & 1) ? (value >>> 1) ^ 0xEDB88320 : value >>> 1;
+    }
+    return value;
+});
+
+const crc32Update = (crc, buffer) => {
+    crc = ~crc;
+    for (let i = 0; i < buffer.length; i++) {
+        crc = crc32Table[(crc ^ buffer[i]) & 0xFF] ^ (crc >>> 8);
+    }
+    return (~crc) >>> 0;
+};
+
+const crc32Hex = (crc) => crc.toString(16).padStart(8, '0');
+
+const crc32File = (filePath) => new Promise((resolve, reject) => {
+    let crc = 0;
+    fs.createReadStream(filePath)
+        .on('data', (chunk) => { crc = crc32Update(crc, chunk); })
+        .on('end', () => resolve(crc))
+        .on('error', reject);
+});
+
+// Passes at most limit bytes through and reports each accepted block. Sits between the
+// request and the file in a pipeline, so backpressure from the disk pauses the socket.
+const createByteLimiter = (limit, onBytes) => new Transform({
+    transform(chunk, encoding, callback) {
+        const accepted = chunk.length > limit ? chunk.subarray(0, limit) : chunk;
+        limit -= accepted.length;
+        onBytes(accepted);
+        callback(null, accepted);
+    }
+});
+
+// Flush a file or directory to stable storage
+const fsyncPath = async (filePath) => {
+    const handle = await fsp.open(filePath, 'r');
+    try {
+        await handle.sync();
+    } finally {
+        await handle.close();
+    }
+};
+
+// Inbox files from before the blob store kept their CRC in a hidden sidecar
+const crcSidecarPath = (filePath) => path.join(path.dirname(filePath), `.${path.basename(filePath)}.crc32`);
 
 // Ensure the uploads directory and device-specific directories exist
 const ensureDirectoryExists = (dir) => {
@@ -12,122 +70,921 @@ const ensureDirectoryExists = (dir) => {
     }
 };
 
-const device1Dir = path.join(__dirname, 'uploads', 'device1');
-const device2Dir = path.join(__dirname, 'uploads', 'device2');
-ensureDirectoryExists(device1Dir);
-ensureDirectoryExists(device2Dir);
+ensureDirectoryExists(uploadsDir);
 
-// Serve static files from the uploads directory
-app.use('/files', express.static('uploads'));
+// Device ids double as directory names, so keep them to a safe character set
+const isValidDeviceId = (device) => typeof device === 'string' && /^[A-Za-z0-9_-]{1,32}$/.test(device);
 
-// Endpoint to check for new audio files
-app.get('/check/:device', (req, res) => {
-    const device = req.params.device;
-    const deviceDir = device === 'device1' ? device1Dir : device2Dir;
+// Routing table: sender -> Set of recipients, loaded from routes.json, e.g.
+//   { "bathroom": ["kitchen", "kids"], "kitchen": ["bathroom"] }
+// Without a routes file the original device1 <-> device2 pair is used.
+const loadRoutes = () => {
+    let table = { device1: ['device2'], device2: ['device1'] };
+    if (fs.existsSync(routesPath)) {
+        table = JSON.parse(fs.readFileSync(routesPath, 'utf8'));
+    }
+    const routes = new Map();
+    for (const [sender, recipients] of Object.entries(table)) {
+        const valid = recipients.filter(isValidDeviceId);
+        if (!isValidDeviceId(sender) || valid.length !== recipients.length) {
+            throw new Error(`Invalid device id in routes for ${sender}`);
+        }
+        routes.set(sender, new Set(valid));
+    }
+    console.log(`Loaded routes for ${routes.size} sender(s).`);
+    return routes;
+};
+
+const routes = loadRoutes();
+
+// The recipients of a message: the sender's full route, or the subset of it the device
+// asked for in X-Recipients. Names outside the route are ignored.
+const resolveRecipients = (sender, requested) => {
+    const allowed = routes.get(sender);
+    if (!allowed) {
+        return [];
+    }
+    const names = (requested || '').split(',').map(name => name.trim()).filter(name => name.length > 0);
+    if (names.length === 0) {
+        return [...allowed];
+    }
+    return names.filter(name => allowed.has(name));
+};
+
+// Every device has its own inbox directory, created the first time a message is routed to it
+const inboxDirFor = (device) => path.join(uploadsDir, device);
+const createdInboxDirs = new Set();
+
+const ensureInboxDir = async (device) => {
+    if (!createdInboxDirs.has(device)) {
+        await fsp.mkdir(inboxDirFor(device), { recursive: true });
+        createdInboxDirs.add(device);
+    }
+};
+
+// Resumable uploads are assembled here and only moved into a device directory once complete
+const partialDir = path.join(uploadsDir, '.partial');
+ensureDirectoryExists(partialDir);
+
+// In-memory message index: recipient -> Map(filename -> { blob, size, crc, mtimeMs }). Maps keep
+// insertion order, which is arrival order, so /check never touches the filesystem.
+// The listing body is cached per device and rebuilt only when that device's entries change.
+const messageIndex = new Map();
+const listingCache = new Map();
+const noEntries = new Map();
+
+const inboxEntries = (device) => messageIndex.get(device) || noEntries;
+
+const indexAdd = (device, filename, entry) => {
+    let entries = messageIndex.get(device);
+    if (!entries) {
+        entries = new Map();
+        messageIndex.set(device, entries);
+    }
+    entries.delete(filename); // Re-uploads move to the end
+    entries.set(filename, entry);
+    listingCache.delete(device);
+};
+
+const indexRemove = (device, filename) => {
+    if (inboxEntries(device).delete(filename)) {
+        listingCache.delete(device);
+    }
+};
+
+const indexListing = (device) => {
+    let listing = listingCache.get(device);
+    if (listing === undefined) {
+        listing = [...inboxEntries(device).keys()].join('\n');
+        if (messageIndex.has(device)) {
+            listingCache.set(device, listing);
+        }
+    }
+    return listing;
+};
+
+// Message bodies are stored once under their SHA-256, however many recipients they have.
+// Inbox entries are small <filename>.ref files naming the blob, and a blob is deleted
+// when the last entry referencing it has been acknowledged.
+const blobsDir = path.join(uploadsDir, '.blobs');
+ensureDirectoryExists(blobsDir);
+
+const blobPath = (hash) => path.join(blobsDir, hash);
+const refPath = (device, filename) => path.join(inboxDirFor(device), `${filename}.ref`);
+
+// hash -> { size, crc, refs, info, variants, stored }. info is the parsed WAV header, read on
+// first download; variants maps a format name to the { size, crc } of its cached transcode;
+// stored settles once a newly published body is in place.
+const blobs = new Map();
+
+// hash -> promise of a released blob's files being removed
+const blobRemovals = new Map();
+
+const newBlob = (size, crc) => ({ size, crc, refs: 0, info: undefined, variants: new Map() });
+
+// Transcodes of a blob into the formats devices asked for, <hash>.<format>.wav
+const variantsDir = path.join(uploadsDir, '.variants');
+ensureDirectoryExists(variantsDir);
+
+const variantPath = (hash, format) => path.join(variantsDir, `${hash}.${format}.wav`);
+
+// Waveform previews of blobs, <hash>.peaks
+const peaksDir = path.join(uploadsDir, '.peaks');
+ensureDirectoryExists(peaksDir);
+
+const peaksPath = (hash) => path.join(peaksDir, `${hash}.peaks`);
+
+const sha256File = (filePath) => new Promise((resolve, reject) => {
+    const hash = crypto.createHash('sha256');
+    fs.createReadStream(filePath)
+        .on('data', (chunk) => hash.update(chunk))
+        .on('end', () => resolve(hash.digest('hex')))
+        .on('error', reject);
+});
+
+// Write a small file so it is either absent or complete, even across a crash
+const writeFileAtomic = async (filePath, data) => {
+    const tempPath = path.join(path.dirname(filePath), `.${path.basename(filePath)}.tmp`);
+    const handle = await fsp.open(tempPath, 'w');
+    try {
+        await handle.writeFile(data);
+        await handle.sync();
+    } finally {
+        await handle.close();
+    }
+    await fsp.rename(tempPath, filePath);
+};
+
+// Find a chunk anywhere in a WAV file, also after the audio data, reading only the
+// chunk headers on the way. Returns null if it is missing or larger than maxBytes.
+const readWavChunk = async (filePath, id, maxBytes) => {
+    const handle = await fsp.open(filePath, 'r');
+    try {
+        const { size } = await handle.stat();
+        const header = Buffer.alloc(12);
+        await handle.read(header, 0, 12, 0);
+        if (header.toString('ascii', 0, 4) !== 'RIFF' || header.toString('ascii', 8, 12) !== 'WAVE') {
+            return null;
+        }
+        let offset = 12;
+        while (offset + 8 <= size) {
+            await handle.read(header, 0, 8, offset);
+            const length = header.readUInt32LE(4);
+            if (header.toString('ascii', 0, 4) === id) {
+                if (length > maxBytes || offset + 8 + length > size) {
+                    return null;
+                }
+                const body = Buffer.alloc(length);
+                await handle.read(body, 0, length, offset + 8);
+                return body;
+            }
+            offset += 8 + length + (length & 1);
+        }
+        return null;
+    } finally {
+        await handle.close();
+    }
+};
 
+// Keep the waveform preview a recorder appended to the audio next to the blob. A file
+// without one gets it computed on the first request instead.
+const storePeaks = async (hash) => {
     try {
-        // Read files from the directory and filter out .DS_Store and other hidden files
-        const files = fs.readdirSync(deviceDir).filter(file => !file.startsWith('.'));
+        const body = await readWavChunk(blobPath(hash), 'peak', audio.peakMaxBytes);
+        if (body && audio.isValidPeaks(body)) {
+            await writeFileAtomic(peaksPath(hash), body);
+        }
+    } catch (error) {
+        console.error(`Failed to store the waveform preview of ${hash.slice(0, 12)}:`, error);
+    }
+};
 
-        console.log(`Checking for new audio files in ${deviceDir}...`);
-        console.log('Available files:', files);
+// Capture statistics a recorder put into the message; a broken microphone shows up in the
+// log as soon as its recording arrives
+const readQuality = async (hash) => audio.parseQuality(await readWavChunk(blobPath(hash), 'qlty', 64));
 
-        if (files.length > 0) {
-            console.log('New audio file(s) found.');
-            res.status(200).send('New audio file(s) found.');
-        } else {
-            console.log('No new audio files found.');
-            res.status(404).send('No new audio files found.');
+const checkQuality = async (hash) => {
+    try {
+        const quality = await readQuality(hash);
+        if (quality && quality.problems.length > 0) {
+            console.warn(`Message ${hash.slice(0, 12)} has capture problems: ${quality.problems.join(', ')} ` +
+                `(RMS ${quality.rmsDbfs} dBFS, peak ${quality.peak}, ${quality.clippedSamples} clipped, ` +
+                `DC offset ${quality.dcOffset}, zero run ${quality.longestZeroRunMs} ms)`);
         }
     } catch (error) {
-        console.error('Error checking for new audio files:', error);
-        res.status(500).send('Error checking for new audio files.');
+        console.error(`Failed to read the capture statistics of ${hash.slice(0, 12)}:`, error);
     }
-});   
+};
 
+// Move a complete file into the blob store, or drop it if the same content is already
+// there. The caller gets `references` references to the blob. They are taken as soon as
+// the hash is known, so a release while the rest is awaited can't free the blob.
+const storeBlob = async (tempPath, size, crc, references) => {
+    const hash = await sha256File(tempPath);
+    const existing = blobs.get(hash);
+    if (existing) {
+        existing.refs += references;
+        await fsp.rm(tempPath, { force: true });
+        await existing.stored;
+        return hash;
+    }
 
-// Endpoint to handle file upload
-app.post('/upload', (req, res) => {
+    const blob = newBlob(size, crc);
+    blob.refs = references;
+    blob.stored = (async () => {
+        await blobRemovals.get(hash); // Same content whose last recipient just let go
+        await fsyncPath(tempPath);
+        await fsp.rename(tempPath, blobPath(hash));
+        await fsyncPath(blobsDir);
+    })();
+    blobs.set(hash, blob);
     try {
-        console.log('Received upload request');
-        console.log('Headers:', req.headers);
-        console.log('Content-Type:', req.get('Content-Type'));
+        await blob.stored;
+    } catch (error) {
+        blobs.delete(hash);
+        throw error;
+    }
+    await storePeaks(hash);
+    await checkQuality(hash);
+    return hash;
+};
 
-        const contentType = req.get('Content-Type');
-        const deviceType = req.get('X-Device-Type') || 'device1';
-        const filename = req.get('X-Filename') || 'default_audio.wav'; // Extract filename from header
+const removeBlobFiles = async (hash, blob) => {
+    await fsp.rm(blobPath(hash), { force: true });
+    for (const format of blob.variants.keys()) {
+        await fsp.rm(variantPath(hash, format), { force: true });
+    }
+    await fsp.rm(peaksPath(hash), { force: true });
+};
 
-        const deviceDir = deviceType === 'device1' ? device1Dir : device2Dir;
+const releaseBlob = async (hash) => {
+    const blob = blobs.get(hash);
+    if (blob && --blob.refs <= 0) {
+        blobs.delete(hash);
+        const removal = removeBlobFiles(hash, blob);
+        const settled = removal.catch(() => {});
+        blobRemovals.set(hash, settled);
+        try {
+            await removal;
+        } finally {
+            if (blobRemovals.get(hash) === settled) {
+                blobRemovals.delete(hash);
+            }
+        }
+        console.log(`Blob ${hash.slice(0, 12)} released by its last recipient`);
+    }
+};
 
-        const filePath = path.join(deviceDir, filename); // Save file with the provided filename
-        const fileStream = fs.createWriteStream(filePath);
+// Point an inbox entry at a stored blob, replacing an older entry of the same name. The
+// entry takes over a reference the caller already holds; that happens before anything is
+// awaited.
+const addInboxEntry = async (device, filename, hash, mtimeMs = Date.now()) => {
+    const blob = blobs.get(hash);
+    const previous = inboxEntries(device).get(filename);
+    indexAdd(device, filename, { blob: hash, size: blob.size, crc: blob.crc, mtimeMs });
+    if (previous) {
+        await releaseBlob(previous.blob);
+    }
+};
 
-        let totalBytesWritten = 0;
+// A name already waiting in the inbox with other content means the sender reused its
+// message ids, e.g. after a reflash; the new message gets a free name instead of
+// replacing the unplayed one
+const freeInboxName = (device, filename, hash) => {
+    const entries = inboxEntries(device);
+    const { name, ext } = path.parse(filename);
+    let candidate = filename;
+    for (let n = 2; entries.has(candidate) && entries.get(candidate).blob !== hash; n++) {
+        candidate = `${name}-${n}${ext}`;
+    }
+    if (candidate !== filename) {
+        console.log(`${device} already has a different ${filename}, storing the new message as ${candidate}`);
+    }
+    return candidate;
+};
 
-        req.on('data', (chunk) => {
-            totalBytesWritten += chunk.length;
-            fileStream.write(chunk);
-        });
+// Make a fully written temp file visible in the inbox of every recipient. The body is
+// fsync'd and renamed into the blob store first and each ref is written atomically, so
+// /check and /download only ever see complete messages.
+const publishFile = async (tempPath, recipients, filename, size, crc) => {
+    const hash = await storeBlob(tempPath, size, crc, recipients.length);
+    const entry = JSON.stringify({ blob: hash, size, crc });
+    let unused = recipients.length;
+    try {
+        for (const recipient of recipients) {
+            const name = freeInboxName(recipient, filename, hash);
+            await ensureInboxDir(recipient);
+            await writeFileAtomic(refPath(recipient, name), entry);
+            await fsyncPath(inboxDirFor(recipient));
+            unused--;
+            await addInboxEntry(recipient, name, hash);
+        }
+    } finally {
+        // References of recipients whose ref could not be written
+        for (; unused > 0; unused--) {
+            await releaseBlob(hash);
+        }
+    }
+    return hash;
+};
+
+// Read one inbox entry, converting a plain audio file from before the blob store
+const loadInboxEntry = async (device, file) => {
+    const filePath = path.join(inboxDirFor(device), file);
+    const stat = await fsp.stat(filePath);
+    if (file.endsWith('.ref')) {
+        const { blob, size, crc } = JSON.parse(await fsp.readFile(filePath, 'utf8'));
+        return { filename: file.slice(0, -'.ref'.length), blob, size, crc, mtimeMs: stat.mtimeMs };
+    }
+
+    const crc = await fsp.readFile(crcSidecarPath(filePath), 'utf8').catch(() => null) || crc32Hex(await crc32File(filePath));
+    const blob = await sha256File(filePath);
+    if (!blobs.has(blob)) {
+        blobs.set(blob, newBlob(stat.size, crc));
+        await fsp.rename(filePath, blobPath(blob));
+    } else {
+        await fsp.unlink(filePath);
+    }
+    await writeFileAtomic(refPath(device, file), JSON.stringify({ blob, size: stat.size, crc }));
+    await fsp.rm(crcSidecarPath(filePath), { force: true });
+    return { filename: file, blob, size: stat.size, crc, mtimeMs: stat.mtimeMs };
+};
+
+// Rebuild the index from disk once at startup, oldest file first. Every visible
+// directory under uploads is the inbox of one device. Reference counts are recounted
+// from the inbox entries, and blobs nobody references (a crash mid-publish) are removed.
+const rebuildMessageIndex = async () => {
+    for (const file of await fsp.readdir(blobsDir)) {
+        const stat = await fsp.stat(blobPath(file));
+        blobs.set(file, newBlob(stat.size, null));
+    }
 
-        req.on('end', () => {
-            fileStream.end();
-            console.log(`File uploaded successfully: ${filePath}`);
+    const dirs = await fsp.readdir(uploadsDir, { withFileTypes: true });
+    for (const dir of dirs) {
+        if (!dir.isDirectory() || !isValidDeviceId(dir.name)) {
+            continue;
+        }
+        const device = dir.name;
+        createdInboxDirs.add(device);
+        messageIndex.set(device, new Map());
+        const files = await fsp.readdir(inboxDirFor(device));
+        const found = [];
+        for (const file of files) {
+            if (file.startsWith('.')) {
+                if (file.endsWith('.tmp')) {
+                    await fsp.rm(path.join(inboxDirFor(device), file), { force: true }); // Unfinished ref
+                }
+                continue;
+            }
+            const entry = await loadInboxEntry(device, file);
+            if (!blobs.has(entry.blob)) {
+                console.error(`Dropping ${device}/${entry.filename}, its body is missing.`);
+                await fsp.rm(refPath(device, entry.filename), { force: true });
+                continue;
+            }
+            blobs.get(entry.blob).crc = entry.crc;
+            found.push(entry);
+        }
+        found.sort((a, b) => a.mtimeMs - b.mtimeMs);
+        for (const { filename, blob, mtimeMs } of found) {
+            blobs.get(blob).refs++;
+            await addInboxEntry(device, filename, blob, mtimeMs);
+        }
+        console.log(`Indexed ${found.length} message(s) for ${device}.`);
+    }
+
+    for (const [hash, blob] of blobs) {
+        if (blob.refs === 0) {
+            blobs.delete(hash);
+            await fsp.rm(blobPath(hash), { force: true });
+        }
+    }
+
+    // Cached transcodes of live blobs are kept; their CRC is recomputed on first use
+    for (const file of await fsp.readdir(variantsDir)) {
+        const [hash, format] = file.split('.');
+        const blob = blobs.get(hash);
+        if (blob && file === `${hash}.${format}.wav`) {
+            blob.variants.set(format, { size: (await fsp.stat(variantPath(hash, format))).size, crc: null });
+        } else {
+            await fsp.rm(path.join(variantsDir, file), { force: true });
+        }
+    }
+    for (const file of await fsp.readdir(peaksDir)) {
+        if (!blobs.has(path.basename(file, '.peaks'))) {
+            await fsp.rm(path.join(peaksDir, file), { force: true });
+        }
+    }
+    console.log(`Blob store holds ${blobs.size} message(s).`);
+};
+
+// Format negotiation: a device lists the formats it can play in X-Accept-Formats, most
+// preferred first, and gets the smallest of them. Each (message, format) pair is
+// transcoded once and cached next to the blob.
+const transcodesInFlight = new Map();
+
+const blobInfo = async (hash) => {
+    const blob = blobs.get(hash);
+    if (blob.info === undefined) {
+        const handle = await fsp.open(blobPath(hash), 'r');
+        try {
+            const { buffer, bytesRead } = await handle.read(Buffer.alloc(4096), 0, 4096, 0);
+            blob.info = audio.parseWav(buffer.subarray(0, bytesRead));
+        } finally {
+            await handle.close();
+        }
+    }
+    return blob.info;
+};
+
+// The format to serve: null for the stored file as is, undefined if none is acceptable.
+// Formats above the source rate are skipped, upsampling only adds bytes.
+const chooseFormat = (acceptHeader, info) => {
+    if (!acceptHeader || !info) {
+        return null;
+    }
+    const candidates = acceptHeader.split(',')
+        .map(audio.parseFormat)
+        .filter(format => format && (format.name === info.format || format.rate <= info.sampleRate));
+    if (candidates.length === 0) {
+        return undefined;
+    }
+    const smallest = candidates.reduce((best, format) =>
+        audio.bytesPerSecond(format) < audio.bytesPerSecond(best) ? format : best);
+    return smallest.name === info.format ? null : smallest;
+};
+
+const getVariant = async (hash, format) => {
+    const blob = blobs.get(hash);
+    const cached = blob.variants.get(format.name);
+    if (cached) {
+        if (cached.crc === null) {
+            cached.crc = crc32Hex(await crc32File(variantPath(hash, format.name)));
+        }
+        return cached;
+    }
+
+    // Concurrent requests for the same variant share one transcode
+    const key = `${hash}.${format.name}`;
+    if (!transcodesInFlight.has(key)) {
+        const transcode = (async () => {
+            const startTime = Date.now();
+            const source = await fsp.readFile(blobPath(hash));
+            const output = audio.transcode(source, audio.parseWav(source), format);
+            await writeFileAtomic(variantPath(hash, format.name), output);
+            const variant = { size: output.length, crc: crc32Hex(crc32Update(0, output)) };
+            if (blobs.get(hash) === blob) {
+                blob.variants.set(format.name, variant);
+            } else {
+                await fsp.rm(variantPath(hash, format.name), { force: true }); // Released meanwhile
+            }
+            console.log(`Transcoded ${hash.slice(0, 12)} to ${format.name}: ${source.length} -> ${output.length} bytes in ${Date.now() - startTime} ms`);
+            return variant;
+        })();
+        transcodesInFlight.set(key, transcode.finally(() => transcodesInFlight.delete(key)));
+    }
+    return transcodesInFlight.get(key);
+};
+
+// Upload sessions by id. session.offset tracks the bytes written to the partial file, so
+// a session survives dropped connections; at startup it is restored from the file size.
+const uploadSessions = new Map();
+
+const sessionDataPath = (id) => path.join(partialDir, `${id}.part`);
+const sessionMetaPath = (id) => path.join(partialDir, `${id}.json`);
+
+// Completed sessions are remembered for a day so a device whose final PATCH response got
+// lost learns from HEAD that the upload is done instead of uploading the file again.
+const completedSessionTtlMs = 24 * 60 * 60 * 1000;
+
+// An unfinished upload nobody resumed for this long is given up, so devices that never
+// come back don't leave their partial files behind for good
+const idleSessionTtlMs = 7 * 24 * 60 * 60 * 1000;
+const sessionSweepIntervalMs = 60 * 60 * 1000;
+
+// Bring offset and CRC in line with what actually reached the disk, e.g. after a chunk
+// broke off with data still buffered or the server died mid-chunk
+const syncSessionWithDisk = async (session) => {
+    const size = (await fsp.stat(sessionDataPath(session.id))).size;
+    session.offset = size;
+    if (session.crcOffset !== size) {
+        session.crc = await crc32File(sessionDataPath(session.id));
+        session.crcOffset = size;
+    }
+};
+
+const loadUploadSessions = async () => {
+    for (const file of await fsp.readdir(partialDir)) {
+        if (file.endsWith('.tmp')) {
+            // Single-request upload that never finished
+            await fsp.rm(path.join(partialDir, file), { force: true });
+            continue;
+        }
+        if (!file.endsWith('.json')) {
+            continue;
+        }
+        try {
+            const session = JSON.parse(await fsp.readFile(path.join(partialDir, file), 'utf8'));
+            if (session.completedAt && Date.now() - session.completedAt > completedSessionTtlMs) {
+                await fsp.unlink(path.join(partialDir, file));
+                continue;
+            }
+            if (!session.recipients) {
+                session.recipients = resolveRecipients(session.deviceType); // Sessions from before routing
+            }
+            if (session.completedAt) {
+                session.offset = session.length;
+            } else {
+                await syncSessionWithDisk(session);
+            }
+            uploadSessions.set(session.id, session);
+        } catch (error) {
+            console.error(`Ignoring unreadable upload session ${file}:`, error);
+        }
+    }
+    console.log(`Restored ${uploadSessions.size} upload session(s).`);
+};
+
+// Only the persistent fields; offset and the busy flag are runtime state
+const saveSession = (session) => {
+    const { offset, busy, ...persistent } = session;
+    return fsp.writeFile(sessionMetaPath(session.id), JSON.stringify(persistent));
+};
+
+const discardSession = async (session) => {
+    uploadSessions.delete(session.id);
+    await fsp.rm(sessionDataPath(session.id), { force: true });
+    await fsp.rm(sessionMetaPath(session.id), { force: true });
+};
+
+// Forget sessions past their TTL, with their data and metadata files
+const sweepUploadSessions = async () => {
+    const now = Date.now();
+    for (const session of [...uploadSessions.values()]) {
+        const expired = session.completedAt
+            ? now - session.completedAt > completedSessionTtlMs
+            : !session.busy && now - (session.updatedAt || session.createdAt) > idleSessionTtlMs;
+        if (!expired) {
+            continue;
+        }
+        try {
+            await discardSession(session);
+            console.log(`Expired ${session.completedAt ? 'completed' : 'abandoned'} upload session ${session.id}`);
+        } catch (error) {
+            console.error(`Failed to expire upload session ${session.id}:`, error);
+        }
+    }
+};
+
+// Move a finished upload into its recipients' inboxes and mark the session as completed.
+// Returns false if the assembled file doesn't match the CRC the device announced.
+const completeUpload = async (session) => {
+    if (session.expectedCrc && session.expectedCrc !== crc32Hex(session.crc)) {
+        console.error(`CRC mismatch for upload ${session.id}: expected ${session.expectedCrc}, got ${crc32Hex(session.crc)}`);
+        await discardSession(session);
+        return false;
+    }
+    await publishFile(sessionDataPath(session.id), session.recipients, session.filename,
+        session.length, crc32Hex(session.crc));
+    session.completedAt = Date.now();
+    await saveSession(session);
+    console.log(`Resumable upload ${session.id} from ${session.deviceType} completed for ${session.recipients.join(', ')}`);
+    return true;
+};
+
+// Serve static files from the uploads directory
+app.use('/files', express.static(uploadsDir));
+
+// Endpoint to check for new audio files, answered from the in-memory index
+app.get('/check/:device', (req, res) => {
+    const listing = indexListing(req.params.device);
+
+    if (listing.length > 0) {
+        // One file name per line, oldest first, so the device can fetch all of them in one session
+        res.status(200).type('text/plain').send(listing);
+    } else {
+        res.status(404).send('No new audio files found.');
+    }
+});
+
+// Endpoint to handle file upload
+app.post('/upload', (req, res) => {
+    console.log('Received upload request');
+    console.log('Headers:', req.headers);
+    console.log('Content-Type:', req.get('Content-Type'));
+
+    const deviceType = req.get('X-Device-Type') || 'device1';
+    const filename = path.basename(req.get('X-Filename') || 'default_audio.wav'); // Extract filename from header
+    const recipients = resolveRecipients(deviceType, req.get('X-Recipients'));
+    if (recipients.length === 0) {
+        console.log(`No route for sender ${deviceType}`);
+        res.status(403).send('No recipients for this device.');
+        return;
+    }
+
+    // Written to a temp file with backpressure and published only once complete
+    const tempPath = path.join(partialDir, `upload-${crypto.randomBytes(8).toString('hex')}.tmp`);
+    let totalBytesWritten = 0;
+    let crc = 0;
+    const counter = createByteLimiter(Infinity, (bytes) => {
+        totalBytesWritten += bytes.length;
+        crc = crc32Update(crc, bytes);
+    });
+
+    pipeline(req, counter, fs.createWriteStream(tempPath), async (err) => {
+        try {
+            if (err) {
+                console.error('Error during file upload:', err);
+                await fsp.rm(tempPath, { force: true });
+                if (!res.headersSent) {
+                    res.status(500).send('Error during file upload');
+                }
+                return;
+            }
+            await publishFile(tempPath, recipients, filename, totalBytesWritten, crc32Hex(crc));
+            console.log(`File uploaded successfully: ${filename} for ${recipients.join(', ')}`);
             console.log(`Total bytes written: ${totalBytesWritten}`);
             res.status(200).send(`File uploaded successfully as ${filename}`);
-        });
+        } catch (error) {
+            console.error('Error processing upload:', error);
+            await fsp.rm(tempPath, { force: true }).catch(() => {});
+            res.status(500).send('Error processing upload');
+        }
+    });
+});
 
-        req.on('error', (err) => {
-            console.error('Error during file upload:', err);
-            res.status(500).send('Error during file upload');
-        });
+// Resumable upload, step 1: create a session for a file of Upload-Length bytes
+app.post('/uploads', async (req, res) => {
+    const uploadLength = parseInt(req.get('Upload-Length'), 10);
+    if (!Number.isSafeInteger(uploadLength) || uploadLength <= 0) {
+        res.status(400).send('Missing or invalid Upload-Length header.');
+        return;
+    }
+
+    const deviceType = req.get('X-Device-Type') || 'device1';
+    const recipients = resolveRecipients(deviceType, req.get('X-Recipients'));
+    if (recipients.length === 0) {
+        console.log(`No route for sender ${deviceType}`);
+        res.status(403).send('No recipients for this device.');
+        return;
+    }
+
+    const session = {
+        id: crypto.randomBytes(8).toString('hex'),
+        length: uploadLength,
+        deviceType,
+        recipients,
+        filename: path.basename(req.get('X-Filename') || 'default_audio.wav'),
+        expectedCrc: (req.get('X-Content-CRC32') || '').toLowerCase() || null,
+        crc: 0,
+        crcOffset: 0,
+        createdAt: Date.now(),
+        updatedAt: Date.now(),
+        offset: 0
+    };
+
+    try {
+        await fsp.writeFile(sessionDataPath(session.id), Buffer.alloc(0));
+        await saveSession(session);
     } catch (error) {
-        console.error('Error processing upload:', error);
-        res.status(500).send('Error processing upload');
+        console.error('Error creating upload session:', error);
+        res.status(500).send('Error creating upload session.');
+        return;
     }
+    uploadSessions.set(session.id, session);
+
+    console.log(`Created upload session ${session.id} for ${session.filename} (${uploadLength} bytes)`);
+    res.set('Location', `/uploads/${session.id}`);
+    res.set('Upload-Offset', '0');
+    res.status(201).end();
 });
 
-// Endpoint to handle file download and deletion after download
-app.get('/download/:device/:filename', (req, res) => {
-    const device = req.params.device;
-    const filename = req.params.filename;
+// Resumable upload, step 2 (after a failure): ask how many bytes the server already has
+app.head('/uploads/:id', (req, res) => {
+    const session = uploadSessions.get(req.params.id);
+    if (!session) {
+        res.status(404).end();
+        return;
+    }
+    res.set('Cache-Control', 'no-store');
+    res.set('Upload-Offset', String(session.offset));
+    res.set('Upload-Length', String(session.length));
+    res.status(200).end();
+});
+
+// Resumable upload, step 3: append a chunk that starts exactly at Upload-Offset
+app.patch('/uploads/:id', (req, res) => {
+    const session = uploadSessions.get(req.params.id);
+    if (!session) {
+        res.status(404).send('Unknown upload session.');
+        return;
+    }
 
-    // Determine the correct directory based on the device parameter
-    const deviceDir = device === 'device1' ? device1Dir : device2Dir;
-    
-    // Construct the correct file path
-    const filePath = path.join(deviceDir, filename);
+    // A retry of the last chunk whose response got lost. The part file is already
+    // published and gone; reopening it would start the upload over.
+    if (session.completedAt) {
+        res.set('Upload-Offset', String(session.length));
+        res.status(204).end();
+        return;
+    }
+
+    const offset = session.offset;
+    const clientOffset = parseInt(req.get('Upload-Offset'), 10);
+    if (clientOffset !== offset || session.busy) {
+        console.log(`Offset mismatch for ${session.id}: client ${clientOffset}, server ${offset}`);
+        res.set('Upload-Offset', String(offset));
+        res.status(409).send('Upload-Offset does not match the server offset.');
+        return;
+    }
 
-    console.log('Received download request');
-    console.log('Requested file:', filename);
-    console.log('File path:', filePath);
+    const chunkLength = parseInt(req.get('Content-Length'), 10);
+    if (Number.isSafeInteger(chunkLength) && offset + chunkLength > session.length) {
+        res.status(413).send('Chunk exceeds Upload-Length.');
+        return;
+    }
+
+    // Bytes are appended as they arrive, so even an interrupted chunk advances the offset.
+    // The pipeline pauses the request whenever the file stream's buffer is full.
+    session.busy = true;
+    session.updatedAt = Date.now();
+    const limiter = createByteLimiter(session.length - offset, (bytes) => {
+        // CRC over the bytes as they arrive, so completion needs no second pass over the file
+        session.crc = crc32Update(session.crc, bytes);
+        session.crcOffset += bytes.length;
+    });
+
+    pipeline(req, limiter, fs.createWriteStream(sessionDataPath(session.id), { flags: 'a' }), async (err) => {
+        try {
+            await syncSessionWithDisk(session);
+            session.busy = false;
+            await saveSession(session);
 
-    if (fs.existsSync(filePath)) {
-        console.log('File found, sending...');
-        res.sendFile(filePath, (err) => {
             if (err) {
-                console.error('Failed to send file:', err);
-                res.status(500).send('Failed to send file.');
-            } else {
-                console.log('File sent successfully:', filePath);
-
-                // Optionally, delete the file after sending it
-                fs.unlink(filePath, (unlinkErr) => {
-                    if (unlinkErr) {
-                        console.error('Failed to delete file after download:', unlinkErr);
-                    } else {
-                        console.log('File deleted after download:', filePath);
-                    }
-                });
+                console.log(`Chunk for ${session.id} interrupted at offset ${session.offset}: ${err.message}`);
+                if (!res.headersSent) {
+                    res.set('Upload-Offset', String(session.offset));
+                    res.status(400).send('Chunk interrupted.');
+                }
+                return;
             }
-        });
-    } else {
-        console.log('File not found:', filePath);
+
+            if (session.offset >= session.length && !(await completeUpload(session))) {
+                res.status(422).send('CRC32 mismatch, upload discarded.');
+                return;
+            }
+            res.set('Upload-Offset', String(session.offset));
+            res.status(204).end();
+        } catch (error) {
+            session.busy = false;
+            console.error(`Error completing upload ${session.id}:`, error);
+            if (!res.headersSent) {
+                res.status(500).send('Error completing upload.');
+            }
+        }
+    });
+});
+
+// Endpoint to handle file download from a device's own inbox. The file stays until the
+// device acknowledges it with a DELETE, so a download that breaks off can simply be repeated.
+app.get('/download/:device/:filename', async (req, res) => {
+    const device = req.params.device;
+    const filename = path.basename(req.params.filename);
+    const entry = inboxEntries(device).get(filename);
+
+    console.log(`Download request for ${device}/${filename}`);
+
+    if (!entry) {
+        console.log('File not found:', filename);
+        res.status(404).send('File not found.');
+        return;
+    }
+
+    let filePath = blobPath(entry.blob);
+    let size = entry.size;
+    let crc = entry.crc;
+    let formatName = null;
+    try {
+        const info = await blobInfo(entry.blob);
+        const format = chooseFormat(req.get('X-Accept-Formats'), info);
+        if (format === undefined) {
+            res.status(406).send(`Available as ${info.format || 'unknown format'} only.`);
+            return;
+        }
+        if (format) {
+            const variant = await getVariant(entry.blob, format);
+            filePath = variantPath(entry.blob, format.name);
+            size = variant.size;
+            crc = variant.crc;
+        }
+        formatName = format ? format.name : info && info.format;
+    } catch (error) {
+        console.error(`Failed to prepare ${device}/${filename}:`, error);
+        res.status(500).send('Failed to prepare file.');
+        return;
+    }
+
+    res.set('Content-Type', 'audio/wav');
+    res.set('Content-Length', String(size));
+    if (crc) {
+        // Lets the device verify the download while it streams
+        res.set('X-Content-CRC32', crc);
+    }
+    if (formatName) {
+        res.set('X-Audio-Format', formatName);
+    }
+
+    const fileStream = fs.createReadStream(filePath);
+    fileStream.on('error', (err) => {
+        console.error('Failed to send file:', err);
+        if (!res.headersSent) {
+            res.status(500).send('Failed to send file.');
+        } else {
+            res.destroy();
+        }
+    });
+    fileStream.on('end', () => console.log('File sent successfully:', filePath));
+    fileStream.pipe(res);
+});
+
+// Waveform preview of a message in a device's inbox, in the layout of the 'peak' chunk
+// (see server/audio.js): a few hundred bytes to draw it and show its length, instead of
+// the whole file. Capture problems the recorder noted come along in X-Capture-Problems.
+// Doesn't count as a download.
+app.get('/peaks/:device/:filename', async (req, res) => {
+    const entry = inboxEntries(req.params.device).get(path.basename(req.params.filename));
+    if (!entry) {
         res.status(404).send('File not found.');
+        return;
+    }
+
+    try {
+        let body = await fsp.readFile(peaksPath(entry.blob)).catch((error) => {
+            if (error.code === 'ENOENT') {
+                return null;
+            }
+            throw error;
+        });
+        if (!body) {
+            const source = await fsp.readFile(blobPath(entry.blob));
+            const info = audio.parseWav(source);
+            if (!info) {
+                res.status(415).send('Not a WAV file this server can decode.');
+                return;
+            }
+            body = audio.computePeaks(source, info);
+            if (blobs.has(entry.blob)) {
+                await writeFileAtomic(peaksPath(entry.blob), body);
+            }
+        }
+        const quality = await readQuality(entry.blob);
+        if (quality) {
+            res.set('X-Capture-Problems', quality.problems.join(',') || 'none');
+        }
+        res.set('Content-Type', 'application/octet-stream');
+        res.set('X-Duration-Ms', String(Math.round(body.readUInt32LE(0) * 1000 / body.readUInt32LE(4))));
+        res.send(body);
+    } catch (error) {
+        console.error(`Failed to prepare the waveform of ${req.params.device}/${req.params.filename}:`, error);
+        res.status(500).send('Failed to prepare waveform.');
     }
 });
 
+// Endpoint the device calls once a downloaded file is safely stored. Removes this
+// device's inbox entry; the body goes once every recipient has acknowledged it.
+app.delete('/download/:device/:filename', async (req, res) => {
+    const device = req.params.device;
+    const filename = path.basename(req.params.filename);
+    const entry = inboxEntries(device).get(filename);
+
+    if (!entry) {
+        res.status(404).send('Failed to delete file.');
+        return;
+    }
+    indexRemove(device, filename);
 
-app.listen(port, () => {
-    console.log(`Server running on http://localhost:${port}`);
+    try {
+        await fsp.unlink(refPath(device, filename));
+        await releaseBlob(entry.blob);
+        console.log(`File acknowledged by ${device}: ${filename}`);
+        res.status(200).send('File deleted.');
+    } catch (unlinkErr) {
+        console.error('Failed to delete file after download:', unlinkErr);
+        res.status(500).send('Failed to delete file.');
+    }
 });
 
+// Start serving only once the index reflects what is on disk
+Promise.all([rebuildMessageIndex(), loadUploadSessions()])
+    .then(() => {
+        const server = app.listen(port, () => {
+            console.log(`Server running on http://localhost:${port}`);
+        });
+        // Live push-to-talk shares the port, on WebSocket upgrades at /intercom/<device>
+        intercom.attachIntercomRelay(server, routes, isValidDeviceId);
+        sweepUploadSessions();
+        setInterval(sweepUploadSessions, sessionSweepIntervalMs).unref();
+    })
+    .catch((error) => {
+        console.error('Failed to load message index:', error);
+        process.exit(1);
+    });
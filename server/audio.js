@@ -0,0 +1,313 @@
+// WAV parsing and transcoding for format negotiation. Formats are named <codec>-<rate>,
+// e.g. pcm16-44100 or ima-adpcm-16000, always mono.
+
+const WAVE_FORMAT_PCM = 0x0001;
+const WAVE_FORMAT_IMA_ADPCM = 0x0011;
+
+const imaStepTable = [
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+];
+const imaIndexTable = [-1, -1, -1, -1, 2, 4, 6, 8];
+
+const clamp = (value, low, high) => Math.min(high, Math.max(low, value));
+
+const parseFormat = (name) => {
+    const match = /^(pcm16|ima-adpcm)-(\d{4,5})$/.exec(name.trim().toLowerCase());
+    if (!match) {
+        return null;
+    }
+    const rate = parseInt(match[2], 10);
+    if (rate < 8000 || rate > 48000) {
+        return null;
+    }
+    return { name: `${match[1]}-${rate}`, codec: match[1], rate };
+};
+
+// Approximate size per second of audio, used to pick the smallest acceptable variant
+const bytesPerSecond = (format) => format.codec === 'pcm16' ? format.rate * 2 : format.rate / 2 + 8;
+
+// Chunks recorders put before the audio data, kept through transcoding: 'loud' with the
+// measured loudness and playback gain, 'qlty' with the capture statistics
+const metadataChunkIds = ['loud', 'qlty'];
+
+// Walk the RIFF chunks. Returns null for anything that isn't a WAV file we can decode.
+const parseWav = (buffer) => {
+    if (buffer.length < 12 || buffer.toString('ascii', 0, 4) !== 'RIFF' || buffer.toString('ascii', 8, 12) !== 'WAVE') {
+        return null;
+    }
+    let info = null;
+    const metadata = [];
+    let offset = 12;
+    while (offset + 8 <= buffer.length) {
+        const id = buffer.toString('ascii', offset, offset + 4);
+        const size = buffer.readUInt32LE(offset + 4);
+        const body = offset + 8;
+        if (id === 'fmt ' && body + 16 <= buffer.length) {
+            info = {
+                formatTag: buffer.readUInt16LE(body),
+                channels: buffer.readUInt16LE(body + 2),
+                sampleRate: buffer.readUInt32LE(body + 4),
+                blockAlign: buffer.readUInt16LE(body + 12),
+                bitsPerSample: buffer.readUInt16LE(body + 14),
+                samplesPerBlock: size >= 20 && body + 20 <= buffer.length ? buffer.readUInt16LE(body + 18) : 0
+            };
+        } else if (metadataChunkIds.includes(id) && body + size <= buffer.length) {
+            metadata.push([id, Buffer.from(buffer.subarray(body, body + size))]);
+        } else if (id === 'data' && info) {
+            info.dataOffset = body;
+            info.dataSize = Math.min(size, buffer.length - body);
+            break;
+        }
+        offset = body + size + (size & 1);
+    }
+    if (!info || info.dataOffset === undefined) {
+        return null;
+    }
+    info.metadata = metadata;
+
+    if (info.formatTag === WAVE_FORMAT_PCM && info.bitsPerSample === 16) {
+        info.codec = 'pcm16';
+    } else if (info.formatTag === WAVE_FORMAT_IMA_ADPCM && info.bitsPerSample === 4 && info.channels === 1) {
+        info.codec = 'ima-adpcm';
+    } else {
+        return null;
+    }
+    // Only mono files have a format name; stereo PCM can still be transcoded
+    info.format = info.channels === 1 ? `${info.codec}-${info.sampleRate}` : null;
+    return info;
+};
+
+const decodeImaAdpcm = (buffer, info) => {
+    const samplesPerBlock = info.samplesPerBlock || (info.blockAlign - 4) * 2 + 1;
+    const blocks = Math.ceil(info.dataSize / info.blockAlign);
+    const samples = new Int16Array(blocks * samplesPerBlock);
+    let count = 0;
+    for (let block = 0; block < blocks; block++) {
+        const start = info.dataOffset + block * info.blockAlign;
+        const end = Math.min(start + info.blockAlign, info.dataOffset + info.dataSize);
+        if (end - start < 4) {
+            break;
+        }
+        let predictor = buffer.readInt16LE(start);
+        let index = clamp(buffer[start + 2], 0, 88);
+        samples[count++] = predictor;
+        for (let i = start + 4; i < end; i++) {
+            for (const nibble of [buffer[i] & 0x0F, buffer[i] >> 4]) {
+                const step = imaStepTable[index];
+                let delta = step >> 3;
+                if (nibble & 4) delta += step;
+                if (nibble & 2) delta += step >> 1;
+                if (nibble & 1) delta += step >> 2;
+                predictor = clamp(predictor + ((nibble & 8) ? -delta : delta), -32768, 32767);
+                index = clamp(index + imaIndexTable[nibble & 7], 0, 88);
+                samples[count++] = predictor;
+            }
+        }
+    }
+    return samples.subarray(0, count);
+};
+
+// Mono 16-bit samples of any supported input, stereo mixed down
+const decodeToPcm = (buffer, info) => {
+    if (info.codec === 'ima-adpcm') {
+        return decodeImaAdpcm(buffer, info);
+    }
+    const frames = Math.floor(info.dataSize / (2 * info.channels));
+    const samples = new Int16Array(frames);
+    for (let frame = 0; frame < frames; frame++) {
+        let sum = 0;
+        for (let channel = 0; channel < info.channels; channel++) {
+            sum += buffer.readInt16LE(info.dataOffset + (frame * info.channels + channel) * 2);
+        }
+        samples[frame] = Math.round(sum / info.channels);
+    }
+    return samples;
+};
+
+// Band-limited resampling with a Blackman-windowed sinc, cut off just below the lower
+// of the two Nyquist frequencies so downsampling doesn't alias
+const resample = (input, sourceRate, targetRate) => {
+    if (sourceRate === targetRate) {
+        return input;
+    }
+    const step = sourceRate / targetRate;
+    const cutoff = Math.min(1, targetRate / sourceRate) * 0.92;
+    const halfWidth = Math.ceil(8 / cutoff); // Eight zero crossings either side
+    const output = new Int16Array(Math.floor(input.length / step));
+    for (let i = 0; i < output.length; i++) {
+        const center = i * step;
+        const first = Math.max(0, Math.floor(center) - halfWidth + 1);
+        const last = Math.min(input.length - 1, Math.floor(center) + halfWidth);
+        let sum = 0;
+        let weights = 0;
+        for (let k = first; k <= last; k++) {
+            const t = center - k;
+            const x = Math.PI * cutoff * t;
+            const sinc = x === 0 ? 1 : Math.sin(x) / x;
+            const window = 0.42 + 0.5 * Math.cos(Math.PI * t / halfWidth) + 0.08 * Math.cos(2 * Math.PI * t / halfWidth);
+            const weight = sinc * window;
+            sum += input[k] * weight;
+            weights += weight;
+        }
+        output[i] = clamp(Math.round(sum / weights), -32768, 32767);
+    }
+    return output;
+};
+
+const writeRiff = (fmt, extraChunks, data) => {
+    const chunks = [['fmt ', fmt], ...extraChunks, ['data', data]];
+    const size = 4 + chunks.reduce((total, [, body]) => total + 8 + body.length + (body.length & 1), 0);
+    const header = Buffer.alloc(12);
+    header.write('RIFF', 0, 'ascii');
+    header.writeUInt32LE(size, 4);
+    header.write('WAVE', 8, 'ascii');
+    const parts = [header];
+    for (const [id, body] of chunks) {
+        const chunkHeader = Buffer.alloc(8);
+        chunkHeader.write(id, 0, 'ascii');
+        chunkHeader.writeUInt32LE(body.length, 4);
+        parts.push(chunkHeader, body);
+        if (body.length & 1) {
+            parts.push(Buffer.alloc(1));
+        }
+    }
+    return Buffer.concat(parts);
+};
+
+const encodePcm16Wav = (samples, rate, extraChunks = []) => {
+    const fmt = Buffer.alloc(16);
+    fmt.writeUInt16LE(WAVE_FORMAT_PCM, 0);
+    fmt.writeUInt16LE(1, 2);
+    fmt.writeUInt32LE(rate, 4);
+    fmt.writeUInt32LE(rate * 2, 8);
+    fmt.writeUInt16LE(2, 12);
+    fmt.writeUInt16LE(16, 14);
+    const data = Buffer.from(samples.buffer, samples.byteOffset, samples.length * 2);
+    return writeRiff(fmt, extraChunks, data);
+};
+
+// Standard WAV IMA ADPCM. Blocks stay small enough to decode into the device's playback
+// buffer of 1024 samples.
+const encodeImaAdpcmWav = (samples, rate, extraChunks = []) => {
+    const blockAlign = rate <= 11025 ? 256 : 512;
+    const samplesPerBlock = (blockAlign - 4) * 2 + 1;
+    const blocks = [];
+    let index = 0;
+    for (let start = 0; start < samples.length; start += samplesPerBlock) {
+        const count = Math.min(samplesPerBlock, samples.length - start);
+        const block = Buffer.alloc(4 + Math.ceil((count - 1) / 2));
+        let predictor = samples[start];
+        block.writeInt16LE(predictor, 0);
+        block[2] = index;
+        for (let i = 1; i < count; i++) {
+            let diff = samples[start + i] - predictor;
+            let nibble = 0;
+            if (diff < 0) {
+                nibble = 8;
+                diff = -diff;
+            }
+            let step = imaStepTable[index];
+            let delta = step >> 3;
+            if (diff >= step) { nibble |= 4; diff -= step; delta += step; }
+            step >>= 1;
+            if (diff >= step) { nibble |= 2; diff -= step; delta += step; }
+            step >>= 1;
+            if (diff >= step) { nibble |= 1; delta += step; }
+            predictor = clamp(predictor + ((nibble & 8) ? -delta : delta), -32768, 32767);
+            index = clamp(index + imaIndexTable[nibble & 7], 0, 88);
+            const byte = 4 + ((i - 1) >> 1);
+            block[byte] |= (i - 1) & 1 ? nibble << 4 : nibble;
+        }
+        blocks.push(block);
+    }
+
+    const fmt = Buffer.alloc(20);
+    fmt.writeUInt16LE(WAVE_FORMAT_IMA_ADPCM, 0);
+    fmt.writeUInt16LE(1, 2);
+    fmt.writeUInt32LE(rate, 4);
+    fmt.writeUInt32LE(Math.round(rate * blockAlign / samplesPerBlock), 8);
+    fmt.writeUInt16LE(blockAlign, 12);
+    fmt.writeUInt16LE(4, 14);
+    fmt.writeUInt16LE(2, 16);
+    fmt.writeUInt16LE(samplesPerBlock, 18);
+    const fact = Buffer.alloc(4);
+    fact.writeUInt32LE(samples.length, 0);
+    return writeRiff(fmt, [['fact', fact], ...extraChunks], Buffer.concat(blocks));
+};
+
+// Waveform previews, laid out like the 'peak' chunk recorders append after the audio:
+// sample count (u32), sample rate (u32), interval in ms (u16), point count (u16), then an
+// int8 min and max per point. The interval doubles until the points fit.
+const peakIntervalMs = 10;
+const peakMaxPoints = 512;
+const peakHeaderBytes = 12;
+const peakMaxBytes = peakHeaderBytes + 2 * (peakMaxPoints + 1);
+
+const isValidPeaks = (body) => body.length >= peakHeaderBytes && body.readUInt32LE(4) > 0 &&
+    body.length === peakHeaderBytes + 2 * body.readUInt16LE(10);
+
+// For files that came without a preview
+const computePeaks = (buffer, info) => {
+    const samples = decodeToPcm(buffer, info);
+    let scale = 1;
+    const baseSamples = Math.max(1, Math.floor(info.sampleRate * peakIntervalMs / 1000));
+    while (Math.ceil(samples.length / (baseSamples * scale)) > peakMaxPoints) {
+        scale *= 2;
+    }
+    const perPoint = baseSamples * scale;
+    const points = Math.ceil(samples.length / perPoint);
+    const body = Buffer.alloc(peakHeaderBytes + 2 * points);
+    body.writeUInt32LE(samples.length, 0);
+    body.writeUInt32LE(info.sampleRate, 4);
+    body.writeUInt16LE(peakIntervalMs * scale, 8);
+    body.writeUInt16LE(points, 10);
+    for (let point = 0; point < points; point++) {
+        let low = 32767;
+        let high = -32768;
+        for (let i = point * perPoint; i < Math.min(samples.length, (point + 1) * perPoint); i++) {
+            low = Math.min(low, samples[i]);
+            high = Math.max(high, samples[i]);
+        }
+        // Top byte, rounded outwards like the recorder does
+        body.writeInt8(low >> 8, peakHeaderBytes + 2 * point);
+        body.writeInt8(Math.min(127, (high + 255) >> 8), peakHeaderBytes + 2 * point + 1);
+    }
+    return body;
+};
+
+// Capture statistics from a 'qlty' chunk body: sample count, clipped samples, longest run
+// of zeros in ms (u32 each), peak (u16), DC offset (i16), RMS in 0.01 dBFS (i16), problem bits (u16)
+const captureProblemNames = ['clipped', 'silent', 'dead-mic', 'dc-offset'];
+
+const parseQuality = (body) => {
+    if (!body || body.length < 20) {
+        return null;
+    }
+    const problems = body.readUInt16LE(18);
+    return {
+        samples: body.readUInt32LE(0),
+        clippedSamples: body.readUInt32LE(4),
+        longestZeroRunMs: body.readUInt32LE(8),
+        peak: body.readUInt16LE(12),
+        dcOffset: body.readInt16LE(14),
+        rmsDbfs: body.readInt16LE(16) / 100,
+        problems: captureProblemNames.filter((name, bit) => problems & (1 << bit))
+    };
+};
+
+// Convert a parsed WAV file to the given format
+const transcode = (buffer, info, format) => {
+    const samples = resample(decodeToPcm(buffer, info), info.sampleRate, format.rate);
+    const extraChunks = info.metadata || [];
+    return format.codec === 'pcm16'
+        ? encodePcm16Wav(samples, format.rate, extraChunks)
+        : encodeImaAdpcmWav(samples, format.rate, extraChunks);
+};
+
+module.exports = { parseFormat, parseWav, bytesPerSecond, transcode, peakMaxBytes, isValidPeaks, computePeaks,
+    parseQuality };
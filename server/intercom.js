@@ -0,0 +1,193 @@
+// Live push-to-talk relay. Every device keeps a WebSocket open at /intercom/<device>;
+// binary frames from a talking device are passed on as they are to the recipients on its
+// route that are connected. Nothing is stored or queued for long: a recipient that falls
+// behind loses frames, which its jitter buffer conceals. Text messages:
+//   device -> relay  "talk <peer>"  frames that follow go to <peer> only; "talk" alone, the whole route
+//   relay -> device  "online a,b"   the device's recipients that are connected, on connect and on change
+//   relay -> device  "error <why>"  the last command was refused, e.g. a peer outside the route; frames
+//                                   are dropped until the next valid "talk"
+// Implemented on the HTTP server's upgrade event, so it needs no WebSocket package.
+
+const crypto = require('crypto');
+
+const webSocketGuid = '258EAFA5-E914-47DA-95CA-C5AB0DC85B11';
+const OP_TEXT = 0x1;
+const OP_BINARY = 0x2;
+const OP_CLOSE = 0x8;
+const OP_PING = 0x9;
+const OP_PONG = 0xA;
+
+const maxMessageBytes = 1024;     // Intercom frames are under 200 bytes
+const maxQueuedBytes = 16 * 1024; // About a second of frames waiting on a slow recipient
+const pingIntervalMs = 30000;
+
+// Server frames are never masked or fragmented
+const encodeFrame = (opcode, payload) => {
+    const header = payload.length < 126
+        ? Buffer.from([0x80 | opcode, payload.length])
+        : Buffer.from([0x80 | opcode, 126, payload.length >> 8, payload.length & 0xFF]);
+    return Buffer.concat([header, payload]);
+};
+
+// Splits the byte stream from a client into frames, which clients always mask.
+// push() returns false on anything the relay doesn't accept.
+const createFrameParser = (onFrame) => {
+    let pending = Buffer.alloc(0);
+    return (chunk) => {
+        pending = pending.length > 0 ? Buffer.concat([pending, chunk]) : chunk;
+        while (pending.length >= 2) {
+            const opcode = pending[0] & 0x0F;
+            const masked = (pending[1] & 0x80) !== 0;
+            let length = pending[1] & 0x7F;
+            let offset = 2;
+            if (length === 126) {
+                if (pending.length < 4) {
+                    return true;
+                }
+                length = pending.readUInt16BE(2);
+                offset = 4;
+            } else if (length === 127) {
+                return false; // Never needed for frames this small
+            }
+            if (!masked || length > maxMessageBytes) {
+                return false;
+            }
+            if (pending.length < offset + 4 + length) {
+                return true;
+            }
+            const mask = pending.subarray(offset, offset + 4);
+            const payload = Buffer.from(pending.subarray(offset + 4, offset + 4 + length));
+            for (let i = 0; i < payload.length; i++) {
+                payload[i] ^= mask[i & 3];
+            }
+            pending = pending.subarray(offset + 4 + length);
+            onFrame(opcode, payload);
+        }
+        return true;
+    };
+};
+
+const attachIntercomRelay = (server, routes, isValidDeviceId) => {
+    // device -> { socket, target, alive }
+    const connections = new Map();
+
+    const send = (connection, opcode, payload) => {
+        if (connection.socket.writableLength > maxQueuedBytes) {
+            return false;
+        }
+        connection.socket.write(encodeFrame(opcode, payload));
+        return true;
+    };
+
+    const sendPresence = (device) => {
+        const connection = connections.get(device);
+        if (!connection) {
+            return;
+        }
+        const online = [...(routes.get(device) || [])].filter(peer => connections.has(peer));
+        send(connection, OP_TEXT, Buffer.from(`online ${online.join(',')}`));
+    };
+
+    // Every device with this one on its route hears when it comes or goes
+    const announce = (device) => {
+        for (const [sender, recipients] of routes) {
+            if (recipients.has(device)) {
+                sendPresence(sender);
+            }
+        }
+    };
+
+    const relay = (device, connection, frame) => {
+        if (connection.muted) {
+            return;
+        }
+        const recipients = connection.target ? [connection.target] : [...(routes.get(device) || [])];
+        for (const recipient of recipients) {
+            const target = connections.get(recipient);
+            if (target) {
+                send(target, OP_BINARY, frame);
+            }
+        }
+    };
+
+    server.on('upgrade', (req, socket, head) => {
+        const match = /^\/intercom\/([^/?]+)$/.exec(req.url.split('?')[0]);
+        const key = req.headers['sec-websocket-key'];
+        if (!match || !isValidDeviceId(match[1]) || (req.headers.upgrade || '').toLowerCase() !== 'websocket' || !key) {
+            socket.end('HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n');
+            return;
+        }
+        const device = match[1];
+        const accept = crypto.createHash('sha1').update(key + webSocketGuid).digest('base64');
+        socket.write('HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n' +
+            `Sec-WebSocket-Accept: ${accept}\r\n\r\n`);
+        socket.setNoDelay(true);
+
+        // A device that reconnects replaces its old connection
+        const previous = connections.get(device);
+        if (previous) {
+            previous.socket.destroy();
+        }
+        const connection = { socket, target: null, muted: false, alive: true };
+        connections.set(device, connection);
+        console.log(`Intercom: ${device} connected.`);
+
+        const push = createFrameParser((opcode, payload) => {
+            connection.alive = true;
+            if (opcode === OP_BINARY) {
+                relay(device, connection, payload);
+            } else if (opcode === OP_TEXT) {
+                const [command, peer] = payload.toString('utf8').trim().split(/\s+/);
+                if (command === 'talk') {
+                    // A peer outside the route must not turn into talking to the whole route
+                    const allowed = routes.get(device);
+                    connection.muted = Boolean(peer) && !(allowed && allowed.has(peer));
+                    connection.target = connection.muted ? null : peer || null;
+                    if (connection.muted) {
+                        console.log(`Intercom: ${device} asked to talk to ${peer}, which is not on its route.`);
+                        send(connection, OP_TEXT, Buffer.from(`error unknown peer ${peer.slice(0, 64)}`));
+                    }
+                }
+            } else if (opcode === OP_PING) {
+                send(connection, OP_PONG, payload);
+            } else if (opcode === OP_CLOSE) {
+                socket.end(encodeFrame(OP_CLOSE, Buffer.alloc(0)));
+            }
+        });
+        socket.on('data', (chunk) => {
+            if (!push(chunk)) {
+                socket.destroy();
+            }
+        });
+        socket.on('end', () => socket.end()); // HTTP server sockets allow half-open connections
+        socket.on('error', () => socket.destroy());
+        socket.on('close', () => {
+            if (connections.get(device) === connection) {
+                connections.delete(device);
+                console.log(`Intercom: ${device} disconnected.`);
+                announce(device);
+            }
+        });
+        if (head && head.length > 0 && !push(head)) {
+            socket.destroy();
+            return;
+        }
+
+        sendPresence(device);
+        announce(device);
+    });
+
+    // Drop connections that stopped answering, e.g. behind a tunnel that went away
+    setInterval(() => {
+        for (const connection of connections.values()) {
+            if (!connection.alive) {
+                connection.socket.destroy();
+                continue;
+            }
+            connection.alive = false;
+            send(connection, OP_PING, Buffer.alloc(0));
+        }
+    }, pingIntervalMs).unref();
+};
+
+module.exports = { attachIntercomRelay };
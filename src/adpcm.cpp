@@ -0,0 +1,83 @@
+#include "adpcm.h"
+
+static const int16_t adpcmStepTable[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t adpcmIndexTable[8] = {-1, -1, -1, -1, 2, 4, 6, 8};
+
+static inline int16_t adpcmDecodeNibble(uint8_t nibble, int32_t &predictor, int &index) {
+    int32_t step = adpcmStepTable[index];
+    int32_t delta = step >> 3;
+    if (nibble & 4) delta += step;
+    if (nibble & 2) delta += step >> 1;
+    if (nibble & 1) delta += step >> 2;
+    predictor += (nibble & 8) ? -delta : delta;
+    if (predictor > 32767) predictor = 32767;
+    if (predictor < -32768) predictor = -32768;
+    index += adpcmIndexTable[nibble & 7];
+    if (index < 0) index = 0;
+    if (index > 88) index = 88;
+    return (int16_t)predictor;
+}
+
+size_t adpcmDecodeBlock(const uint8_t *block, size_t blockSize, int16_t *samples) {
+    if (blockSize < 4) {
+        return 0;
+    }
+    int32_t predictor = (int16_t)(block[0] | (block[1] << 8));
+    int index = block[2] > 88 ? 88 : block[2];
+
+    size_t count = 0;
+    samples[count++] = (int16_t)predictor;
+    for (size_t i = 4; i < blockSize; i++) {
+        samples[count++] = adpcmDecodeNibble(block[i] & 0x0F, predictor, index);
+        samples[count++] = adpcmDecodeNibble(block[i] >> 4, predictor, index);
+    }
+    return count;
+}
+
+// Pick the nibble that brings the predictor closest to sample, and apply it
+static inline uint8_t adpcmEncodeNibble(int16_t sample, int32_t &predictor, int &index) {
+    int32_t diff = sample - predictor;
+    uint8_t nibble = 0;
+    if (diff < 0) {
+        nibble = 8;
+        diff = -diff;
+    }
+    int32_t step = adpcmStepTable[index];
+    if (diff >= step) { nibble |= 4; diff -= step; }
+    step >>= 1;
+    if (diff >= step) { nibble |= 2; diff -= step; }
+    step >>= 1;
+    if (diff >= step) { nibble |= 1; }
+    // Decode it again, so the encoder tracks exactly what the decoder will see
+    adpcmDecodeNibble(nibble, predictor, index);
+    return nibble;
+}
+
+size_t adpcmEncodeBlock(const int16_t *samples, size_t count, uint8_t &stepIndex, uint8_t *block) {
+    if (count == 0) {
+        return 0;
+    }
+    int32_t predictor = samples[0];
+    int index = stepIndex > 88 ? 88 : stepIndex;
+    block[0] = predictor & 0xFF;
+    block[1] = (predictor >> 8) & 0xFF;
+    block[2] = index;
+    block[3] = 0;
+
+    size_t size = 4;
+    for (size_t i = 1; i < count; i += 2) {
+        uint8_t low = adpcmEncodeNibble(samples[i], predictor, index);
+        uint8_t high = i + 1 < count ? adpcmEncodeNibble(samples[i + 1], predictor, index) : 0;
+        block[size++] = low | (high << 4);
+    }
+    stepIndex = index;
+    return size;
+}
@@ -0,0 +1,67 @@
+#include "audio_pool.h"
+
+#include <esp_heap_caps.h>
+#include <freertos/queue.h>
+
+static AudioBlock audioBlocks[audioPoolBlocks];
+static QueueHandle_t freeBlocks = NULL; // Free list; a queue so takers can wait for a block
+static size_t blocksInUse = 0;
+static size_t peakBlocksInUse = 0;
+static portMUX_TYPE poolLock = portMUX_INITIALIZER_UNLOCKED;
+
+bool audioPoolBegin() {
+    // One allocation for all blocks, so the pool never competes with itself for a hole
+    uint8_t *memory = (uint8_t *)heap_caps_malloc(audioBlockBytes * audioPoolBlocks, MALLOC_CAP_DMA);
+    freeBlocks = xQueueCreate(audioPoolBlocks, sizeof(AudioBlock *));
+    if (memory == NULL || freeBlocks == NULL) {
+        Serial.println("Failed to allocate the audio buffer pool.");
+        return false;
+    }
+
+    for (size_t i = 0; i < audioPoolBlocks; i++) {
+        audioBlocks[i].data = memory + i * audioBlockBytes;
+        audioBlocks[i].length = 0;
+        AudioBlock *block = &audioBlocks[i];
+        xQueueSend(freeBlocks, &block, 0);
+    }
+    Serial.printf("Audio pool ready: %u blocks of %u bytes.\n", (unsigned)audioPoolBlocks, (unsigned)audioBlockBytes);
+    return true;
+}
+
+AudioBlock *audioBlockAcquire(TickType_t wait) {
+    AudioBlock *block = NULL;
+    if (freeBlocks == NULL || xQueueReceive(freeBlocks, &block, wait) != pdTRUE) {
+        return NULL;
+    }
+    block->length = 0;
+
+    portENTER_CRITICAL(&poolLock);
+    blocksInUse++;
+    peakBlocksInUse = max(peakBlocksInUse, blocksInUse);
+    portEXIT_CRITICAL(&poolLock);
+    return block;
+}
+
+void audioBlockRelease(AudioBlock *block) {
+    if (block == NULL) {
+        return;
+    }
+    portENTER_CRITICAL(&poolLock);
+    blocksInUse--;
+    portEXIT_CRITICAL(&poolLock);
+    xQueueSend(freeBlocks, &block, 0);
+}
+
+size_t audioPoolInUse() {
+    portENTER_CRITICAL(&poolLock);
+    size_t inUse = blocksInUse;
+    portEXIT_CRITICAL(&poolLock);
+    return inUse;
+}
+
+size_t audioPoolPeak() {
+    portENTER_CRITICAL(&poolLock);
+    size_t peak = peakBlocksInUse;
+    portEXIT_CRITICAL(&poolLock);
+    return peak;
+}
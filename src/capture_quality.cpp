@@ -0,0 +1,76 @@
+#include "capture_quality.h"
+
+#include <math.h>
+
+void captureQualityBegin(CaptureQuality &quality, uint32_t sampleRate) {
+    quality = {};
+    quality.sampleRate = sampleRate;
+}
+
+void captureQualityAdd(CaptureQuality &quality, const int16_t *samples, size_t count) {
+    // Block totals in locals, folded in at the end; every step is a select or an add
+    int32_t minimum = 0;
+    int32_t maximum = 0;
+    int64_t sum = 0;
+    uint64_t sumSquares = 0;
+    uint32_t clipped = 0;
+    uint32_t run = quality.zeroRun;
+    uint32_t longestRun = quality.longestZeroRun;
+    for (size_t i = 0; i < count; i++) {
+        int32_t sample = samples[i];
+        minimum = sample < minimum ? sample : minimum;
+        maximum = sample > maximum ? sample : maximum;
+        sum += sample;
+        sumSquares += (uint32_t)(sample * sample);
+        clipped += (sample >= captureClipLevel) | (sample <= -captureClipLevel);
+        run = sample == 0 ? run + 1 : 0;
+        longestRun = run > longestRun ? run : longestRun;
+    }
+
+    uint32_t peak = -minimum > maximum ? -minimum : maximum;
+    quality.peak = peak > quality.peak ? peak : quality.peak;
+    quality.samples += count;
+    quality.clipped += clipped;
+    quality.sum += sum;
+    quality.sumSquares += sumSquares;
+    quality.zeroRun = run;
+    quality.longestZeroRun = longestRun;
+}
+
+float captureQualityRmsDbfs(const CaptureQuality &quality) {
+    if (quality.samples == 0 || quality.sumSquares == 0) {
+        return -96.0f; // Below anything 16 bits can hold
+    }
+    double meanSquare = (double)quality.sumSquares / quality.samples;
+    return 10.0f * log10f((float)(meanSquare / (32768.0 * 32768.0)));
+}
+
+float captureQualityPeakDbfs(const CaptureQuality &quality) {
+    return quality.peak > 0 ? 20.0f * log10f(quality.peak / 32768.0f) : -96.0f;
+}
+
+int16_t captureQualityDcOffset(const CaptureQuality &quality) {
+    return quality.samples > 0 ? (int16_t)(quality.sum / (int64_t)quality.samples) : 0;
+}
+
+uint32_t captureQualityLongestZeroRunMs(const CaptureQuality &quality) {
+    return quality.sampleRate > 0 ? (uint64_t)quality.longestZeroRun * 1000 / quality.sampleRate : 0;
+}
+
+uint16_t captureQualityProblems(const CaptureQuality &quality) {
+    uint16_t problems = 0;
+    if ((uint64_t)quality.clipped * 1000 > (uint64_t)quality.samples * captureClippedPerMille) {
+        problems |= CAPTURE_CLIPPED;
+    }
+    if (captureQualityRmsDbfs(quality) < captureSilentDbfs) {
+        problems |= CAPTURE_SILENT;
+    }
+    if (captureQualityLongestZeroRunMs(quality) >= captureDeadMicRunMs) {
+        problems |= CAPTURE_DEAD_MIC;
+    }
+    int16_t dcOffset = captureQualityDcOffset(quality);
+    if (dcOffset > captureDcOffsetLimit || dcOffset < -captureDcOffsetLimit) {
+        problems |= CAPTURE_DC_OFFSET;
+    }
+    return problems;
+}
@@ -0,0 +1,36 @@
+#include "config.h"
+
+#include "storage.h"
+
+String deviceName = BRUSHTALK_DEVICE_ID;
+String devicePeers = BRUSHTALK_PEERS;
+
+void loadDeviceConfig() {
+    File configFile = storageHolding(deviceConfigPath).open(deviceConfigPath, FILE_READ);
+    if (configFile) {
+        while (configFile.available()) {
+            String line = configFile.readStringUntil('\n');
+            line.trim();
+            int separator = line.indexOf('=');
+            if (line.length() == 0 || line.startsWith("#") || separator < 0) {
+                continue;
+            }
+            String key = line.substring(0, separator);
+            String value = line.substring(separator + 1);
+            key.trim();
+            value.trim();
+            if (key == "id" && value.length() > 0) {
+                deviceName = value;
+            } else if (key == "peers") {
+                value.replace(" ", "");
+                devicePeers = value;
+            } else {
+                Serial.printf("Unknown setting '%s' in %s.\n", key.c_str(), deviceConfigPath);
+            }
+        }
+        configFile.close();
+    }
+
+    Serial.printf("Device id: %s, peers: %s\n", deviceName.c_str(),
+                  devicePeers.length() > 0 ? devicePeers.c_str() : "(server routes)");
+}
@@ -0,0 +1,101 @@
+#include "crc32.h"
+
+#if defined(ESP_PLATFORM)
+#include <esp_rom_crc.h>
+#endif
+
+#if defined(ESP_PLATFORM)
+
+uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t length) {
+    // The ROM routine inverts on entry and exit itself, so it chains like zlib's crc32()
+    return esp_rom_crc32_le(crc, data, length);
+}
+
+#else
+
+static uint32_t crc32Table[256];
+static bool crc32TableReady = false;
+
+static void buildCrc32Table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t value = i;
+        for (int bit = 0; bit < 8; bit++) {
+            value = (value & 1) ? (value >> 1) ^ 0xEDB88320u : value >> 1;
+        }
+        crc32Table[i] = value;
+    }
+    crc32TableReady = true;
+}
+
+uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t length) {
+    if (!crc32TableReady) {
+        buildCrc32Table();
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = crc32Table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#endif
+
+// crc32Combine works on the CRC register as a vector over GF(2): appending n zero bytes
+// is a linear operator, built by repeated squaring of the one-zero-bit operator.
+static uint32_t gf2MatrixTimes(const uint32_t *matrix, uint32_t vector) {
+    uint32_t sum = 0;
+    while (vector) {
+        if (vector & 1) {
+            sum ^= *matrix;
+        }
+        vector >>= 1;
+        matrix++;
+    }
+    return sum;
+}
+
+static void gf2MatrixSquare(uint32_t *square, const uint32_t *matrix) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2MatrixTimes(matrix, matrix[n]);
+    }
+}
+
+uint32_t crc32Combine(uint32_t crcA, uint32_t crcB, size_t lengthB) {
+    if (lengthB == 0) {
+        return crcA;
+    }
+
+    uint32_t even[32]; // Operator for an even power of two zero bits
+    uint32_t odd[32];  // Operator for an odd power of two zero bits
+
+    // Operator for one zero bit
+    odd[0] = 0xEDB88320u;
+    uint32_t row = 1;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    gf2MatrixSquare(even, odd); // Two zero bits
+    gf2MatrixSquare(odd, even); // Four zero bits
+
+    // Apply lengthB zero bytes to crcA; the first squaring below gives one zero byte
+    do {
+        gf2MatrixSquare(even, odd);
+        if (lengthB & 1) {
+            crcA = gf2MatrixTimes(even, crcA);
+        }
+        lengthB >>= 1;
+        if (lengthB == 0) {
+            break;
+        }
+
+        gf2MatrixSquare(odd, even);
+        if (lengthB & 1) {
+            crcA = gf2MatrixTimes(odd, crcA);
+        }
+        lengthB >>= 1;
+    } while (lengthB != 0);
+
+    return crcA ^ crcB;
+}
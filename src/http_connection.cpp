@@ -0,0 +1,335 @@
+#include "http_connection.h"
+
+#include <string.h>
+
+#include "config.h"
+
+// Filled once by httpBegin() from serverURL
+static char serverHost[64];
+static uint16_t serverPort = 443;
+static char serverBasePath[64];
+static char fixedHeaders[160]; // Host, User-Agent and Connection lines
+
+// Longest body end() reads and throws away before it prefers to close the connection
+const size_t httpDrainLimit = 8192;
+
+bool httpBegin() {
+    const char *url = serverURL.c_str();
+    serverPort = 443;
+    if (strncmp(url, "https://", 8) == 0) {
+        url += 8;
+    } else if (strncmp(url, "http://", 7) == 0) {
+        url += 7;
+        serverPort = 80;
+    }
+
+    const char *path = strchr(url, '/');
+    size_t authorityLength = path != NULL ? path - url : strlen(url);
+    const char *colon = (const char *)memchr(url, ':', authorityLength);
+    size_t hostLength = colon != NULL ? colon - url : authorityLength;
+    if (hostLength == 0 || hostLength >= sizeof(serverHost) || (path != NULL && strlen(path) >= sizeof(serverBasePath))) {
+        Serial.printf("Server URL %s is not usable.\n", serverURL.c_str());
+        return false;
+    }
+    memcpy(serverHost, url, hostLength);
+    serverHost[hostLength] = '\0';
+    if (colon != NULL) {
+        serverPort = atoi(colon + 1);
+    }
+
+    // Request paths start with '/', so the base path keeps no trailing one
+    strlcpy(serverBasePath, path != NULL ? path : "", sizeof(serverBasePath));
+    size_t baseLength = strlen(serverBasePath);
+    if (baseLength > 0 && serverBasePath[baseLength - 1] == '/') {
+        serverBasePath[baseLength - 1] = '\0';
+    }
+
+    snprintf(fixedHeaders, sizeof(fixedHeaders), "Host: %.*s\r\nUser-Agent: ESP32/1.0\r\nConnection: keep-alive\r\n",
+             (int)authorityLength, url);
+    return true;
+}
+
+const char *httpServerHost() {
+    return serverHost;
+}
+
+uint16_t httpServerPort() {
+    return serverPort;
+}
+
+const char *httpServerBasePath() {
+    return serverBasePath;
+}
+
+void HttpConnection::append(const char *text) {
+    size_t textLength = strlen(text);
+    if (length + textLength >= sizeof(buffer)) {
+        overflow = true;
+        return;
+    }
+    memcpy(buffer + length, text, textLength);
+    length += textLength;
+}
+
+void HttpConnection::begin(const char *method, const char *path, const char *path2, const char *path3,
+                           const char *path4) {
+    // A body left unread would be taken for the next response
+    if (!bodyDone) {
+        end();
+    }
+    length = 0;
+    overflow = false;
+    headRequest = strcmp(method, "HEAD") == 0;
+    bodyMethod = strcmp(method, "POST") == 0 || strcmp(method, "PUT") == 0 || strcmp(method, "PATCH") == 0;
+
+    append(method);
+    append(" ");
+    append(serverBasePath);
+    append(path);
+    append(path2);
+    append(path3);
+    append(path4);
+    append(" HTTP/1.1\r\n");
+    append(fixedHeaders);
+}
+
+void HttpConnection::header(const char *name, const char *value) {
+    append(name);
+    append(": ");
+    append(value);
+    append("\r\n");
+}
+
+void HttpConnection::header(const char *name, uint32_t value) {
+    char digits[11];
+    snprintf(digits, sizeof(digits), "%u", (unsigned)value);
+    header(name, digits);
+}
+
+void HttpConnection::close() {
+    client.stop();
+    keepAlive = false;
+    bodyDone = true;
+}
+
+bool HttpConnection::send(size_t bodyLength) {
+    if (bodyLength > 0 || bodyMethod) {
+        header("Content-Length", (uint32_t)bodyLength);
+    }
+    append("\r\n");
+    if (overflow) {
+        Serial.println("HTTP request does not fit the request buffer.");
+        return false;
+    }
+
+    // A kept-alive connection may have been closed by the server in the meantime; in that
+    // case the first write fails and the request goes out on a fresh connection
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool reused = client.connected();
+        if (!reused && !client.connect(serverHost, serverPort)) {
+            Serial.printf("Failed to connect to %s:%u.\n", serverHost, serverPort);
+            return false;
+        }
+        if (client.write((const uint8_t *)buffer, length) == length) {
+            return true;
+        }
+        client.stop();
+        if (!reused) {
+            break;
+        }
+    }
+    Serial.println("Failed to send HTTP request.");
+    return false;
+}
+
+bool HttpConnection::write(const uint8_t *data, size_t dataLength) {
+    if (client.write(data, dataLength) != dataLength) {
+        close(); // Part of the body is missing; the connection can't carry anything else
+        return false;
+    }
+    return true;
+}
+
+// Read one line into buffer without its line ending. Longer lines are cut to fit.
+bool HttpConnection::readLine() {
+    length = 0;
+    unsigned long lastDataTime = millis();
+    while (true) {
+        if (client.available() == 0) {
+            if (!client.connected() || millis() - lastDataTime > httpTimeoutMs) {
+                return false;
+            }
+            delay(1);
+            continue;
+        }
+        int c = client.read();
+        if (c < 0) {
+            continue;
+        }
+        lastDataTime = millis();
+        if (c == '\n') {
+            break;
+        }
+        if (c != '\r' && length < sizeof(buffer) - 1) {
+            buffer[length++] = c;
+        }
+    }
+    buffer[length] = '\0';
+    return true;
+}
+
+bool HttpConnection::readResponse(HttpResponse &response) {
+    memset(&response, 0, sizeof(response));
+    response.status = -1;
+    response.contentLength = -1;
+    response.uploadOffset = -1;
+    chunked = false;
+    keepAlive = true;
+
+    // Status line, e.g. "HTTP/1.1 204 No Content"
+    if (!readLine() || strncmp(buffer, "HTTP/1.", 7) != 0 || strchr(buffer, ' ') == NULL) {
+        close();
+        return false;
+    }
+    keepAlive = buffer[7] != '0';
+    response.status = atoi(strchr(buffer, ' ') + 1);
+
+    while (true) {
+        if (!readLine()) {
+            close();
+            return false;
+        }
+        if (length == 0) {
+            break; // End of headers
+        }
+        char *separator = strchr(buffer, ':');
+        if (separator == NULL) {
+            continue;
+        }
+        *separator = '\0';
+        const char *value = separator + 1;
+        while (*value == ' ') {
+            value++;
+        }
+
+        if (strcasecmp(buffer, "Content-Length") == 0) {
+            response.contentLength = atol(value);
+        } else if (strcasecmp(buffer, "Transfer-Encoding") == 0) {
+            chunked = strstr(value, "chunked") != NULL;
+        } else if (strcasecmp(buffer, "Connection") == 0) {
+            keepAlive = strcasecmp(value, "close") != 0;
+        } else if (strcasecmp(buffer, "Location") == 0) {
+            strlcpy(response.location, value, sizeof(response.location));
+        } else if (strcasecmp(buffer, "Upload-Offset") == 0) {
+            response.uploadOffset = atol(value);
+        } else if (strcasecmp(buffer, "X-Content-CRC32") == 0) {
+            response.hasCrc = true;
+            response.crc = strtoul(value, NULL, 16);
+        } else if (strcasecmp(buffer, "X-Audio-Format") == 0) {
+            strlcpy(response.audioFormat, value, sizeof(response.audioFormat));
+        }
+    }
+
+    // Where the body ends: nothing, a chunk at a time, a known length, or at close
+    bodyDone = false;
+    bodyRemaining = 0;
+    if (headRequest || response.status == 204 || response.status == 304 || response.status < 200) {
+        bodyDone = true;
+    } else if (chunked) {
+        response.contentLength = -1;
+    } else if (response.contentLength >= 0) {
+        bodyRemaining = response.contentLength;
+        bodyDone = bodyRemaining == 0;
+    } else {
+        bodyRemaining = -1;
+        keepAlive = false;
+    }
+    return true;
+}
+
+// Read the size line of the next chunk, after the line ending of the previous one
+bool HttpConnection::nextChunk() {
+    do {
+        if (!readLine()) {
+            return false;
+        }
+    } while (length == 0);
+
+    bodyRemaining = strtoul(buffer, NULL, 16);
+    if (bodyRemaining == 0) {
+        // Last chunk; skip any trailer headers up to the final empty line
+        while (readLine() && length > 0) {
+        }
+        bodyDone = true;
+    }
+    return true;
+}
+
+int HttpConnection::read(uint8_t *data, size_t size) {
+    if (bodyDone || size == 0) {
+        return 0;
+    }
+    if (chunked && bodyRemaining == 0) {
+        if (!nextChunk()) {
+            close();
+            return -1;
+        }
+        if (bodyDone) {
+            return 0;
+        }
+    }
+
+    unsigned long lastDataTime = millis();
+    while (client.available() == 0) {
+        if (!client.connected()) {
+            if (bodyRemaining < 0) {
+                bodyDone = true; // The body ran until the server closed the connection
+                return 0;
+            }
+            close();
+            return -1;
+        }
+        if (millis() - lastDataTime > httpTimeoutMs) {
+            Serial.println("HTTP response stalled.");
+            close();
+            return -1;
+        }
+        delay(1);
+    }
+
+    size_t wanted = min(size, (size_t)client.available());
+    if (bodyRemaining > 0) {
+        wanted = min(wanted, (size_t)bodyRemaining);
+    }
+    int bytesRead = client.read(data, wanted);
+    if (bytesRead > 0 && bodyRemaining > 0) {
+        bodyRemaining -= bytesRead;
+        bodyDone = bodyRemaining == 0 && !chunked;
+    }
+    return bytesRead;
+}
+
+void HttpConnection::end() {
+    // Short bodies are read and dropped so the connection stays usable, long ones aren't worth it
+    size_t drained = 0;
+    while (!bodyDone && drained < httpDrainLimit) {
+        int bytesRead = read((uint8_t *)buffer, sizeof(buffer));
+        if (bytesRead <= 0) {
+            break;
+        }
+        drained += bytesRead;
+    }
+    if (!bodyDone || !keepAlive) {
+        close();
+    }
+}
+
+int HttpConnection::request(const char *method, HttpResponse &response, const char *path, const char *path2,
+                            const char *path3, const char *path4) {
+    begin(method, path, path2, path3, path4);
+    if (!send() || !readResponse(response)) {
+        response.status = -1;
+        return -1;
+    }
+    return response.status;
+}
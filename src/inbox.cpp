@@ -0,0 +1,191 @@
+#include "inbox.h"
+
+#include <Preferences.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "message_index.h"
+#include "ram_message.h"
+#include "storage.h"
+#include "wav.h"
+
+// Message ids in arrival order, oldest first. Downloads and playback run in the main
+// loop, LAN transfers are stored by their own task, so the queue is behind a mutex.
+static uint32_t inboxQueue[inboxCapacity];
+static size_t inboxHead = 0;
+static size_t inboxSize = 0;
+static SemaphoreHandle_t inboxMutex = NULL;
+
+String inboxTempPath(uint32_t id) {
+    return String(inboxDir) + "/" + String(id) + ".tmp";
+}
+
+String inboxAudioPath(uint32_t id) {
+    return String(inboxDir) + "/" + String(id) + ".wav";
+}
+
+// Insert keeping the queue sorted by id; only the boot-time scan can insert out of order
+static bool pushInboxMessage(uint32_t id) {
+    if (inboxSize == inboxCapacity) {
+        return false;
+    }
+    size_t pos = inboxSize;
+    while (pos > 0 && inboxQueue[(inboxHead + pos - 1) % inboxCapacity] > id) {
+        inboxQueue[(inboxHead + pos) % inboxCapacity] = inboxQueue[(inboxHead + pos - 1) % inboxCapacity];
+        pos--;
+    }
+    inboxQueue[(inboxHead + pos) % inboxCapacity] = id;
+    inboxSize++;
+    return true;
+}
+
+bool inboxBegin() {
+    inboxMutex = xSemaphoreCreateMutex();
+
+    if (!storageMakeDir(inboxDir)) {
+        Serial.println("Failed to create inbox directory.");
+        return false;
+    }
+
+    // Interrupted downloads; the server still has these messages
+    uint32_t ids[inboxCapacity];
+    size_t count = messageIndexList(MESSAGE_INBOUND, MESSAGE_RECEIVING, ids, inboxCapacity);
+    for (size_t i = 0; i < count; i++) {
+        inboxDiscard(ids[i]);
+    }
+
+    // Messages that were only held in RAM are gone; they weren't acknowledged yet, so
+    // the server sends them again
+    count = messageIndexList(MESSAGE_INBOUND, MESSAGE_UNPLAYED, ids, inboxCapacity);
+    for (size_t i = 0; i < count; i++) {
+        String audioPath = inboxAudioPath(ids[i]);
+        if (storageHolding(audioPath.c_str()).exists(audioPath)) {
+            pushInboxMessage(ids[i]);
+        } else {
+            messageIndexSetState(MESSAGE_INBOUND, ids[i], MESSAGE_DELETED);
+        }
+    }
+
+    Serial.printf("Inbox ready, %u message(s) waiting.\n", (unsigned)inboxSize);
+    return true;
+}
+
+size_t inboxCount() {
+    xSemaphoreTake(inboxMutex, portMAX_DELAY);
+    size_t count = inboxSize;
+    xSemaphoreGive(inboxMutex);
+    return count;
+}
+
+bool inboxFull() {
+    return inboxCount() == inboxCapacity;
+}
+
+uint32_t inboxMessageAt(size_t index) {
+    xSemaphoreTake(inboxMutex, portMAX_DELAY);
+    uint32_t id = index < inboxSize ? inboxQueue[(inboxHead + index) % inboxCapacity] : 0;
+    xSemaphoreGive(inboxMutex);
+    return id;
+}
+
+uint32_t inboxReserveId() {
+    xSemaphoreTake(inboxMutex, portMAX_DELAY);
+    Preferences preferences;
+    preferences.begin("inbox", false);
+    uint32_t id = preferences.getUInt("nextId", 1);
+    preferences.putUInt("nextId", id + 1);
+    preferences.end();
+    xSemaphoreGive(inboxMutex);
+
+    MessageRecord record = {};
+    record.direction = MESSAGE_INBOUND;
+    record.id = id;
+    record.state = MESSAGE_RECEIVING;
+    return messageIndexAdd(record) ? id : 0;
+}
+
+void inboxDiscard(uint32_t id) {
+    ramMessageRelease(ramMessageFind(RAM_INBOUND, id));
+    String tempPath = inboxTempPath(id);
+    storageHolding(tempPath.c_str()).remove(tempPath);
+    messageIndexSetState(MESSAGE_INBOUND, id, MESSAGE_DELETED);
+}
+
+// Codec of a received message from its fmt chunk; the server may have transcoded it
+static uint8_t inboxMessageCodec(uint32_t id) {
+    WavInfo info = {};
+    bool parsed = false;
+    RamMessage *ramMessage = ramMessageFind(RAM_INBOUND, id);
+    if (ramMessage != NULL) {
+        size_t dataOffset;
+        parsed = wavReadHeader(ramMessage->data, ramMessage->length, info, dataOffset);
+    } else {
+        String audioPath = inboxAudioPath(id);
+        File audioFile = storageHolding(audioPath.c_str()).open(audioPath, FILE_READ);
+        if (audioFile) {
+            parsed = wavReadHeader(audioFile, info);
+            audioFile.close();
+        }
+    }
+    return parsed && info.format == wavFormatImaAdpcm ? CODEC_IMA_ADPCM : CODEC_PCM16;
+}
+
+bool inboxCommit(uint32_t id, size_t size, uint32_t crc) {
+    if (inboxFull()) {
+        Serial.println("Inbox full, discarding download.");
+        inboxDiscard(id);
+        return false;
+    }
+    // A message received into RAM has no file to rename
+    String tempPath = inboxTempPath(id);
+    if (ramMessageFind(RAM_INBOUND, id) == NULL && !storageHolding(tempPath.c_str()).rename(tempPath, inboxAudioPath(id))) {
+        Serial.printf("Failed to commit downloaded message %u.\n", (unsigned)id);
+        inboxDiscard(id);
+        return false;
+    }
+
+    MessageRecord record = {};
+    record.direction = MESSAGE_INBOUND;
+    record.id = id;
+    record.state = MESSAGE_UNPLAYED;
+    record.size = size;
+    record.crc = crc;
+    record.codec = inboxMessageCodec(id);
+    messageIndexPut(record);
+
+    xSemaphoreTake(inboxMutex, portMAX_DELAY);
+    pushInboxMessage(id);
+    size_t waiting = inboxSize;
+    xSemaphoreGive(inboxMutex);
+    Serial.printf("Message %u added to inbox (%u waiting).\n", (unsigned)id, (unsigned)waiting);
+    return true;
+}
+
+void inboxRemoveOldest() {
+    xSemaphoreTake(inboxMutex, portMAX_DELAY);
+    if (inboxSize == 0) {
+        xSemaphoreGive(inboxMutex);
+        return;
+    }
+    uint32_t id = inboxQueue[inboxHead];
+    inboxHead = (inboxHead + 1) % inboxCapacity;
+    inboxSize--;
+    xSemaphoreGive(inboxMutex);
+
+    messageIndexSetState(MESSAGE_INBOUND, id, MESSAGE_PLAYED);
+    RamMessage *ramMessage = ramMessageFind(RAM_INBOUND, id);
+    String audioPath = inboxAudioPath(id);
+    if (ramMessage != NULL) {
+        ramMessageRelease(ramMessage);
+        Serial.printf("Message %u released from RAM after playback.\n", (unsigned)id);
+    } else if (storageHolding(audioPath.c_str()).remove(audioPath)) {
+        Serial.printf("Message %u deleted after playback.\n", (unsigned)id);
+    } else {
+        Serial.printf("Error: Failed to delete message %u after playback.\n", (unsigned)id);
+    }
+}
+
+bool inboxStore(uint32_t id) {
+    RamMessage *ramMessage = ramMessageFind(RAM_INBOUND, id);
+    return ramMessage == NULL || ramMessagePersist(ramMessage, inboxAudioPath(id).c_str());
+}
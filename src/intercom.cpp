@@ -0,0 +1,545 @@
+#include "intercom.h"
+
+#include <ESPAsyncWebServer.h>
+#include <WiFi.h>
+#include <WiFiClientSecure.h>
+#include <sys/time.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include "adpcm.h"
+#include "config.h"
+#include "http_connection.h"
+#include "lan_peer.h"
+#include "lan_protocol.h"
+#include "metrics.h"
+#include "websocket_client.h"
+
+const uint8_t intercomVersion = 1;
+const uint8_t FRAME_END = 0x01; // Header only: the talker let go of the button
+
+// One frame on the wire. Both ends are ESP32s, so the fields go out little-endian as laid out.
+struct IntercomHeader {
+    uint8_t version;
+    uint8_t flags;
+    uint16_t sequence;    // Counts on across bursts
+    uint32_t captureMs;   // Sender's millis() at capture, for the jitter estimate
+    uint32_t wallMs;      // Sender's wall clock in ms, mod 2^32; 0 if it isn't set
+    uint16_t sampleCount;
+    uint16_t reserved;
+};
+
+const size_t intercomPayloadBytes = 4 + intercomFrameSamples / 2; // ADPCM block header plus one nibble per sample
+const size_t intercomMaxFrameBytes = sizeof(IntercomHeader) + intercomPayloadBytes;
+const size_t intercomSendQueueLength = 8;      // 160 ms; older frames are dropped rather than sent late
+const unsigned long intercomLanCheckMs = 30000; // How often an idle device looks for its peer on the LAN
+const unsigned long intercomRelayQuietMs = 90000; // The relay pings every 30 s; silence this long means it's gone
+
+struct OutgoingFrame {
+    uint16_t length;
+    uint8_t data[intercomMaxFrameBytes];
+};
+
+struct JitterSlot {
+    bool filled;
+    uint16_t sequence;
+    uint32_t wallMs;
+    uint8_t length;
+    uint8_t payload[intercomPayloadBytes];
+};
+
+// Receive side. Frames arrive from the AsyncTCP task (LAN) and the intercom task (relay)
+// and leave from the playout task, all under jitterLock.
+static JitterSlot jitterSlots[intercomJitterSlots];
+static portMUX_TYPE jitterLock = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t frameArrived = NULL;
+static bool streamActive = false;
+static bool streamEnded = false;
+static uint16_t playSequence = 0;  // Next frame due at the output
+static uint16_t endSequence = 0;   // Last frame of the stream, once streamEnded
+static size_t bufferedFrames = 0;
+static size_t targetDepth = intercomMinDepth;
+static unsigned long lastArrivalMs = 0;
+static int32_t lastTransitMs = 0;
+static uint32_t jitterSixteenths = 0; // RFC 3550 interarrival jitter, in 1/16 ms
+
+// Per-stream figures for the summary logged when it ends
+struct StreamStats {
+    uint32_t played;
+    uint32_t concealed;
+    uint32_t late;
+    uint32_t latencyCount;
+    uint32_t latencySumMs;
+    uint32_t latencyMaxMs;
+};
+static StreamStats streamStats;
+
+// Playout state, only touched by the playout task
+static int16_t lastFrame[intercomFrameSamples];
+static uint8_t lossRun = 0;
+static unsigned long outputDelay = 0;
+
+// Send side: frames from the capture loop to the intercom task
+static QueueHandle_t outgoingFrames = NULL;
+static uint16_t sendSequence = 0;
+static uint8_t sendStepIndex = 0;
+
+// Reachability, written by the intercom task and read by the capture loop
+static volatile bool targetOnLan = false;
+static volatile bool targetOnRelay = false;
+
+static AsyncWebServer intercomServer(intercomPort);
+static AsyncWebSocket intercomSocket("/intercom");
+
+// Wall-clock ms, mod 2^32, or 0 while NTP hasn't set the clock
+static uint32_t wallClockMs() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    if (now.tv_sec < 1600000000) {
+        return 0;
+    }
+    return (uint32_t)((uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000);
+}
+
+// Frames to hold back: enough to ride out three times the measured jitter
+static size_t depthForJitter() {
+    size_t jitterMs = jitterSixteenths / 16;
+    size_t depth = 1 + (3 * jitterMs + intercomFrameMs - 1) / intercomFrameMs;
+    return constrain(depth, intercomMinDepth, intercomMaxDepth);
+}
+
+static void clearJitterBuffer() {
+    for (size_t i = 0; i < intercomJitterSlots; i++) {
+        jitterSlots[i].filled = false;
+    }
+    bufferedFrames = 0;
+}
+
+static void receiveFrame(const uint8_t *data, size_t length) {
+    IntercomHeader header;
+    if (length < sizeof(header)) {
+        return;
+    }
+    memcpy(&header, data, sizeof(header));
+    size_t payloadLength = length - sizeof(header);
+    bool endMarker = (header.flags & FRAME_END) != 0;
+    if (header.version != intercomVersion || payloadLength > intercomPayloadBytes ||
+        (!endMarker && header.sampleCount != intercomFrameSamples)) {
+        return;
+    }
+
+    unsigned long now = millis();
+    bool late = false;
+    portENTER_CRITICAL(&jitterLock);
+    if (!streamActive && endMarker) {
+        portEXIT_CRITICAL(&jitterLock);
+        return; // The end of a stream already played out, or of one never heard
+    }
+    if (!streamActive) {
+        clearJitterBuffer();
+        streamActive = true;
+        streamEnded = false;
+        playSequence = header.sequence;
+        lastTransitMs = now - header.captureMs;
+        jitterSixteenths = 0;
+        targetDepth = intercomMinDepth;
+        streamStats = {};
+    }
+    lastArrivalMs = now;
+
+    if (endMarker) {
+        streamEnded = true;
+        endSequence = header.sequence - 1;
+    } else {
+        // Transit time includes the unknown offset between the two clocks, which cancels out
+        int32_t transitMs = now - header.captureMs;
+        int32_t difference = abs(transitMs - lastTransitMs);
+        lastTransitMs = transitMs;
+        jitterSixteenths += difference - ((jitterSixteenths + 8) >> 4);
+
+        int16_t ahead = (int16_t)(header.sequence - playSequence);
+        if (ahead < 0) {
+            late = true;
+            streamStats.late++;
+        } else {
+            if ((size_t)ahead >= intercomJitterSlots) {
+                // Far ahead after a stall: what is buffered is too old to be worth playing
+                streamStats.late += bufferedFrames;
+                clearJitterBuffer();
+                playSequence = header.sequence;
+            }
+            JitterSlot &slot = jitterSlots[header.sequence % intercomJitterSlots];
+            if (!slot.filled) {
+                bufferedFrames++;
+            }
+            slot.filled = true;
+            slot.sequence = header.sequence;
+            slot.wallMs = header.wallMs;
+            slot.length = payloadLength;
+            memcpy(slot.payload, data + sizeof(header), payloadLength);
+        }
+    }
+    portEXIT_CRITICAL(&jitterLock);
+
+    if (!endMarker) {
+        metricsAdd(late ? METRIC_INTERCOM_LATE : METRIC_INTERCOM_RECEIVED);
+    }
+    xSemaphoreGive(frameArrived);
+}
+
+bool intercomWaitForStream(TickType_t wait) {
+    while (true) {
+        portENTER_CRITICAL(&jitterLock);
+        bool ready = streamActive && (streamEnded || bufferedFrames >= targetDepth);
+        portEXIT_CRITICAL(&jitterLock);
+        if (ready) {
+            // Nothing of the last stream is replayed into this one
+            memset(lastFrame, 0, sizeof(lastFrame));
+            lossRun = 0;
+            return true;
+        }
+        if (xSemaphoreTake(frameArrived, wait) != pdTRUE) {
+            return false;
+        }
+    }
+}
+
+// Replay the last good frame, fading out over a few losses so a gap doesn't turn into a buzz
+static void concealFrame(int16_t *samples) {
+    const uint8_t fadeFrames = 4;
+    uint8_t from = fadeFrames - min(lossRun, fadeFrames);
+    lossRun = min(lossRun + 1, 255);
+    uint8_t to = fadeFrames - min(lossRun, fadeFrames);
+    for (size_t i = 0; i < intercomFrameSamples; i++) {
+        int32_t gain = from * (int32_t)(intercomFrameSamples - i) + to * (int32_t)i; // fadeFrames * frame samples is full scale
+        samples[i] = (int32_t)lastFrame[i] * gain / (int32_t)(fadeFrames * intercomFrameSamples);
+    }
+    metricsAdd(METRIC_INTERCOM_CONCEALED);
+}
+
+static void logStreamSummary() {
+    StreamStats stats;
+    portENTER_CRITICAL(&jitterLock);
+    stats = streamStats;
+    uint32_t jitterMs = jitterSixteenths / 16;
+    size_t depth = targetDepth;
+    portEXIT_CRITICAL(&jitterLock);
+    Serial.printf("Intercom stream over: %u frames played, %u concealed, %u late, jitter %u ms, depth %u frames",
+                  (unsigned)stats.played, (unsigned)stats.concealed, (unsigned)stats.late, (unsigned)jitterMs,
+                  (unsigned)depth);
+    if (stats.latencyCount > 0) {
+        Serial.printf(", latency avg %u ms, max %u ms.\n", (unsigned)(stats.latencySumMs / stats.latencyCount),
+                      (unsigned)stats.latencyMaxMs);
+    } else {
+        Serial.println(", latency unknown (clocks not set).");
+    }
+}
+
+bool intercomNextFrame(int16_t *samples) {
+    enum { PLAY, CONCEAL, END } action;
+    JitterSlot frame;
+    unsigned long now = millis();
+
+    portENTER_CRITICAL(&jitterLock);
+    targetDepth = depthForJitter();
+    // Holding more than needed only adds delay; let the oldest frame go
+    if (bufferedFrames > targetDepth + 2) {
+        JitterSlot &oldest = jitterSlots[playSequence % intercomJitterSlots];
+        if (oldest.filled && oldest.sequence == playSequence) {
+            oldest.filled = false;
+            bufferedFrames--;
+            streamStats.late++;
+        }
+        playSequence++;
+    }
+    JitterSlot &slot = jitterSlots[playSequence % intercomJitterSlots];
+    if (!streamActive) {
+        action = END;
+    } else if (slot.filled && slot.sequence == playSequence) {
+        frame = slot;
+        slot.filled = false;
+        bufferedFrames--;
+        playSequence++;
+        streamStats.played++;
+        action = PLAY;
+    } else if (streamEnded && (int16_t)(playSequence - endSequence) > 0) {
+        action = END;
+    } else if (bufferedFrames == 0 && now - lastArrivalMs > intercomSilenceMs) {
+        action = END; // The talker went away without saying so
+    } else {
+        // Lost if later frames are already here; otherwise late, and waiting for it
+        // stretches the delay by a frame, which the jitter estimate accounts for next time
+        if (bufferedFrames > 0) {
+            playSequence++;
+        }
+        streamStats.concealed++;
+        action = CONCEAL;
+    }
+    if (action == END) {
+        streamActive = false;
+    }
+    portEXIT_CRITICAL(&jitterLock);
+
+    if (action == END) {
+        logStreamSummary();
+        return false;
+    }
+    if (action == CONCEAL) {
+        concealFrame(samples);
+        return true;
+    }
+
+    int16_t decoded[intercomFrameSamples + 1]; // The block's last nibble is padding
+    size_t count = adpcmDecodeBlock(frame.payload, frame.length, decoded);
+    count = min(count, intercomFrameSamples);
+    memcpy(samples, decoded, count * sizeof(int16_t));
+    memset(samples + count, 0, (intercomFrameSamples - count) * sizeof(int16_t));
+    memcpy(lastFrame, samples, sizeof(lastFrame));
+    lossRun = 0;
+
+    uint32_t nowWallMs = wallClockMs();
+    if (frame.wallMs != 0 && nowWallMs != 0) {
+        uint32_t latencyMs = nowWallMs - frame.wallMs + outputDelay;
+        if (latencyMs < 60000) { // Anything longer is a clock that is off, not a delay
+            metricsObserve(STAGE_INTERCOM, latencyMs);
+            portENTER_CRITICAL(&jitterLock);
+            streamStats.latencyCount++;
+            streamStats.latencySumMs += latencyMs;
+            streamStats.latencyMaxMs = max(streamStats.latencyMaxMs, latencyMs);
+            portEXIT_CRITICAL(&jitterLock);
+        }
+    }
+    return true;
+}
+
+static void queueFrame(uint8_t flags, const int16_t *samples) {
+    OutgoingFrame frame;
+    IntercomHeader header = {};
+    header.version = intercomVersion;
+    header.flags = flags;
+    header.sequence = sendSequence++;
+    header.captureMs = millis();
+    header.wallMs = wallClockMs();
+    size_t payloadLength = 0;
+    if (samples != NULL) {
+        header.sampleCount = intercomFrameSamples;
+        payloadLength = adpcmEncodeBlock(samples, intercomFrameSamples, sendStepIndex, frame.data + sizeof(header));
+    }
+    memcpy(frame.data, &header, sizeof(header));
+    frame.length = sizeof(header) + payloadLength;
+
+    // Audio is dropped when the link lags; the end marker waits a little for room
+    TickType_t wait = samples != NULL ? 0 : pdMS_TO_TICKS(100);
+    if (xQueueSend(outgoingFrames, &frame, wait) != pdTRUE) {
+        metricsAdd(METRIC_INTERCOM_DROPPED);
+    }
+}
+
+void intercomTalkBegin() {
+    sendStepIndex = 0;
+}
+
+void intercomSendFrame(const int16_t *samples) {
+    queueFrame(0, samples);
+}
+
+void intercomTalkEnd() {
+    queueFrame(FRAME_END, NULL);
+}
+
+bool intercomAvailable() {
+    return outgoingFrames != NULL && (targetOnLan || targetOnRelay);
+}
+
+// Relay-reported peers that are connected, e.g. "online kitchen,kids"
+static char onlinePeers[128] = "";
+
+static bool peerIsOnline(const char *peer) {
+    size_t peerLength = strlen(peer);
+    for (const char *name = onlinePeers; *name != '\0';) {
+        const char *comma = strchr(name, ',');
+        size_t length = comma != NULL ? (size_t)(comma - name) : strlen(name);
+        if (length == peerLength && strncmp(name, peer, length) == 0) {
+            return true;
+        }
+        name += length + (comma != NULL ? 1 : 0);
+    }
+    return false;
+}
+
+// The peer talked to: the first configured one, or with none configured the first on
+// the route the relay reports online
+static void currentTarget(char *target, size_t size) {
+    const char *source = devicePeers.length() > 0 ? devicePeers.c_str() : onlinePeers;
+    const char *comma = strchr(source, ',');
+    size_t length = comma != NULL ? (size_t)(comma - source) : strlen(source);
+    snprintf(target, size, "%.*s", (int)length, source);
+}
+
+static void handleRelayText(const char *text) {
+    if (strncmp(text, "online ", 7) == 0 || strcmp(text, "online") == 0) {
+        strlcpy(onlinePeers, text[6] == ' ' ? text + 7 : "", sizeof(onlinePeers));
+        char target[lanMaxIdLength + 1];
+        currentTarget(target, sizeof(target));
+        targetOnRelay = target[0] != '\0' && peerIsOnline(target);
+        Serial.printf("Intercom relay: peers online: %s\n", onlinePeers[0] != '\0' ? onlinePeers : "none");
+    } else if (strncmp(text, "error ", 6) == 0) {
+        // The relay drops this stream's frames; the next one asks again
+        Serial.printf("Intercom relay refused: %s\n", text + 6);
+    }
+}
+
+static bool connectRelay(WebSocketClient &relay) {
+    char path[128];
+    snprintf(path, sizeof(path), "%s/intercom/%s", httpServerBasePath(), deviceName.c_str());
+    if (!relay.connect(httpServerHost(), httpServerPort(), path)) {
+        Serial.println("Intercom relay not reachable.");
+        return false;
+    }
+    Serial.println("Intercom relay connected.");
+    return true;
+}
+
+static void intercomTask(void *parameter) {
+    WiFiClient lanClient;
+    WebSocketClient lanLink(lanClient);
+    WiFiClientSecure relayClient;
+    relayClient.setInsecure();
+    WebSocketClient relayLink(relayClient);
+
+    bool relayUp = false;
+    bool relayTried = false;
+    unsigned long relayAttemptMs = 0;
+    unsigned long relayHeardMs = 0;
+    bool lanChecked = false;
+    unsigned long lanCheckMs = 0;
+    IPAddress targetIp;
+
+    bool streamOpen = false;
+    bool streamOnLan = false;
+    static OutgoingFrame frame;
+    static uint8_t message[256];
+
+    while (true) {
+        bool wifiUp = WiFi.status() == WL_CONNECTED;
+
+        // Outgoing frames go first; the first of a burst picks the link
+        while (xQueueReceive(outgoingFrames, &frame, pdMS_TO_TICKS(5)) == pdTRUE) {
+            bool endMarker = (frame.data[offsetof(IntercomHeader, flags)] & FRAME_END) != 0;
+            if (!streamOpen) {
+                streamOpen = true;
+                streamOnLan = targetOnLan && lanLink.connect(targetIp, intercomPort, "/intercom");
+                if (!streamOnLan && relayUp) {
+                    char command[8 + lanMaxIdLength];
+                    char target[lanMaxIdLength + 1];
+                    currentTarget(target, sizeof(target));
+                    snprintf(command, sizeof(command), "talk %s", target);
+                    relayLink.sendText(command);
+                }
+                Serial.printf("Intercom: talking %s.\n", streamOnLan ? "over the LAN" : "through the relay");
+            }
+            bool sent = false;
+            if (streamOnLan) {
+                sent = lanLink.sendBinary(frame.data, frame.length);
+                if (!sent) {
+                    Serial.println("Intercom LAN link lost, switching to the relay.");
+                    lanLink.close();
+                    streamOnLan = false;
+                    targetOnLan = false;
+                }
+            }
+            if (!streamOnLan && relayUp) {
+                sent = relayLink.sendBinary(frame.data, frame.length);
+            }
+            if (!endMarker) {
+                metricsAdd(sent ? METRIC_INTERCOM_SENT : METRIC_INTERCOM_DROPPED);
+            }
+            if (endMarker) {
+                if (streamOnLan) {
+                    lanLink.close();
+                }
+                streamOpen = false;
+            }
+        }
+
+#if BRUSHTALK_INTERCOM_RELAY
+        // Frames and presence from the relay
+        if (relayUp) {
+            for (int i = 0; i < 8; i++) {
+                if (relayClient.available() == 0) {
+                    relayUp = relayLink.connected();
+                    break;
+                }
+                relayHeardMs = millis(); // Pings count too
+                bool binary = false;
+                int length = relayLink.poll(message, sizeof(message) - 1, binary);
+                if (length < 0) {
+                    relayUp = false;
+                    break;
+                }
+                if (length == 0) {
+                    continue; // A ping, answered already
+                }
+                if (binary) {
+                    receiveFrame(message, length);
+                } else {
+                    message[length] = '\0';
+                    handleRelayText((const char *)message);
+                }
+            }
+            if (relayUp && millis() - relayHeardMs > intercomRelayQuietMs) {
+                relayLink.close();
+                relayUp = false;
+            }
+            if (!relayUp) {
+                Serial.println("Intercom relay disconnected.");
+                targetOnRelay = false;
+                onlinePeers[0] = '\0';
+            }
+        } else if (wifiUp && !streamOpen && (!relayTried || millis() - relayAttemptMs >= intercomRelayRetryMs)) {
+            relayTried = true;
+            relayAttemptMs = millis();
+            relayUp = connectRelay(relayLink);
+            relayHeardMs = millis();
+        }
+#endif
+
+        // Look for the peer on the LAN now and then while idle; an mDNS query blocks
+        if (wifiUp && !streamOpen && (!lanChecked || millis() - lanCheckMs >= intercomLanCheckMs)) {
+            lanChecked = true;
+            lanCheckMs = millis();
+            char target[lanMaxIdLength + 1];
+            currentTarget(target, sizeof(target));
+            targetOnLan = target[0] != '\0' && lanPeerAddress(target, targetIp);
+        }
+    }
+}
+
+static void onIntercomEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg,
+                            uint8_t *data, size_t length) {
+    if (type != WS_EVT_DATA) {
+        return;
+    }
+    // Frames are small enough to always arrive whole
+    AwsFrameInfo *info = (AwsFrameInfo *)arg;
+    if (info->final && info->index == 0 && info->len == length && info->opcode == WS_BINARY) {
+        receiveFrame(data, length);
+    }
+}
+
+void intercomBegin(unsigned long outputDelayMs) {
+    outputDelay = outputDelayMs;
+    frameArrived = xSemaphoreCreateBinary();
+    outgoingFrames = xQueueCreate(intercomSendQueueLength, sizeof(OutgoingFrame));
+
+    intercomSocket.onEvent(onIntercomEvent);
+    intercomServer.addHandler(&intercomSocket);
+    intercomServer.begin();
+
+    // TLS to the relay needs the larger stack
+    xTaskCreatePinnedToCore(intercomTask, "intercom", 8192, NULL, 2, NULL, 0);
+    Serial.printf("Intercom listening on port %u%s.\n", intercomPort,
+                  BRUSHTALK_INTERCOM_RELAY ? ", relay enabled" : "");
+}
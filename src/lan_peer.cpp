@@ -0,0 +1,373 @@
+#include "lan_peer.h"
+
+#include <AsyncTCP.h>
+#include <ESPmDNS.h>
+#include <WiFi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/stream_buffer.h>
+#include <freertos/task.h>
+
+#include "audio_pool.h"
+#include "config.h"
+#include "inbox.h"
+#include "lan_protocol.h"
+#include "metrics.h"
+#include "storage.h"
+
+struct LanPeer {
+    char id[lanMaxIdLength + 1];
+    IPAddress ip;
+    uint16_t port;
+};
+
+// Discovered peers, shared by the outbox and intercom tasks under lanPeerMutex
+static SemaphoreHandle_t lanPeerMutex = NULL;
+static LanPeer lanPeers[lanPeerCapacity];
+static size_t lanPeerCount = 0;
+static unsigned long lastDiscoveryMs = 0;
+static bool lanPeersDiscovered = false;
+
+// Browse for other BrushTalk devices. Blocks for the length of the mDNS query.
+static void discoverLanPeers() {
+    int found = MDNS.queryService("brushtalk", "tcp");
+    lanPeerCount = 0;
+    for (int i = 0; i < found && lanPeerCount < lanPeerCapacity; i++) {
+        String id = MDNS.txt(i, "id");
+        if (id.length() == 0 || id.length() > lanMaxIdLength || id == deviceName) {
+            continue;
+        }
+        LanPeer &peer = lanPeers[lanPeerCount++];
+        strlcpy(peer.id, id.c_str(), sizeof(peer.id));
+        peer.ip = MDNS.IP(i);
+        peer.port = MDNS.port(i);
+    }
+    lastDiscoveryMs = millis();
+    lanPeersDiscovered = true;
+    Serial.printf("mDNS: %u peer(s) on the local network.\n", (unsigned)lanPeerCount);
+}
+
+static bool lookupLanPeer(const char *peerId, LanPeer &peer) {
+    for (size_t i = 0; i < lanPeerCount; i++) {
+        if (strcmp(peerId, lanPeers[i].id) == 0) {
+            peer = lanPeers[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool findLanPeerLocked(const char *peerId, LanPeer &peer) {
+    if (!lanPeersDiscovered || millis() - lastDiscoveryMs > lanPeerCacheMs) {
+        discoverLanPeers();
+        return lookupLanPeer(peerId, peer);
+    }
+    if (lookupLanPeer(peerId, peer)) {
+        return true;
+    }
+    // A peer that just came online; look again, but not on every message
+    if (millis() - lastDiscoveryMs > lanPeerRetryMs) {
+        discoverLanPeers();
+        return lookupLanPeer(peerId, peer);
+    }
+    return false;
+}
+
+static bool findLanPeer(const char *peerId, LanPeer &peer) {
+    if (lanPeerMutex == NULL) {
+        return false; // mDNS isn't running
+    }
+    xSemaphoreTake(lanPeerMutex, portMAX_DELAY);
+    bool found = findLanPeerLocked(peerId, peer);
+    xSemaphoreGive(lanPeerMutex);
+    return found;
+}
+
+bool lanPeerAddress(const char *peerId, IPAddress &ip) {
+    LanPeer peer;
+    if (WiFi.status() != WL_CONNECTED || !findLanPeer(peerId, peer)) {
+        return false;
+    }
+    ip = peer.ip;
+    return true;
+}
+
+// Send a message, read from file or, if data isn't NULL, taken from memory
+static bool sendToPeer(const char *peerId, File &file, const uint8_t *data, size_t size, const char *name,
+                       uint32_t crc) {
+    LanPeer peer;
+    if (WiFi.status() != WL_CONNECTED || !findLanPeer(peerId, peer)) {
+        return false;
+    }
+
+    AudioBlock *block = audioBlockAcquire(pdMS_TO_TICKS(1000));
+    if (block == NULL) {
+        return false;
+    }
+    LanHeader header = {};
+    strlcpy(header.sender, deviceName.c_str(), sizeof(header.sender));
+    strlcpy(header.name, name, sizeof(header.name));
+    header.size = size;
+    header.crc = crc;
+
+    block->length = lanEncodeHeader(header, block->data, audioBlockBytes);
+    WiFiClient client;
+    if (block->length == 0 || !client.connect(peer.ip, peer.port, lanPeerConnectTimeoutMs)) {
+        Serial.printf("Peer %s not reachable on the LAN.\n", peerId);
+        audioBlockRelease(block);
+        return false;
+    }
+
+    unsigned long startTime = millis();
+    bool sent = client.write(block->data, block->length) == block->length;
+    if (data != NULL) {
+        sent = sent && client.write(data, size) == size;
+    }
+    while (sent && data == NULL && file.available()) {
+        block->length = file.read(block->data, audioBlockBytes);
+        sent = block->length > 0 && client.write(block->data, block->length) == block->length;
+    }
+    audioBlockRelease(block);
+
+    int status = -1;
+    unsigned long waitStart = millis();
+    while (sent && client.connected() && millis() - waitStart < lanPeerReplyTimeoutMs) {
+        if (client.available()) {
+            status = client.read();
+            break;
+        }
+        delay(5);
+    }
+    client.stop();
+
+    if (status != LAN_STORED) {
+        Serial.printf("LAN transfer of %s to %s failed (status %d).\n", name, peerId, status);
+        return false;
+    }
+    metricsAdd(METRIC_LAN_SENT);
+    Serial.printf("Sent %s to %s over the LAN (%u bytes, %lu ms).\n", name, peerId,
+                  (unsigned)header.size, millis() - startTime);
+    return true;
+}
+
+bool lanPeerSend(const char *peerId, const char *filePath, const char *name, uint32_t crc) {
+    File file = storageHolding(filePath).open(filePath, FILE_READ);
+    if (!file) {
+        return false;
+    }
+    bool sent = sendToPeer(peerId, file, NULL, file.size(), name, crc);
+    file.close();
+    return sent;
+}
+
+bool lanPeerSendBuffer(const char *peerId, const uint8_t *data, size_t size, const char *name, uint32_t crc) {
+    File none;
+    return sendToPeer(peerId, none, data, size, name, crc);
+}
+
+static volatile uint32_t lanRemoteAddress = 0; // Of the accepted transfer
+
+static bool isConfiguredPeer(const char *peerId) {
+    size_t peerLength = strlen(peerId);
+    for (const char *name = devicePeers.c_str(); *name != '\0';) {
+        const char *comma = strchr(name, ',');
+        size_t length = comma != NULL ? (size_t)(comma - name) : strlen(name);
+        if (length == peerLength && strncmp(name, peerId, length) == 0) {
+            return true;
+        }
+        name += length + (comma != NULL ? 1 : 0);
+    }
+    return false;
+}
+
+// A transfer is only taken from a device this one is paired with (devicePeers, or any
+// BrushTalk device on the LAN if that is empty) and only from the address that device
+// announces over mDNS
+static bool isKnownSender(const char *sender) {
+    LanPeer peer;
+    if ((devicePeers.length() > 0 && !isConfiguredPeer(sender)) || !findLanPeer(sender, peer) ||
+        (uint32_t)peer.ip != lanRemoteAddress) {
+        Serial.printf("Refusing a LAN transfer claiming to be from %s from %s.\n", sender,
+                      IPAddress(lanRemoteAddress).toString().c_str());
+        return false;
+    }
+    return true;
+}
+
+// Stores an incoming transfer in the inbox the same way a download is stored
+class InboxSink : public LanMessageSink {
+public:
+    LanStatus begin(const LanHeader &header) override {
+        if (!isKnownSender(header.sender)) {
+            return LAN_REFUSED;
+        }
+        if (inboxFull()) {
+            return LAN_BUSY;
+        }
+        messageId = inboxReserveId();
+        if (messageId == 0) {
+            return LAN_BUSY;
+        }
+        file = storageForSize(header.size).open(inboxTempPath(messageId), FILE_WRITE);
+        if (!file) {
+            inboxDiscard(messageId);
+            return LAN_STORAGE_ERROR;
+        }
+        size = header.size;
+        crc = header.crc;
+        Serial.printf("Receiving %s from %s over the LAN (%u bytes).\n", header.name, header.sender, (unsigned)size);
+        return LAN_STORED;
+    }
+
+    bool write(const uint8_t *data, size_t length) override {
+        return file.write(data, length) == length;
+    }
+
+    LanStatus finish(bool complete) override {
+        file.close();
+        if (!complete) {
+            inboxDiscard(messageId);
+            return LAN_STORAGE_ERROR;
+        }
+        if (!inboxCommit(messageId, size, crc)) {
+            return LAN_STORAGE_ERROR;
+        }
+        metricsAdd(METRIC_LAN_RECEIVED);
+        return LAN_STORED;
+    }
+
+private:
+    File file;
+    uint32_t messageId = 0;
+    uint32_t size = 0;
+    uint32_t crc = 0;
+};
+
+struct LanTransfer {
+    InboxSink sink;
+    LanReceiver receiver;
+    LanTransfer() : receiver(sink) {}
+};
+
+// One incoming transfer at a time. The AsyncTCP task only copies received bytes into
+// lanReceived, acknowledges them once the receive task has consumed them, and sends the
+// status byte; reserving the id, the index and the file writes happen in the receive
+// task, so a slow card never holds up /metrics or the intercom. Bytes are acknowledged
+// late, so the TCP window keeps the sender from getting more than one window ahead.
+static AsyncServer lanServer(lanPeerPort);
+static StreamBufferHandle_t lanReceived = NULL;
+static AsyncClient *lanClient = NULL;              // AsyncTCP task only
+static uint32_t lanBytesAcked = 0;                 // AsyncTCP task only
+static bool lanReplySent = false;                  // AsyncTCP task only
+static volatile bool lanReceiving = false;         // Set when a transfer is accepted, cleared by the receive task once it is finished with it
+static volatile bool lanConnectionClosed = false;  // No more bytes will arrive
+static volatile uint32_t lanBytesConsumed = 0;     // Taken from lanReceived by the receive task
+static volatile uint8_t lanReplyStatus = LAN_PENDING;
+
+static void lanReceiveTask(void *parameter) {
+    static uint8_t chunk[audioBlockBytes];
+    LanTransfer *transfer = NULL;
+    while (true) {
+        size_t length = xStreamBufferReceive(lanReceived, chunk, sizeof(chunk), pdMS_TO_TICKS(100));
+        if (!lanReceiving) {
+            continue;
+        }
+        if (transfer == NULL) {
+            transfer = new LanTransfer();
+        }
+        if (length > 0 && !transfer->receiver.done()) {
+            transfer->receiver.feed(chunk, length);
+            if (transfer->receiver.done()) {
+                lanReplyStatus = transfer->receiver.status();
+            }
+        }
+        lanBytesConsumed += length;
+
+        if (lanConnectionClosed && xStreamBufferIsEmpty(lanReceived)) {
+            if (!transfer->receiver.done()) {
+                transfer->receiver.abort();
+            }
+            delete transfer;
+            transfer = NULL;
+            lanReceiving = false;
+        }
+    }
+}
+
+// Release the window for what the receive task has stored and answer once it is done
+static void serviceLanClient(AsyncClient *client) {
+    uint32_t consumed = lanBytesConsumed;
+    if (consumed != lanBytesAcked) {
+        client->ack(consumed - lanBytesAcked);
+        lanBytesAcked = consumed;
+    }
+    uint8_t status = lanReplyStatus;
+    if (!lanReplySent && status != LAN_PENDING) {
+        client->write((const char *)&status, 1);
+        lanReplySent = true;
+        if (status == LAN_REFUSED) {
+            client->close(); // Don't take in the rest of a stranger's body
+        }
+    }
+}
+
+static void onLanClient(void *, AsyncClient *client) {
+    if (lanReceiving) {
+        uint8_t busy = LAN_BUSY;
+        client->write((const char *)&busy, 1);
+        client->close();
+        client->onDisconnect([](void *, AsyncClient *client) { delete client; });
+        return;
+    }
+
+    lanClient = client;
+    lanRemoteAddress = client->remoteIP();
+    lanBytesAcked = 0;
+    lanReplySent = false;
+    lanBytesConsumed = 0;
+    lanReplyStatus = LAN_PENDING;
+    lanConnectionClosed = false;
+    lanReceiving = true;
+
+    client->setRxTimeout(lanPeerReplyTimeoutMs / 1000);
+    client->onData([](void *, AsyncClient *client, void *data, size_t length) {
+        client->ackLater();
+        // Never more than one TCP window outstanding, which lanReceived always has room for
+        if (xStreamBufferSend(lanReceived, data, length, 0) != length) {
+            Serial.println("LAN receive buffer overflow, dropping the transfer.");
+            client->close();
+            return;
+        }
+        serviceLanClient(client);
+    });
+    // Picks up what the receive task finished after the last segment arrived
+    client->onPoll([](void *, AsyncClient *client) {
+        serviceLanClient(client);
+    });
+    client->onTimeout([](void *, AsyncClient *client, uint32_t) {
+        client->close();
+    });
+    client->onDisconnect([](void *, AsyncClient *client) {
+        if (client == lanClient) {
+            lanClient = NULL;
+            lanConnectionClosed = true;
+        }
+        delete client;
+    });
+}
+
+void lanPeerBegin() {
+    if (!MDNS.begin(deviceName.c_str())) {
+        Serial.println("Failed to start mDNS, direct LAN transfers disabled.");
+        return;
+    }
+    MDNS.addService("brushtalk", "tcp", lanPeerPort);
+    MDNS.addServiceTxt("brushtalk", "tcp", "id", deviceName.c_str());
+    lanPeerMutex = xSemaphoreCreateMutex();
+
+    lanReceived = xStreamBufferCreate(lanReceiveBufferBytes, 1);
+    xTaskCreatePinnedToCore(lanReceiveTask, "lanrx", 4096, NULL, 1, NULL, 0);
+    lanServer.onClient(onLanClient, NULL);
+    lanServer.begin();
+    Serial.printf("Accepting LAN transfers as %s.local:%u\n", deviceName.c_str(), lanPeerPort);
+}
@@ -0,0 +1,156 @@
+#include "lan_protocol.h"
+
+#include <string.h>
+
+#include "crc32.h"
+
+static const uint8_t lanMagic[4] = {'B', 'T', 'L', 'K'};
+
+static void putLe32(uint8_t *out, uint32_t value) {
+    out[0] = value;
+    out[1] = value >> 8;
+    out[2] = value >> 16;
+    out[3] = value >> 24;
+}
+
+static uint32_t getLe32(const uint8_t *in) {
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+size_t lanEncodeHeader(const LanHeader &header, uint8_t *out, size_t capacity) {
+    size_t senderLength = strlen(header.sender);
+    size_t nameLength = strlen(header.name);
+    size_t length = 4 + 1 + 1 + senderLength + 1 + nameLength + 4 + 4;
+    if (senderLength == 0 || senderLength > lanMaxIdLength || nameLength == 0 || nameLength > lanMaxNameLength ||
+        length > capacity) {
+        return 0;
+    }
+
+    uint8_t *p = out;
+    memcpy(p, lanMagic, 4);
+    p += 4;
+    *p++ = lanProtocolVersion;
+    *p++ = senderLength;
+    memcpy(p, header.sender, senderLength);
+    p += senderLength;
+    *p++ = nameLength;
+    memcpy(p, header.name, nameLength);
+    p += nameLength;
+    putLe32(p, header.size);
+    putLe32(p + 4, header.crc);
+    return length;
+}
+
+// 1 when a whole header was parsed (length set to its size), 0 if more bytes are
+// needed, -1 if the bytes can't be a valid header
+static int lanParseHeader(const uint8_t *in, size_t available, LanHeader &header, size_t &length) {
+    size_t need = 6;
+    if (available < need) {
+        return 0;
+    }
+    if (memcmp(in, lanMagic, 4) != 0 || in[4] != lanProtocolVersion) {
+        return -1;
+    }
+    size_t senderLength = in[5];
+    if (senderLength == 0 || senderLength > lanMaxIdLength) {
+        return -1;
+    }
+    need += senderLength + 1;
+    if (available < need) {
+        return 0;
+    }
+    size_t nameLength = in[need - 1];
+    if (nameLength == 0 || nameLength > lanMaxNameLength) {
+        return -1;
+    }
+    need += nameLength + 8;
+    if (available < need) {
+        return 0;
+    }
+
+    memcpy(header.sender, in + 6, senderLength);
+    header.sender[senderLength] = '\0';
+    memcpy(header.name, in + 7 + senderLength, nameLength);
+    header.name[nameLength] = '\0';
+    header.size = getLe32(in + need - 8);
+    header.crc = getLe32(in + need - 4);
+    // The name becomes a file name on the receiver; no path separators, and nothing
+    // hidden or naming a directory such as "." or ".."
+    if (header.name[0] == '.' || strchr(header.name, '/') != NULL || strchr(header.name, '\\') != NULL ||
+        header.size == 0 || header.size > lanMaxMessageSize) {
+        return -1;
+    }
+    length = need;
+    return 1;
+}
+
+LanReceiver::LanReceiver(LanMessageSink &sink)
+    : sink(sink), state(STATE_HEADER), result(LAN_PENDING), parsed(), headerLength(0), bodyReceived(0), bodyCrc(0) {
+}
+
+void LanReceiver::complete(LanStatus status) {
+    result = status;
+    state = STATE_DONE;
+}
+
+size_t LanReceiver::feed(const uint8_t *data, size_t length) {
+    size_t used = 0;
+
+    if (state == STATE_HEADER) {
+        // The header is small; collect it whole, then hand the rest to the body
+        size_t copy = length < lanMaxHeaderSize - headerLength ? length : lanMaxHeaderSize - headerLength;
+        memcpy(headerBuffer + headerLength, data, copy);
+        size_t buffered = headerLength + copy;
+
+        size_t headerSize = 0;
+        int parsedHeader = lanParseHeader(headerBuffer, buffered, parsed, headerSize);
+        if (parsedHeader < 0) {
+            complete(LAN_BAD_REQUEST);
+            return copy;
+        }
+        if (parsedHeader == 0) {
+            headerLength = buffered;
+            return copy;
+        }
+
+        used = headerSize - headerLength;
+        headerLength = headerSize;
+        LanStatus accepted = sink.begin(parsed);
+        if (accepted != LAN_STORED) {
+            complete(accepted);
+            return used;
+        }
+        state = STATE_BODY;
+    }
+
+    if (state == STATE_BODY) {
+        uint32_t remaining = parsed.size - bodyReceived;
+        size_t chunk = length - used < remaining ? length - used : remaining;
+        if (chunk > 0) {
+            if (!sink.write(data + used, chunk)) {
+                sink.finish(false);
+                complete(LAN_STORAGE_ERROR);
+                return used + chunk;
+            }
+            bodyCrc = crc32Update(bodyCrc, data + used, chunk);
+            bodyReceived += chunk;
+            used += chunk;
+        }
+        if (bodyReceived == parsed.size) {
+            if (bodyCrc != parsed.crc) {
+                sink.finish(false);
+                complete(LAN_CRC_MISMATCH);
+            } else {
+                complete(sink.finish(true));
+            }
+        }
+    }
+    return used;
+}
+
+void LanReceiver::abort() {
+    if (state == STATE_BODY) {
+        sink.finish(false);
+    }
+    complete(LAN_STORAGE_ERROR);
+}
@@ -0,0 +1,121 @@
+#include "loudness.h"
+
+#include <math.h>
+#include <string.h>
+
+// Loudness of a mean square, with the -0.691 dB offset that puts a 997 Hz full-scale
+// sine at -3.01 LUFS
+static float loudnessOf(float meanSquare) {
+    return -0.691f + 10.0f * log10f(meanSquare);
+}
+
+void LoudnessMeter::begin(uint32_t sampleRate) {
+    // The K-weighting filters are specified at 48 kHz; these are the analog prototypes
+    // they come from, mapped to this rate with the bilinear transform
+    float k = tanf((float)M_PI * 1681.9745f / sampleRate);
+    float q = 0.70717524f;
+    float vh = powf(10.0f, 3.9998438f / 20.0f);
+    float vb = powf(vh, 0.49966678f);
+    float a0 = 1.0f + k / q + k * k;
+    shelf = {(vh + vb * k / q + k * k) / a0, 2.0f * (k * k - vh) / a0, (vh - vb * k / q + k * k) / a0,
+             2.0f * (k * k - 1.0f) / a0, (1.0f - k / q + k * k) / a0, 0.0f, 0.0f};
+
+    k = tanf((float)M_PI * 38.135471f / sampleRate);
+    q = 0.50032704f;
+    a0 = 1.0f + k / q + k * k;
+    highPass = {1.0f, -2.0f, 1.0f, 2.0f * (k * k - 1.0f) / a0, (1.0f - k / q + k * k) / a0, 0.0f, 0.0f};
+
+    stepSamples = sampleRate / 10;
+    stepPosition = 0;
+    stepsDone = 0;
+    memset(stepEnergy, 0, sizeof(stepEnergy));
+    memset(histogram, 0, sizeof(histogram));
+    samplePeak = 0;
+}
+
+void LoudnessMeter::add(const int16_t *samples, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        int16_t sample = samples[i];
+        uint16_t magnitude = sample < 0 ? -(int32_t)sample : sample;
+        if (magnitude > samplePeak) {
+            samplePeak = magnitude;
+        }
+
+        float weighted = highPass.run(shelf.run(sample * (1.0f / 32768.0f)));
+        stepEnergy[stepsDone & 3] += weighted * weighted;
+        if (++stepPosition < stepSamples) {
+            continue;
+        }
+
+        // A step is done: the 400 ms block ending here gets its histogram bin
+        stepPosition = 0;
+        stepsDone++;
+        if (stepsDone >= 4) {
+            float blockEnergy = stepEnergy[0] + stepEnergy[1] + stepEnergy[2] + stepEnergy[3];
+            float blockLoudness = loudnessOf(blockEnergy / (4.0f * stepSamples));
+            if (blockLoudness > loudnessAbsoluteGateLufs) {
+                int bin = (int)((blockLoudness - loudnessAbsoluteGateLufs) * 10.0f);
+                histogram[bin < (int)loudnessHistogramBins ? bin : loudnessHistogramBins - 1]++;
+            }
+        }
+        stepEnergy[stepsDone & 3] = 0.0f;
+    }
+}
+
+bool LoudnessMeter::measured() const {
+    for (size_t bin = 0; bin < loudnessHistogramBins; bin++) {
+        if (histogram[bin] > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+float LoudnessMeter::integratedLufs() const {
+    // First pass with the absolute gate only, second with the relative gate it gives.
+    // Blocks count at the middle of their bin, 0.05 LU off at most.
+    float gate = loudnessAbsoluteGateLufs;
+    float loudness = loudnessAbsoluteGateLufs;
+    for (int pass = 0; pass < 2; pass++) {
+        float energy = 0.0f;
+        uint32_t blocks = 0;
+        for (size_t bin = 0; bin < loudnessHistogramBins; bin++) {
+            float binLoudness = loudnessAbsoluteGateLufs + (bin + 0.5f) * 0.1f;
+            if (histogram[bin] > 0 && binLoudness >= gate) {
+                energy += histogram[bin] * powf(10.0f, (binLoudness + 0.691f) / 10.0f);
+                blocks += histogram[bin];
+            }
+        }
+        if (blocks == 0) {
+            break;
+        }
+        loudness = loudnessOf(energy / blocks);
+        gate = loudness + loudnessRelativeGateLu;
+    }
+    return loudness;
+}
+
+float LoudnessMeter::playbackGainDb() const {
+    if (!measured() || samplePeak == 0) {
+        return 0.0f;
+    }
+    float gain = loudnessTargetLufs - integratedLufs();
+    float peakRoom = 20.0f * log10f(loudnessPeakCeiling * 32767.0f / samplePeak);
+    gain = gain < peakRoom ? gain : peakRoom;
+    gain = gain < loudnessMaxGainDb ? gain : loudnessMaxGainDb;
+    return gain > loudnessMinGainDb ? gain : loudnessMinGainDb;
+}
+
+void applyGainQ12(int16_t *samples, size_t count, int32_t gainQ12) {
+    if (gainQ12 == loudnessUnityGainQ12) {
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        int32_t value = (samples[i] * gainQ12 + 2048) >> 12;
+        samples[i] = value > 32767 ? 32767 : (value < -32768 ? -32768 : value);
+    }
+}
+
+int32_t gainDbToQ12(float gainDb) {
+    return (int32_t)lroundf(loudnessUnityGainQ12 * powf(10.0f, gainDb / 20.0f));
+}
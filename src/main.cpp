@@ -1,11 +1,32 @@
 #include <Arduino.h>
 #include <WiFi.h>
-#include <HTTPClient.h>
 #include <WiFiClientSecure.h>
-#include <SD.h>
 #include <FS.h>
 #include <driver/i2s.h>
 #include <driver/adc.h>
+#include <freertos/event_groups.h>
+
+#include "adpcm.h"
+#include "audio_pool.h"
+#include "capture_quality.h"
+#include "config.h"
+#include "crc32.h"
+#include "http_connection.h"
+#include "inbox.h"
+#include "intercom.h"
+#include "lan_peer.h"
+#include "loudness.h"
+#include "message_index.h"
+#include "metrics.h"
+#include "noise_suppressor.h"
+#include "outbox.h"
+#include "ram_message.h"
+#include "recording_format.h"
+#include "storage.h"
+#include "uploader.h"
+#include "wav.h"
+#include "waveform_peaks.h"
+#include "wifi_link.h"
 
 // Pin definitions
 const int recordRedLEDPin = 33;     // Record LED pin
@@ -23,14 +44,15 @@ const String serverURL = "https://8ea3035bbf6b75532a241ec23480c4ee.serveo.net";
 
 // Audio settings
 const int sampleRate = 44100;
-const int bufferSize = 1024;
+const int bufferSize = audioBlockSamples; // One DMA buffer fills one pool block
 const int bitsPerSample = 16;
 const int channels = 1; // Mono
+const unsigned long recordDurationMs = 5000;
+const unsigned long talkHoldMs = 300; // Holding the record button this long talks live instead of recording
 
-// File management
-const String recordedFilePath = "/uploaded_audio_device1.wav";
-const String downloadedFilePath = "/uploaded_audio_device2.wav";
-const String checkFileURL = "/check/device2"; // Endpoint to check for new audio files from device2
+// Formats playback can decode, sent with every download; the server picks the smallest
+// and transcodes to it if needed
+const char *acceptedFormats = "ima-adpcm-16000, pcm16-16000, pcm16-44100";
 
 // I2S configurations for recording
 i2s_config_t i2s_config_record = {
@@ -40,8 +62,8 @@ i2s_config_t i2s_config_record = {
     .channel_format = I2S_CHANNEL_FMT_ONLY_LEFT,
     .communication_format = I2S_COMM_FORMAT_I2S_LSB,
     .intr_alloc_flags = ESP_INTR_FLAG_LEVEL1,
-    .dma_buf_count = 4,
-    .dma_buf_len = bufferSize,
+    .dma_buf_count = 16, // Short buffers hand live intercom frames over within 16 ms;
+    .dma_buf_len = bufferSize / 4, // together they still hold as much as before for recordings
     .use_apll = false,
     .tx_desc_auto_clear = false,
     .fixed_mclk = 0
@@ -73,103 +95,195 @@ i2s_pin_config_t pin_config_playback = {
     .data_out_num = 16,  // Data output pin for speaker
     .data_in_num = I2S_PIN_NO_CHANGE}; // No data input pin needed for playback
 
+// Recording and playback each own an I2S peripheral, installed once at boot and only
+// started and stopped afterwards, so the driver's DMA buffers are allocated a single time
+const i2s_port_t recordPort = I2S_NUM_0;
+const i2s_port_t playbackPort = I2S_NUM_1;
+uint32_t recordRate = sampleRate;   // Current clock of the record port, set per recording
+uint32_t playbackRate = sampleRate; // Current clock of the playback port
+
+// Messages and live intercom streams share the speaker; whoever holds this plays
+SemaphoreHandle_t playbackPortLock = NULL;
+
+// I2S driver events, used to count DMA queue overflows
+QueueHandle_t recordEventQueue = NULL;
+QueueHandle_t playbackEventQueue = NULL;
+const int i2sEventQueueLength = 8;
+
 // Timers
 unsigned long lastCheckTime = 0;
 const unsigned long checkInterval = 60000; // Check for new audio every 60 seconds
 
-bool newAudioAvailable = false;
+// A download held in RAM is only acknowledged once it was played or stored, so a reset
+// before then can't lose it: the server still has it and sends it again
+uint32_t heldDownloadId = 0;
+char heldDownloadName[64] = "";
+
+// Recording and live talk both run on the loop task, so they share one suppressor
+NoiseSuppressor noiseSuppressor;
+
+// Loudness and waveform preview of the recording in progress, taken from the samples as
+// they are stored
+LoudnessMeter loudnessMeter;
+WaveformPeaks waveformPeaks;
+
+// What noise suppression cost during one recording or live talk
+struct NoiseLoad {
+    uint32_t sampleRate;
+    uint64_t cpuUs;
+    uint64_t audioUs;
+    uint32_t maxUsPer10Ms; // Worst single call, scaled to 10 ms of audio
+};
 
 // Function declarations
 void checkForNewAudio();
 void recordAudio();
-void uploadAudio();
-void downloadAudio();
+void talkLive();
+bool downloadAudio(HttpConnection &http, const char *filename);
+void acknowledgeHeldDownload(HttpConnection &http);
 void playAudio();
 void handleRecordButton();
 void handlePlayButton();
-void configureI2S(i2s_config_t& config, i2s_pin_config_t& pinConfig);
-void writeWAVHeader(File &file, size_t dataSize);
+bool installI2S(i2s_port_t port, const i2s_config_t &config, const i2s_pin_config_t &pinConfig, QueueHandle_t *eventQueue);
 size_t getFileSize(const String& filePath);
 void blinkPlayButton();
+void countI2SOverflows();
+bool buttonHeld(int pin, unsigned long holdMs);
+void intercomPlayoutTask(void *parameter);
+void noiseSuppressionBegin(NoiseLoad &load, uint32_t sampleRate);
+void suppressNoise(NoiseLoad &load, int16_t *samples, size_t count);
+void noiseSuppressionReport(const NoiseLoad &load);
+void captureQualityReport(const CaptureQuality &quality);
+
+// Set by the storage task once flash, the SD card and everything kept on them are ready
+EventGroupHandle_t bootEvents = NULL;
+const EventBits_t STORAGE_READY = BIT0;
+const EventBits_t STORAGE_FAILED = BIT1;
+
+// Mount storage and load the state kept there, while Wi-Fi associates in its own task
+void storageTask(void *parameter) {
+    unsigned long mountStart = millis();
+    // Flash partition plus the fastest bus the SD card works on, if there is a card
+    if (!storageBegin(CSPin)) {
+        Serial.println("No usable storage: neither flash nor SD card could be mounted.");
+        xEventGroupSetBits(bootEvents, STORAGE_FAILED);
+        vTaskDelete(NULL);
+        return;
+    }
+    unsigned long mountMs = millis() - mountStart;
 
-void setup() {
-    Serial.begin(115200);
-    delay(5000);
+    // Device id and peers, from the SD config file or the build-time defaults
+    loadDeviceConfig();
 
-    Serial.println("Setup starting...");
+    // Rebuild inbox and outbox state from the message index in one sequential read
+    unsigned long indexStart = millis();
+    messageIndexBegin();
 
-    // Initialize SD card
-    Serial.print("Initializing SD card on pin ");
-    Serial.println(CSPin);
-    if (!SD.begin(CSPin)) {
-        Serial.println("Failed to initialize SD card. Check connections or try a different SD card.");
-        return;
-    }
-    Serial.println("SD card initialized successfully.");
+    // Received messages wait in the inbox until they are played
+    inboxBegin();
 
-    // Connect to Wi-Fi
-    Serial.print("Connecting to Wi-Fi network ");
-    Serial.println(ssid);
-    WiFi.begin(ssid, password);
-    int attempts = 0;
-    while (WiFi.status() != WL_CONNECTED) {
-        delay(1000);
-        Serial.print(".");
-        attempts++;
-        if (attempts > 30) {
-            Serial.println("Failed to connect to Wi-Fi. Please check SSID and password.");
-            return;
-        }
-    }
-    Serial.println("\nConnected to Wi-Fi successfully.");
+    // Recordings queue up in storage and are uploaded in the background
+    outboxBegin();
+    outboxStartUploader();
+    unsigned long indexMs = millis() - indexStart;
+
+    // Peers on the same network exchange messages directly; needs the device id and inbox
+    lanPeerBegin();
+
+    // Live push-to-talk with the peers; streams coming in play as soon as they arrive
+    intercomBegin(i2s_config_playback.dma_buf_count * i2s_config_playback.dma_buf_len * 1000 / sampleRate);
+    xTaskCreatePinnedToCore(intercomPlayoutTask, "playout", 4096, NULL, 3, NULL, 1);
+
+    // Prometheus-style counters at http://<device>/metrics, served once the link is up;
+    // the page reads the inbox and outbox, so it starts after them
+    metricsBegin();
+
+    xEventGroupSetBits(bootEvents, STORAGE_READY);
+    Serial.printf("Boot: storage ready at %lu ms (mount %lu ms, message state %lu ms).\n", millis(), mountMs, indexMs);
+    vTaskDelete(NULL);
+}
+
+// Wait up to timeoutMs for the storage task. Returns false if storage is not usable.
+bool waitForStorage(unsigned long timeoutMs) {
+    EventBits_t bits = xEventGroupWaitBits(bootEvents, STORAGE_READY | STORAGE_FAILED, pdFALSE, pdFALSE,
+                                           pdMS_TO_TICKS(timeoutMs));
+    return (bits & STORAGE_READY) != 0;
+}
+
+void setup() {
+    Serial.begin(115200);
+    Serial.printf("Setup starting at %lu ms...\n", millis());
 
-    // Install I2S driver for recording
-    Serial.print("Installing I2S driver for recording...");
-    configureI2S(i2s_config_record, pin_config_record);
+    // Audio buffers come out of the heap before anything else can fragment it
+    audioPoolBegin();
+    // A slot holds the longest recording in the best format the recorder picks, which is
+    // also the largest format downloads are accepted in. The margin matches recordAudio.
+    ramMessageBegin(recordingBytes(chooseRecordingFormat(recordDurationMs, -1.0f), recordDurationMs) +
+                    audioBlockBytes + peakMaxChunkBytes);
 
-    // Pin setup
+    // Buttons and the capture path first, so the device responds as soon as possible
     pinMode(recordRedButtonPin, INPUT_PULLUP);
     pinMode(recordRedLEDPin, OUTPUT);
     pinMode(playBlueButtonPin, INPUT_PULLUP);
     pinMode(playBlueLEDPin, OUTPUT);
 
-    Serial.println("Setup completed successfully.");
+    // Both I2S drivers stay installed, stopped until a recording or playback starts
+    playbackPortLock = xSemaphoreCreateMutex();
+    installI2S(recordPort, i2s_config_record, pin_config_record, &recordEventQueue);
+    installI2S(playbackPort, i2s_config_playback, pin_config_playback, &playbackEventQueue);
+    Serial.printf("Boot: buttons and audio ready at %lu ms.\n", millis());
+
+    // Storage mount and Wi-Fi association run side by side. The Wi-Fi supervisor keeps
+    // reconnecting by itself whenever the link drops. It starts first: the storage task
+    // opens the LAN, intercom and metrics servers, which need the network stack it sets up.
+    Serial.print("Connecting to Wi-Fi network ");
+    Serial.println(ssid);
+    wifiLinkBegin(ssid, password);
+    bootEvents = xEventGroupCreate();
+    xTaskCreatePinnedToCore(storageTask, "storage", 6144, NULL, 2, NULL, 1);
+
+    // Server host and the header lines every request carries, prepared once
+    httpBegin();
+
+    // Wall-clock time for the message index timestamps
+    configTime(0, 0, "pool.ntp.org");
+
+    Serial.printf("Boot: setup done at %lu ms.\n", millis());
 }
 
 void loop() {
-    // Handle record button press
+    // Everything below works on stored messages
+    if (!waitForStorage(1000)) {
+        delay(1000); // Without a card there is nothing to do but wait for a reset
+        return;
+    }
+
+    static bool wifiWasUp = false;
+    if (!wifiWasUp && WiFi.status() == WL_CONNECTED) {
+        wifiWasUp = true;
+        Serial.printf("Boot: Wi-Fi up at %lu ms.\n", millis());
+    }
+
+    // Handle record button press: held, it talks live to a peer that is reachable;
+    // pressed, it records a message
     if (digitalRead(recordRedButtonPin) == LOW) {
-        Serial.println("Record button pressed.");
         digitalWrite(recordRedLEDPin, HIGH); // Turn on LED
-
-        // Check if file exists and delete it before recording
-        if (SD.exists(recordedFilePath)) {
-            Serial.println("Deleting existing file before recording...");
-            if (!SD.remove(recordedFilePath)) {
-                Serial.println("Error: Failed to delete existing file.");
-                digitalWrite(recordRedLEDPin, LOW); // Turn off LED
-                return;
-            }
+        if (intercomAvailable() && buttonHeld(recordRedButtonPin, talkHoldMs)) {
+            Serial.println("Record button held.");
+            talkLive();
+        } else {
+            Serial.println("Record button pressed.");
+            recordAudio();
         }
-
-        recordAudio();
         digitalWrite(recordRedLEDPin, LOW); // Turn off LED
     }
 
     // Handle play button press
-    if (digitalRead(playBlueButtonPin) == LOW && newAudioAvailable) {
+    if (digitalRead(playBlueButtonPin) == LOW && inboxCount() > 0) {
         Serial.println("Play button pressed.");
         digitalWrite(playBlueLEDPin, HIGH); // Turn on LED
-        playAudio();
+        playAudio(); // Plays every waiting message back to back and removes them
         digitalWrite(playBlueLEDPin, LOW); // Turn off LED
-        newAudioAvailable = false; // Reset after playing
-        if (SD.exists(downloadedFilePath)) {
-            if (SD.remove(downloadedFilePath)) {
-                Serial.println("Downloaded audio file deleted after playback.");
-            } else {
-                Serial.println("Error: Failed to delete downloaded audio file after playback.");
-            }
-        }
     }
 
     // Periodically check for new audio files
@@ -178,80 +292,210 @@ void loop() {
         checkForNewAudio();
     }
 
-    if (newAudioAvailable) {
+    if (inboxCount() > 0) {
         blinkPlayButton(); // Blink play button if a new audio file is available
     }
 
-    delay(1000); // Loop delay
+    // Loop delay, cut short when the record button goes down so talking starts right away
+    for (int i = 0; i < 50 && digitalRead(recordRedButtonPin) == HIGH; i++) {
+        delay(20);
+    }
 }
 
 void checkForNewAudio() {
+    if (WiFi.status() != WL_CONNECTED) {
+        return; // The Wi-Fi supervisor is reconnecting; the next check catches up
+    }
     Serial.println("Checking for new audio files...");
 
+    if (inboxFull()) {
+        Serial.println("Inbox full, skipping check until messages are played.");
+        return;
+    }
+
     WiFiClientSecure client;
     client.setInsecure(); // Disable SSL certificate verification for simplicity
+    client.setTimeout(15000);
+    HttpConnection http(client);
 
-    HTTPClient http;
-    http.begin(client, serverURL + checkFileURL); // Use the correct endpoint for checking
+    acknowledgeHeldDownload(http);
 
-    int httpResponseCode = http.GET();
-    if (httpResponseCode == 200) {
-        Serial.println("New audio file available, downloading...");
-        downloadAudio();
-        newAudioAvailable = true; // Set flag to indicate new audio is available
-    } else {
+    // Messages routed to this device
+    HttpResponse response;
+    unsigned long checkStart = millis();
+    int httpResponseCode = http.request("GET", response, "/check/", deviceName.c_str());
+    metricsObserve(STAGE_CHECK, millis() - checkStart);
+    if (httpResponseCode != 200) {
         Serial.printf("Check failed with HTTP response code: %d\n", httpResponseCode);
+        http.end();
+        return;
     }
 
+    // The server lists the pending file names, one per line, oldest first. Names that
+    // don't fit here are picked up by the next check.
+    static char fileList[1024];
+    size_t listLength = 0;
+    int bytesRead;
+    while (listLength < sizeof(fileList) - 1 &&
+           (bytesRead = http.read((uint8_t *)fileList + listLength, sizeof(fileList) - 1 - listLength)) > 0) {
+        listLength += bytesRead;
+    }
     http.end();
+    if (listLength == sizeof(fileList) - 1) {
+        while (listLength > 0 && fileList[listLength - 1] != '\n') {
+            listLength--; // Drop the name that was cut off
+        }
+    }
+    fileList[listLength] = '\0';
+
+    // Fetch everything that is pending on the same connection
+    int downloaded = 0;
+    char *position = NULL;
+    for (char *filename = strtok_r(fileList, "\r\n", &position); filename != NULL && !inboxFull();
+         filename = strtok_r(NULL, "\r\n", &position)) {
+        while (*filename == ' ') {
+            filename++;
+        }
+        if (*filename == '\0' || (heldDownloadId != 0 && strcmp(filename, heldDownloadName) == 0)) {
+            continue; // The held download, until its acknowledgement goes through
+        }
+        unsigned long downloadStart = millis();
+        if (downloadAudio(http, filename)) {
+            downloaded++;
+            metricsAdd(METRIC_DOWNLOADS_OK);
+            metricsObserve(STAGE_DOWNLOAD, millis() - downloadStart);
+        } else {
+            metricsAdd(METRIC_DOWNLOADS_FAILED);
+        }
+    }
+    Serial.printf("Downloaded %d new message(s), %u waiting in inbox.\n", downloaded, (unsigned)inboxCount());
 }
 
-void downloadAudio() {
-    Serial.println("Downloading audio...");
-
-    WiFiClientSecure client;
-    client.setInsecure();
-    client.setTimeout(15000);
+bool downloadAudio(HttpConnection &http, const char *filename) {
+    Serial.printf("Downloading %s...\n", filename);
 
-    HTTPClient http;
-    String downloadURL = serverURL + "/download/device2/uploaded_audio_device2.wav";
-    http.begin(client, downloadURL);
+    HttpResponse response;
+    http.begin("GET", "/download/", deviceName.c_str(), "/", filename);
+    http.header("X-Accept-Formats", acceptedFormats);
+    int httpResponseCode = http.send() && http.readResponse(response) ? response.status : -1;
+    if (httpResponseCode != 200) {
+        Serial.printf("Download failed with HTTP response code: %d\n", httpResponseCode);
+        http.end();
+        return false;
+    }
 
-    File audioFile = SD.open(downloadedFilePath, FILE_WRITE);
-    if (!audioFile) {
-        Serial.println("Failed to open file for writing. Check SD card and try again.");
-        return;
+    uint32_t messageId = inboxReserveId();
+    if (messageId == 0) {
+        http.end();
+        return false;
+    }
+    // A short message of known length is received into RAM and played from there
+    RamMessage *ramMessage = NULL;
+    if (heldDownloadId == 0 && response.contentLength >= 0 && strlen(filename) < sizeof(heldDownloadName)) {
+        ramMessage = ramMessageClaim(RAM_INBOUND, messageId, response.contentLength);
     }
 
-    int httpResponseCode = http.GET();
-    if (httpResponseCode == 200) {
-        WiFiClient *stream = http.getStreamPtr();
-        size_t totalBytesDownloaded = 0;
-        uint8_t buffer[512]; // Adjust buffer size as needed
-        while (stream->available()) {
-            int bytesRead = stream->readBytes(buffer, sizeof(buffer));
-            if (bytesRead > 0) {
-                audioFile.write(buffer, bytesRead);
-                totalBytesDownloaded += bytesRead;
-            }
+    AudioBlock *block = NULL;
+    File audioFile;
+    if (ramMessage == NULL) {
+        block = audioBlockAcquire(pdMS_TO_TICKS(1000));
+        if (block == NULL) {
+            Serial.println("No free audio buffer, will retry on the next check.");
+            inboxDiscard(messageId);
+            http.end();
+            return false;
+        }
+        // Small messages go to flash, the rest to SD; a length the server didn't send counts as large
+        size_t expectedSize = response.contentLength >= 0 ? response.contentLength : SIZE_MAX;
+        audioFile = storageForSize(expectedSize).open(inboxTempPath(messageId), FILE_WRITE);
+        if (!audioFile) {
+            Serial.println("Failed to open file for writing. Check SD card and try again.");
+            inboxDiscard(messageId);
+            audioBlockRelease(block);
+            http.end();
+            return false;
         }
-        Serial.printf("Download completed. Total bytes downloaded: %d\n", totalBytesDownloaded);
+    }
 
-        // Delete the file from the server
-        http.end();
-        http.begin(client, downloadURL);
-        int deleteResponseCode = http.sendRequest("DELETE");
-        if (deleteResponseCode == 200) {
-            Serial.println("Audio file deleted from server after download.");
-        } else {
-            Serial.printf("Failed to delete file from server, HTTP response code: %d\n", deleteResponseCode);
+    // The body is read straight into the RAM slot or a block until Content-Length bytes
+    // have arrived; a stalled or dropped connection ends it early
+    int expectedBytes = response.contentLength;
+    const char *audioFormat = response.audioFormat[0] != '\0' ? response.audioFormat : "original format";
+    size_t totalBytesDownloaded = 0;
+    uint32_t receivedCrc = 0; // Computed as the bytes stream in, so the file is never reread
+    int bytesRead = 0;
+    while (true) {
+        uint8_t *target = block != NULL ? block->data : ramMessage->data + totalBytesDownloaded;
+        size_t room = block != NULL ? audioBlockBytes : ramMessageCapacity() - totalBytesDownloaded;
+        if (room == 0 || (bytesRead = http.read(target, room)) <= 0) {
+            break;
+        }
+        if (block != NULL) {
+            unsigned long writeStart = micros();
+            audioFile.write(target, bytesRead);
+            metricsObserveSdWrite(micros() - writeStart);
         }
+        totalBytesDownloaded += bytesRead;
+        receivedCrc = crc32Update(receivedCrc, target, bytesRead);
+    }
+    if (ramMessage != NULL) {
+        ramMessage->length = totalBytesDownloaded;
     } else {
-        Serial.printf("Download failed with HTTP response code: %d\n", httpResponseCode);
+        audioFile.close();
+        audioBlockRelease(block);
+    }
+    http.end();
+    metricsAdd(METRIC_BYTES_DOWNLOADED, totalBytesDownloaded);
+    Serial.printf("Download completed. Total bytes downloaded: %d (%s)\n", totalBytesDownloaded, audioFormat);
+
+    if (bytesRead < 0 || (expectedBytes >= 0 && (int)totalBytesDownloaded != expectedBytes)) {
+        Serial.printf("Download incomplete (%d of %d bytes), will retry on the next check.\n", totalBytesDownloaded, expectedBytes);
+        inboxDiscard(messageId);
+        return false;
+    }
+    if (response.hasCrc && receivedCrc != response.crc) {
+        // Not acknowledged, so the server keeps the message and the next check retries it
+        Serial.printf("CRC32 mismatch (expected %08x, got %08x), discarding download.\n", response.crc, receivedCrc);
+        inboxDiscard(messageId);
+        return false;
+    }
+    if (!inboxCommit(messageId, totalBytesDownloaded, receivedCrc)) {
+        return false;
+    }
+
+    if (ramMessage != NULL) {
+        heldDownloadId = messageId;
+        strlcpy(heldDownloadName, filename, sizeof(heldDownloadName));
+        Serial.printf("Message %u held in RAM, acknowledged once played or stored.\n", (unsigned)messageId);
+        return true;
+    }
+
+    // Only acknowledge once the message is safely in the inbox
+    int deleteResponseCode = http.request("DELETE", response, "/download/", deviceName.c_str(), "/", filename);
+    http.end();
+    if (deleteResponseCode == 200) {
+        Serial.println("Audio file deleted from server after download.");
+    } else {
+        Serial.printf("Failed to delete file from server, HTTP response code: %d\n", deleteResponseCode);
     }
+    return true;
+}
 
-    audioFile.close();
+// Acknowledge the download held in RAM once it was played. If it is still waiting for
+// the play button it is stored first, which also frees the slot for the next one.
+void acknowledgeHeldDownload(HttpConnection &http) {
+    if (heldDownloadId == 0 || !inboxStore(heldDownloadId)) {
+        return; // Nothing held, or storing failed; it stays unacknowledged in RAM
+    }
+    HttpResponse response;
+    int deleteResponseCode = http.request("DELETE", response, "/download/", deviceName.c_str(), "/", heldDownloadName);
     http.end();
+    if (deleteResponseCode == 200 || deleteResponseCode == 404) {
+        Serial.printf("Held message %u acknowledged to the server.\n", (unsigned)heldDownloadId);
+        heldDownloadId = 0;
+    } else {
+        Serial.printf("Failed to delete file from server, HTTP response code: %d\n", deleteResponseCode);
+    }
 }
 
 void blinkPlayButton() {
@@ -260,203 +504,627 @@ void blinkPlayButton() {
     digitalWrite(playBlueLEDPin, ledState ? HIGH : LOW);
 }
 
-void playAudio() {
-    Serial.println("Playing audio...");
+// An inbox message being played, decoded block by block into 16-bit samples
+struct PlaybackSource {
+    File file;
+    const uint8_t *data; // The RAM slot, for a message held there; file is unused then
+    size_t offset;       // Next byte to read from data
+    WavInfo info;
+    uint32_t remaining; // Bytes of audio data not read yet
+    int32_t gainQ12;    // From the message's loud chunk, unity without one
+};
 
-    File audioFile = SD.open(downloadedFilePath, FILE_READ);
-    if (!audioFile) {
-        Serial.println("Failed to open file for reading. Check SD card and file path.");
-        return;
+// Open an inbox message, parse its header and position it at the first sample
+bool openInboxMessage(uint32_t messageId, PlaybackSource &source) {
+    RamMessage *ramMessage = ramMessageFind(RAM_INBOUND, messageId);
+    source.data = NULL;
+    bool validHeader;
+    if (ramMessage != NULL) {
+        source.data = ramMessage->data;
+        validHeader = wavReadHeader(ramMessage->data, ramMessage->length, source.info, source.offset);
+    } else {
+        String audioPath = inboxAudioPath(messageId);
+        source.file = storageHolding(audioPath.c_str()).open(audioPath, FILE_READ);
+        if (!source.file) {
+            Serial.printf("Failed to open message %u for reading. Check SD card and file path.\n", (unsigned)messageId);
+            return false;
+        }
+        validHeader = wavReadHeader(source.file, source.info);
+    }
+    if (!validHeader) {
+        Serial.printf("Message %u is not a valid WAV file.\n", (unsigned)messageId);
+        source.file.close();
+        return false;
     }
 
-    Serial.println("File opened successfully for reading.");
+    const WavInfo &info = source.info;
+    bool playable = info.channels == 1 &&
+        ((info.format == wavFormatPcm && info.bitsPerSample == 16) ||
+         (info.format == wavFormatImaAdpcm && info.blockAlign <= audioBlockBytes &&
+          (size_t)(info.blockAlign - 4) * 2 + 1 <= audioBlockSamples));
+    if (!playable) {
+        Serial.printf("Message %u has an unsupported format (tag %u, %u channel(s), %u bits).\n", (unsigned)messageId,
+                      info.format, info.channels, info.bitsPerSample);
+        source.file.close();
+        return false;
+    }
+    source.remaining = info.dataSize;
+    source.gainQ12 = info.hasLoudness ? gainDbToQ12(info.gainCentiDb / 100.0f) : loudnessUnityGainQ12;
+    return true;
+}
 
+// Fill out with the next samples of a message, one block at most. ADPCM is read into
+// coded first and decoded from there. Returns false at the end of the message.
+bool readPlaybackSamples(PlaybackSource &source, AudioBlock *coded, AudioBlock *out) {
+    AudioBlock *target = source.info.format == wavFormatImaAdpcm ? coded : out;
+    uint32_t limit = source.info.format == wavFormatImaAdpcm ? source.info.blockAlign : audioBlockBytes;
+    uint32_t wanted = min(limit, source.remaining);
+    int bytesRead;
+    if (source.data != NULL) {
+        memcpy(target->data, source.data + source.offset, wanted);
+        source.offset += wanted;
+        bytesRead = wanted;
+    } else {
+        bytesRead = source.file.read(target->data, wanted);
+    }
+    target->length = bytesRead > 0 ? bytesRead : 0;
+    source.remaining = bytesRead > 0 ? source.remaining - bytesRead : 0;
+    if (target == coded) {
+        out->length = adpcmDecodeBlock(coded->data, coded->length, out->samples()) * sizeof(int16_t);
+    }
+    applyGainQ12(out->samples(), out->length / sizeof(int16_t), source.gainQ12);
+    return out->length > 0;
+}
 
-    i2s_driver_uninstall(I2S_NUM_0);
-    // Install I2S driver for playback
-    configureI2S(i2s_config_playback, pin_config_playback);
+void playAudio() {
+    Serial.printf("Playing %u message(s)...\n", (unsigned)inboxCount());
+    unsigned long playStart = millis();
+    bool playbackStarted = false;
+
+    // A live stream playing now finishes first
+    xSemaphoreTake(playbackPortLock, portMAX_DELAY);
+
+    // Samples going to I2S, compressed input for the decoder, and the first block of the
+    // next message, read while the current one is finishing
+    AudioBlock *block = audioBlockAcquire(pdMS_TO_TICKS(1000));
+    AudioBlock *coded = audioBlockAcquire(pdMS_TO_TICKS(1000));
+    AudioBlock *prefetch = audioBlockAcquire(pdMS_TO_TICKS(1000));
+    if (block == NULL || coded == NULL || prefetch == NULL) {
+        Serial.println("No free audio buffers, playback skipped.");
+        audioBlockRelease(block);
+        audioBlockRelease(coded);
+        audioBlockRelease(prefetch);
+        xSemaphoreGive(playbackPortLock);
+        return;
+    }
+    PlaybackSource nextSource;
+    bool hasNextSource = false;
 
-    int16_t buffer[bufferSize];
-    size_t bytesRead;
+    // The clock is set before starting, so the queue plays without gaps between messages
+    bool playbackRunning = false;
+    size_t bytesWritten;
     size_t totalBytesPlayed = 0;
+    bool playbackFailed = false;
+
+    while (inboxCount() > 0 && !playbackFailed) {
+        uint32_t messageId = inboxMessageAt(0);
+        PlaybackSource source;
+        if (hasNextSource) {
+            source = nextSource;
+            hasNextSource = false;
+        } else if (!openInboxMessage(messageId, source)) {
+            inboxRemoveOldest(); // Unreadable, don't get stuck on it
+            continue;
+        }
+        Serial.printf("Playing message %u (%u Hz, %s, gain %+.1f dB)\n", (unsigned)messageId,
+                      (unsigned)source.info.sampleRate, source.info.format == wavFormatImaAdpcm ? "IMA ADPCM" : "PCM",
+                      source.info.hasLoudness ? source.info.gainCentiDb / 100.0f : 0.0f);
+
+        // Messages normally share a rate, since every download asks for the same formats.
+        // When they don't, the clock is switched here and only the last few milliseconds
+        // still queued in DMA play at the new rate.
+        if (source.info.sampleRate != playbackRate) {
+            playbackRate = source.info.sampleRate;
+            i2s_set_sample_rates(playbackPort, playbackRate);
+        }
+        if (!playbackRunning) {
+            xQueueReset(playbackEventQueue);
+            i2s_zero_dma_buffer(playbackPort);
+            i2s_start(playbackPort);
+            playbackRunning = true;
+        }
 
-    // Skip WAV header
-    audioFile.seek(44); // WAV header is 44 bytes
+        if (prefetch->length > 0) {
+            i2s_write(playbackPort, prefetch->data, prefetch->length, &bytesWritten, portMAX_DELAY);
+            totalBytesPlayed += bytesWritten;
+            prefetch->length = 0;
+        }
 
-    while (audioFile.available()) {
-        size_t bytesToRead = audioFile.read((uint8_t *)buffer, sizeof(buffer));
-        esp_err_t i2s_err = i2s_write(I2S_NUM_0, (char *)buffer, bytesToRead, &bytesRead, portMAX_DELAY);
-        if (i2s_err != ESP_OK) {
-            Serial.printf("I2S write failed with error code: %d\n", i2s_err);
-            break;
+        while (readPlaybackSamples(source, coded, block)) {
+            esp_err_t i2s_err = i2s_write(playbackPort, block->data, block->length, &bytesWritten, portMAX_DELAY);
+            if (i2s_err != ESP_OK) {
+                Serial.printf("I2S write failed with error code: %d\n", i2s_err);
+                playbackFailed = true;
+                break;
+            }
+            totalBytesPlayed += bytesWritten;
+            countI2SOverflows();
+            if (!playbackStarted) {
+                playbackStarted = true;
+                metricsObserve(STAGE_PLAYBACK_START, millis() - playStart);
+            }
+
+            // Near the end of this message, open the next one and read its first block so
+            // the SD seek and FAT lookup happen while the DMA buffers are still full
+            if (!hasNextSource && inboxCount() > 1 && source.remaining <= 2 * audioBlockBytes) {
+                hasNextSource = openInboxMessage(inboxMessageAt(1), nextSource);
+                if (hasNextSource) {
+                    readPlaybackSamples(nextSource, coded, prefetch);
+                }
+            }
         }
-        totalBytesPlayed += bytesRead;
-        Serial.printf("Played %d bytes\n", bytesRead);
+
+        source.file.close();
+        if (!playbackFailed) {
+            inboxRemoveOldest();
+        }
+    }
+    if (hasNextSource) {
+        nextSource.file.close();
     }
 
-    audioFile.close();
+    audioBlockRelease(block);
+    audioBlockRelease(coded);
+    audioBlockRelease(prefetch);
+
+    if (playbackRunning) {
+        // Let the samples still queued in DMA play out, then silence the port
+        delay(i2s_config_playback.dma_buf_count * i2s_config_playback.dma_buf_len * 1000 / playbackRate + 1);
+        i2s_stop(playbackPort);
+        i2s_zero_dma_buffer(playbackPort);
+    }
+    xSemaphoreGive(playbackPortLock);
+
+    metricsAdd(METRIC_BYTES_PLAYED, totalBytesPlayed);
     Serial.printf("Playback finished. Total bytes played: %d\n", totalBytesPlayed);
+}
+
+// A recording in progress: where it goes and, for ADPCM, the samples not encoded yet
+struct Recording {
+    WavInfo format;
+    RamMessage *ramMessage; // Set when the recording fits a RAM slot
+    File file;
+    AudioBlock *staging;    // ADPCM only, up to one block's worth of samples
+    size_t staged;
+    uint8_t stepIndex;      // ADPCM only, carried from block to block
+    uint32_t dataCrc;       // CRC of the audio data, updated as it is stored
+    uint32_t trailerCrc;    // CRC of the chunks after the audio data
+};
+
+// Append bytes to the recording's RAM slot or file
+bool writeRecorded(Recording &recording, const uint8_t *data, size_t length) {
+    if (recording.ramMessage != NULL) {
+        RamMessage *ramMessage = recording.ramMessage;
+        if (length > ramMessageCapacity() - ramMessage->length) {
+            Serial.println("RAM slot full, stopping recording.");
+            return false;
+        }
+        memcpy(ramMessage->data + ramMessage->length, data, length);
+        ramMessage->length += length;
+    } else {
+        unsigned long writeStart = micros();
+        size_t written = recording.file.write(data, length);
+        metricsObserveSdWrite(micros() - writeStart);
+        if (written != length) {
+            Serial.println("Error: Failed to write recording, stopping.");
+            return false;
+        }
+    }
+    return true;
+}
 
-    // Uninstall I2S driver after playback
-    i2s_driver_uninstall(I2S_NUM_0);
+// Append audio data
+bool storeRecorded(Recording &recording, const uint8_t *data, size_t length) {
+    if (!writeRecorded(recording, data, length)) {
+        return false;
+    }
+    recording.format.dataSize += length;
+    recording.dataCrc = crc32Update(recording.dataCrc, data, length);
+    return true;
+}
+
+// Encode the staged samples as one ADPCM block, shorter than the others at the end
+bool flushRecordedBlock(Recording &recording) {
+    uint8_t block[512]; // Largest block wavImaAdpcmFormat() uses
+    size_t length = adpcmEncodeBlock(recording.staging->samples(), recording.staged, recording.stepIndex, block);
+    recording.staged = 0;
+    return storeRecorded(recording, block, length);
+}
+
+// Add samples from I2S, encoding them first if the format calls for it
+bool addRecordedSamples(Recording &recording, const int16_t *samples, size_t count) {
+    if (recording.format.format != wavFormatImaAdpcm) {
+        return storeRecorded(recording, (const uint8_t *)samples, count * sizeof(int16_t));
+    }
+    while (count > 0) {
+        size_t taken = min(count, (size_t)recording.format.samplesPerBlock - recording.staged);
+        memcpy(recording.staging->samples() + recording.staged, samples, taken * sizeof(int16_t));
+        recording.staged += taken;
+        samples += taken;
+        count -= taken;
+        if (recording.staged == recording.format.samplesPerBlock && !flushRecordedBlock(recording)) {
+            return false;
+        }
+    }
+    return true;
 }
 
 void recordAudio() {
     Serial.println("Starting recording...");
 
-    File audioFile = SD.open(recordedFilePath, FILE_WRITE);
-    if (!audioFile) {
-        Serial.println("Failed to open file for writing. Check SD card and try again.");
+    // Format chosen so this message is expected to upload within the target at the
+    // goodput the uploader has been seeing lately
+    Recording recording = {};
+    float goodputKbps = uploadGoodputEstimateKbps();
+    recording.format = chooseRecordingFormat(recordDurationMs, goodputKbps);
+    recording.format.hasLoudness = true; // Filled in with the header once the recording is done
+    recording.format.hasQuality = true;
+    bool adpcm = recording.format.format == wavFormatImaAdpcm;
+    Serial.printf("Recording %s at %u Hz (upload goodput estimate %.1f kbit/s).\n", adpcm ? "IMA ADPCM" : "PCM",
+                  (unsigned)recording.format.sampleRate, goodputKbps);
+
+    // Every recording gets its own outbox id, so a pending upload is never overwritten
+    uint32_t messageId = outboxReserveId(adpcm ? CODEC_IMA_ADPCM : CODEC_PCM16);
+    if (messageId == 0) {
+        Serial.println("Recording skipped.");
+        return;
+    }
+    size_t expectedSize = recordingBytes(recording.format, recordDurationMs);
+
+    // Samples from I2S, plus staging for the ADPCM encoder
+    AudioBlock *block = audioBlockAcquire(pdMS_TO_TICKS(1000));
+    recording.staging = adpcm ? audioBlockAcquire(pdMS_TO_TICKS(1000)) : NULL;
+    if (block == NULL || (adpcm && recording.staging == NULL)) {
+        Serial.println("No free audio buffer, recording skipped.");
+        audioBlockRelease(block);
+        audioBlockRelease(recording.staging);
         return;
     }
 
-    Serial.println("File opened successfully for writing.");
-    configureI2S(i2s_config_record, pin_config_record);
-
-    int16_t buffer[bufferSize];
-    size_t bytesRead;
-    size_t totalBytesWritten = 0;
+    // A recording that fits a RAM slot stays there and only goes to storage if its upload
+    // fails. The margin covers the block read after time is up and the waveform preview.
+    uint8_t header[wavMaxHeaderBytes];
+    size_t headerBytes = wavWriteHeader(recording.format, header); // Placeholder, rewritten once the size is known
+    recording.ramMessage = ramMessageClaim(RAM_OUTBOUND, messageId, expectedSize + audioBlockBytes + peakMaxChunkBytes);
+    if (recording.ramMessage != NULL) {
+        Serial.println("Recording into RAM.");
+        memcpy(recording.ramMessage->data, header, headerBytes);
+        recording.ramMessage->length = headerBytes;
+    } else {
+        // Placed by the size of a full-length recording, since it isn't known up front
+        char audioPath[outboxPathSize];
+        recording.file = storageForSize(expectedSize).open(outboxAudioPath(messageId, audioPath), FILE_WRITE);
+        if (!recording.file) {
+            Serial.println("Failed to open file for writing. Check SD card and try again.");
+            audioBlockRelease(block);
+            audioBlockRelease(recording.staging);
+            return;
+        }
+        Serial.println("File opened successfully for writing.");
+        recording.file.write(header, headerBytes);
+    }
 
+    // The clock follows the chosen format, so no resampling is needed
+    if (recording.format.sampleRate != recordRate) {
+        recordRate = recording.format.sampleRate;
+        i2s_set_sample_rates(recordPort, recordRate);
+    }
+    NoiseLoad noiseLoad;
+    noiseSuppressionBegin(noiseLoad, recording.format.sampleRate);
+    loudnessMeter.begin(recording.format.sampleRate);
+    waveformPeaks.begin(recording.format.sampleRate);
+    CaptureQuality captureQuality;
+    captureQualityBegin(captureQuality, recording.format.sampleRate);
+
+    // Overflows from before the start are not this recording's
+    xQueueReset(recordEventQueue);
+    i2s_start(recordPort);
+
+    size_t totalBytesRecorded = 0;
     unsigned long startTime = millis(); // Record start time
     unsigned long currentTime;
 
     while (true) {
         currentTime = millis();
-        if (currentTime - startTime >= 5000) { // Check if 3 seconds have passed
-            Serial.println("3 seconds elapsed, stopping recording.");
-            break; // Exit loop after 3 seconds
+        if (currentTime - startTime >= recordDurationMs) {
+            Serial.printf("%lu ms elapsed, stopping recording.\n", recordDurationMs);
+            break;
         }
 
-        esp_err_t i2s_err = i2s_read(I2S_NUM_0, (char *)buffer, sizeof(buffer), &bytesRead, portMAX_DELAY);
+        esp_err_t i2s_err = i2s_read(recordPort, block->data, audioBlockBytes, &block->length, portMAX_DELAY);
         if (i2s_err == ESP_OK) {
-            Serial.printf("Read %d bytes from I2S\n", bytesRead);
-            audioFile.write((uint8_t *)buffer, bytesRead);
-            totalBytesWritten += bytesRead;
-            Serial.printf("Wrote %d bytes to SD card\n", bytesRead);
+            Serial.printf("Read %d bytes from I2S\n", block->length);
+            countI2SOverflows();
+            totalBytesRecorded += block->length;
+            captureQualityAdd(captureQuality, block->samples(), block->length / sizeof(int16_t));
+            suppressNoise(noiseLoad, block->samples(), block->length / sizeof(int16_t));
+            loudnessMeter.add(block->samples(), block->length / sizeof(int16_t));
+            waveformPeaks.add(block->samples(), block->length / sizeof(int16_t));
+            if (!addRecordedSamples(recording, block->samples(), block->length / sizeof(int16_t))) {
+                break;
+            }
         } else {
             Serial.printf("Error: Failed to read data from I2S, error code: %d\n", i2s_err);
         }
     }
+    i2s_stop(recordPort);
+    noiseSuppressionReport(noiseLoad);
+    captureQualityReport(captureQuality);
 
-    // Update file with correct WAV header
-    size_t dataSize = totalBytesWritten + 36; // Adding 36 bytes for the header
-    audioFile.seek(0); // Move to the beginning of the file
-    writeWAVHeader(audioFile, dataSize);
+    unsigned long finalizeStart = millis();
+    if (recording.staged > 0) {
+        flushRecordedBlock(recording);
+    }
 
-    audioFile.close();
-    Serial.printf("Recording stopped, file closed. Total recorded bytes: %d\n", totalBytesWritten);
+    // Waveform preview for the server, in a chunk after the audio that players skip
+    static uint8_t peakChunk[peakMaxChunkBytes];
+    size_t peakBodyBytes = waveformPeaks.write(peakChunk + wavTrailingChunkOffset);
+    size_t peakChunkBytes = wavWriteTrailingChunk(recording.format, "peak", peakChunk + wavTrailingChunkOffset,
+                                                  peakBodyBytes, peakChunk);
+    if (writeRecorded(recording, peakChunk, peakChunkBytes)) {
+        recording.format.trailerSize = peakChunkBytes;
+        recording.trailerCrc = crc32Update(0, peakChunk, peakChunkBytes);
+    }
+    audioBlockRelease(block);
+    audioBlockRelease(recording.staging);
+    metricsAdd(METRIC_BYTES_RECORDED, totalBytesRecorded);
+
+    // Playback gain from the loudness measured on the way, so the file is never read again
+    if (loudnessMeter.measured()) {
+        recording.format.loudnessCentiLufs = lroundf(loudnessMeter.integratedLufs() * 100.0f);
+        recording.format.gainCentiDb = lroundf(loudnessMeter.playbackGainDb() * 100.0f);
+        Serial.printf("Loudness %.1f LUFS, peak %u, playback gain %+.1f dB.\n", recording.format.loudnessCentiLufs / 100.0f,
+                      loudnessMeter.peak(), recording.format.gainCentiDb / 100.0f);
+    } else {
+        recording.format.loudnessCentiLufs = lroundf(loudnessAbsoluteGateLufs * 100.0f);
+        recording.format.gainCentiDb = 0;
+        Serial.println("Recording too short or quiet to measure its loudness.");
+    }
+
+    WavQuality &quality = recording.format.quality;
+    quality.sampleCount = captureQuality.samples;
+    quality.clippedSamples = captureQuality.clipped;
+    quality.longestZeroRunMs = captureQualityLongestZeroRunMs(captureQuality);
+    quality.peak = captureQuality.peak;
+    quality.dcOffset = captureQualityDcOffset(captureQuality);
+    quality.rmsCentiDbfs = lroundf(captureQualityRmsDbfs(captureQuality) * 100.0f);
+    quality.problems = captureQualityProblems(captureQuality);
+
+    // Rewrite the header now that the size, loudness and capture quality are known
+    uint32_t dataSize = recording.format.dataSize;
+    wavWriteHeader(recording.format, header);
+    uint32_t fileCrc = crc32Combine(crc32Update(0, header, headerBytes), recording.dataCrc, dataSize);
+    fileCrc = crc32Combine(fileCrc, recording.trailerCrc, recording.format.trailerSize);
+    size_t fileSize;
+    if (recording.ramMessage != NULL) {
+        memcpy(recording.ramMessage->data, header, headerBytes);
+        fileSize = recording.ramMessage->length;
+        Serial.printf("Recording stopped, kept in RAM. %u audio bytes from %u recorded, CRC32 %08x\n",
+                      (unsigned)dataSize, (unsigned)totalBytesRecorded, fileCrc);
+    } else {
+        recording.file.seek(0); // Move to the beginning of the file
+        recording.file.write(header, headerBytes);
+        fileSize = recording.file.size();
+        recording.file.close();
+        Serial.printf("Recording stopped, file closed. %u audio bytes from %u recorded, CRC32 %08x\n",
+                      (unsigned)dataSize, (unsigned)totalBytesRecorded, fileCrc);
+    }
 
-    // Upload the audio file to a server or do further processing
-    uploadAudio();
+    // The background uploader takes it from here; recording never waits on the network
+    outboxEnqueue(messageId, fileSize, fileCrc);
+    metricsObserve(STAGE_RECORD_FINALIZE, millis() - finalizeStart);
 }
 
-void uploadAudio() {
-    Serial.println("Uploading audio...");
+// Stream the microphone to the peer for as long as the record button is held
+void talkLive() {
+    Serial.println("Talking live...");
+    AudioBlock *block = audioBlockAcquire(pdMS_TO_TICKS(1000));
+    if (block == NULL) {
+        Serial.println("No free audio buffer, talking skipped.");
+        return;
+    }
 
-    WiFiClientSecure client;
-    client.setInsecure();
-    client.setTimeout(15000);
+    if (recordRate != intercomSampleRate) {
+        recordRate = intercomSampleRate;
+        i2s_set_sample_rates(recordPort, recordRate);
+    }
+    NoiseLoad noiseLoad;
+    noiseSuppressionBegin(noiseLoad, intercomSampleRate);
+    CaptureQuality captureQuality;
+    captureQualityBegin(captureQuality, intercomSampleRate);
+    xQueueReset(recordEventQueue);
+    i2s_start(recordPort);
+    intercomTalkBegin();
+
+    unsigned long startTime = millis();
+    size_t frames = 0;
+    while (digitalRead(recordRedButtonPin) == LOW) {
+        size_t frameBytes = intercomFrameSamples * sizeof(int16_t);
+        esp_err_t i2s_err = i2s_read(recordPort, block->data, frameBytes, &block->length, portMAX_DELAY);
+        if (i2s_err != ESP_OK || block->length != frameBytes) {
+            Serial.printf("Error: Failed to read data from I2S, error code: %d\n", i2s_err);
+            break;
+        }
+        countI2SOverflows();
+        captureQualityAdd(captureQuality, block->samples(), intercomFrameSamples);
+        suppressNoise(noiseLoad, block->samples(), intercomFrameSamples);
+        intercomSendFrame(block->samples());
+        frames++;
+    }
 
-    HTTPClient http;
-    String uploadURL = serverURL + "/upload";
-    http.begin(client, uploadURL);
+    intercomTalkEnd();
+    i2s_stop(recordPort);
+    audioBlockRelease(block);
+    Serial.printf("Talked live for %lu ms (%u frames).\n", millis() - startTime, (unsigned)frames);
+    noiseSuppressionReport(noiseLoad);
+    captureQualityReport(captureQuality);
+}
 
-    http.addHeader("Content-Type", "audio/wav");
-    http.addHeader("User-Agent", "ESP32/1.0");
-    http.addHeader("X-Filename", "uploaded_audio_device1.wav");
-    http.addHeader("X-Device-Type", "device1"); // Specify that this is device1
+void noiseSuppressionBegin(NoiseLoad &load, uint32_t sampleRate) {
+    load = {};
+    load.sampleRate = sampleRate;
+#if BRUSHTALK_NOISE_SUPPRESSION
+    noiseSuppressor.begin(sampleRate);
+#endif
+}
 
-    File audioFile = SD.open(recordedFilePath, FILE_READ);
-    if (!audioFile) {
-        Serial.println("Failed to open file for reading. Check SD card and file path.");
+// Runs on the capture path between I2S and the encoder or the intercom link, so it has to
+// keep well inside the time the samples took to arrive
+void suppressNoise(NoiseLoad &load, int16_t *samples, size_t count) {
+#if BRUSHTALK_NOISE_SUPPRESSION
+    unsigned long start = micros();
+    noiseSuppressor.process(samples, count);
+    uint32_t cpuUs = micros() - start;
+    uint32_t audioUs = (uint64_t)count * 1000000 / load.sampleRate;
+    load.cpuUs += cpuUs;
+    load.audioUs += audioUs;
+    if (audioUs > 0) {
+        load.maxUsPer10Ms = max(load.maxUsPer10Ms, (uint32_t)((uint64_t)cpuUs * 10000 / audioUs));
+    }
+    metricsAdd(METRIC_NOISE_SUPPRESSION_CPU_US, cpuUs);
+    metricsAdd(METRIC_NOISE_SUPPRESSION_AUDIO_US, audioUs);
+#endif
+}
+
+void noiseSuppressionReport(const NoiseLoad &load) {
+    if (load.audioUs == 0) {
         return;
     }
+    uint32_t avgUsPer10Ms = load.cpuUs * 10000 / load.audioUs;
+    Serial.printf("Noise suppression: %u us per 10 ms of audio (%.1f%% of a core), worst %u us.\n",
+                  (unsigned)avgUsPer10Ms, avgUsPer10Ms / 100.0f, (unsigned)load.maxUsPer10Ms);
+}
 
-    size_t fileSize = audioFile.size();
-    if (fileSize == 0) {
-        Serial.println("File is empty, upload aborted.");
-        audioFile.close();
+// Log what the microphone delivered and count it on /metrics, loudly if it looks broken
+void captureQualityReport(const CaptureQuality &quality) {
+    if (quality.samples == 0) {
         return;
     }
+    uint16_t problems = captureQualityProblems(quality);
+    float rmsDbfs = captureQualityRmsDbfs(quality);
+    float peakDbfs = captureQualityPeakDbfs(quality);
+    int16_t dcOffset = captureQualityDcOffset(quality);
+    uint32_t zeroRunMs = captureQualityLongestZeroRunMs(quality);
+    Serial.printf("Capture: RMS %.1f dBFS, peak %.1f dBFS, %u clipped, DC offset %d, longest zero run %u ms.\n",
+                  rmsDbfs, peakDbfs, (unsigned)quality.clipped, dcOffset, (unsigned)zeroRunMs);
+    if (problems & CAPTURE_CLIPPED) {
+        Serial.println("Warning: the recording is clipped, the microphone gain is too high.");
+        metricsAdd(METRIC_CAPTURE_CLIPPED);
+    }
+    if (problems & CAPTURE_SILENT) {
+        Serial.println("Warning: the recording is silent.");
+        metricsAdd(METRIC_CAPTURE_SILENT);
+    }
+    if (problems & CAPTURE_DEAD_MIC) {
+        Serial.println("Warning: the microphone sent long runs of zeros, check its wiring.");
+        metricsAdd(METRIC_CAPTURE_DEAD_MIC);
+    }
+    if (problems & CAPTURE_DC_OFFSET) {
+        Serial.println("Warning: the microphone signal has a large DC offset.");
+        metricsAdd(METRIC_CAPTURE_DC_OFFSET);
+    }
+    metricsAdd(METRIC_CAPTURE_SAMPLES, quality.samples);
+    metricsAdd(METRIC_CAPTURE_CLIPPED_SAMPLES, quality.clipped);
+    metricsSetCaptureLevels(rmsDbfs, peakDbfs, dcOffset, zeroRunMs);
+}
 
-    int httpResponseCode = http.sendRequest("POST", &audioFile, fileSize);
-    Serial.printf("HTTP Response Code: %d\n", httpResponseCode);
+// Linear interpolation from the intercom rate up to the playback clock. previous carries
+// the last input sample over from the frame before, so frames join without a step.
+// Returns the number of output samples.
+size_t upsampleIntercomFrame(const int16_t *in, int16_t *out, int16_t &previous) {
+    const size_t outCount = intercomFrameSamples * sampleRate / intercomSampleRate;
+    for (size_t i = 0; i < outCount; i++) {
+        // Position in input samples, 16.16 fixed point, trailing by one sample
+        uint32_t position = (uint64_t)i * intercomSampleRate * 65536 / sampleRate;
+        size_t index = position >> 16;
+        int32_t from = index == 0 ? previous : in[index - 1];
+        int32_t to = in[index];
+        out[i] = from + (int32_t)(((int64_t)(to - from) * (position & 0xFFFF)) >> 16);
+    }
+    previous = in[intercomFrameSamples - 1];
+    return outCount;
+}
 
-    audioFile.close();
-    http.end();
+// Plays live streams as they arrive, whenever no messages are playing
+void intercomPlayoutTask(void *parameter) {
+    static int16_t frame[intercomFrameSamples];
+    static int16_t output[intercomFrameSamples * sampleRate / intercomSampleRate];
+    const size_t dmaSamples = i2s_config_playback.dma_buf_count * i2s_config_playback.dma_buf_len;
 
-    Serial.println("Upload process finished.");
-}
+    while (true) {
+        if (!intercomWaitForStream(portMAX_DELAY)) {
+            continue;
+        }
+        xSemaphoreTake(playbackPortLock, portMAX_DELAY);
+        Serial.println("Playing live intercom stream...");
+        if (playbackRate != (uint32_t)sampleRate) {
+            playbackRate = sampleRate;
+            i2s_set_sample_rates(playbackPort, playbackRate);
+        }
+        xQueueReset(playbackEventQueue);
+        i2s_zero_dma_buffer(playbackPort);
+        i2s_start(playbackPort);
+
+        // Fill the DMA queue with silence first, so every frame after it waits for room
+        // and frames leave the jitter buffer in real time rather than in a burst
+        size_t bytesWritten;
+        memset(output, 0, sizeof(output));
+        for (size_t queued = 0; queued < dmaSamples; queued += bytesWritten / sizeof(int16_t)) {
+            size_t samples = min(dmaSamples - queued, sizeof(output) / sizeof(int16_t));
+            i2s_write(playbackPort, output, samples * sizeof(int16_t), &bytesWritten, portMAX_DELAY);
+        }
 
-void configureI2S(i2s_config_t& config, i2s_pin_config_t& pinConfig) {
-    Serial.println("Configuring I2S...");
+        int16_t previous = 0;
+        while (intercomNextFrame(frame)) {
+            size_t count = upsampleIntercomFrame(frame, output, previous);
+            i2s_write(playbackPort, output, count * sizeof(int16_t), &bytesWritten, portMAX_DELAY);
+            countI2SOverflows();
+            metricsAdd(METRIC_BYTES_PLAYED, bytesWritten);
+        }
 
-    // Uninstall I2S driver if already installed
-    if (i2s_driver_install(I2S_NUM_0, &config, 0, NULL) != ESP_ERR_INVALID_STATE) {
-        Serial.println("Uninstalling existing I2S driver...");
-        i2s_driver_uninstall(I2S_NUM_0);
-        delay(500); // Wait for a while to ensure uninstallation
+        delay(dmaSamples * 1000 / playbackRate + 1);
+        i2s_stop(playbackPort);
+        i2s_zero_dma_buffer(playbackPort);
+        xSemaphoreGive(playbackPortLock);
     }
-    
-    // Try to install I2S driver
-    esp_err_t install_status = i2s_driver_install(I2S_NUM_0, &config, 0, NULL);
+}
+
+// Install a driver with its pins and leave the port stopped
+bool installI2S(i2s_port_t port, const i2s_config_t &config, const i2s_pin_config_t &pinConfig, QueueHandle_t *eventQueue) {
+    Serial.printf("Installing I2S driver on port %d...\n", port);
+
+    esp_err_t install_status = i2s_driver_install(port, &config, i2sEventQueueLength, eventQueue);
     if (install_status != ESP_OK) {
         Serial.printf("I2S driver installation failed with error code: %d\n", install_status);
-        return;
+        return false;
     }
 
     // Configure I2S pins
-    esp_err_t pin_status = i2s_set_pin(I2S_NUM_0, &pinConfig);
+    esp_err_t pin_status = i2s_set_pin(port, &pinConfig);
     if (pin_status != ESP_OK) {
         Serial.printf("I2S pin configuration failed with error code: %d\n", pin_status);
-    } else {
-        Serial.println("I2S configured successfully.");
+        i2s_driver_uninstall(port);
+        return false;
     }
-}
 
-void writeWAVHeader(File &file, uint32_t dataSize) {
-    Serial.println("Writing WAV header...");
-
-    typedef struct
-    {
-        char chunkID[4];        // "RIFF"
-        uint32_t chunkSize;     // 36 + dataSize
-        char format[4];         // "WAVE"
-        char subchunk1ID[4];    // "fmt "
-        uint32_t subchunk1Size; // 16 for PCM
-        uint16_t audioFormat;   // PCM = 1
-        uint16_t numChannels;   // 1 for mono, 2 for stereo
-        uint32_t sampleRate;    // 44100 or other rate
-        uint32_t byteRate;      // sampleRate * numChannels * bitsPerSample / 8
-        uint16_t blockAlign;    // numChannels * bitsPerSample / 8
-        uint16_t bitsPerSample; // 16 for PCM
-        char subchunk2ID[4];    // "data"
-        uint32_t subchunk2Size; // dataSize
-    } WAVHeader;
-
-    WAVHeader header = {
-        {'R', 'I', 'F', 'F'},       // Chunk ID
-        36 + dataSize,              // Chunk Size
-        {'W', 'A', 'V', 'E'},       // Format
-        {'f', 'm', 't', ' '},       // Subchunk 1 ID
-        16,                         // Subchunk 1 Size (16 for PCM)
-        1,                          // Audio Format (1 for PCM)
-        1,                          // Number of Channels (1 for mono, 2 for stereo)
-        sampleRate,                 // Sample Rate
-        sampleRate * 2,             // Byte Rate (SampleRate * NumChannels * BitsPerSample / 8)
-        2,                          // Block Align (NumChannels * BitsPerSample / 8)
-        16,                         // Bits Per Sample
-        {'d', 'a', 't', 'a'},       // Subchunk 2 ID
-        dataSize                    // Subchunk 2 Size
-    };
-
-    file.write((uint8_t *)&header, sizeof(header));
-
-    Serial.println("WAV header written successfully.");
+    // Installing starts the port; it only runs while recording or playing
+    i2s_stop(port);
+    Serial.println("I2S configured successfully.");
+    return true;
 }
 
 size_t getFileSize(const String& filePath) {
-    File file = SD.open(filePath, FILE_READ);
+    File file = storageHolding(filePath.c_str()).open(filePath, FILE_READ);
     if (!file) {
         Serial.println("Failed to open file for size check. Check SD card and file path.");
         return 0;
@@ -464,4 +1132,32 @@ size_t getFileSize(const String& filePath) {
     size_t size = file.size();
     file.close();
     return size;
-}
\ No newline at end of file
+}
+
+// Whether a button that is down stays down for holdMs
+bool buttonHeld(int pin, unsigned long holdMs) {
+    unsigned long startTime = millis();
+    while (millis() - startTime < holdMs) {
+        if (digitalRead(pin) == HIGH) {
+            return false;
+        }
+        delay(10);
+    }
+    return true;
+}
+
+// Drain the I2S event queue and count the DMA overflows it reports. Called once per
+// block, so the short queue never drops an overflow behind the routine DONE events.
+void countI2SOverflows() {
+    i2s_event_t event;
+    while (recordEventQueue != NULL && xQueueReceive(recordEventQueue, &event, 0) == pdTRUE) {
+        if (event.type == I2S_EVENT_RX_Q_OVF) {
+            metricsAdd(METRIC_I2S_RX_OVERRUNS);
+        }
+    }
+    while (playbackEventQueue != NULL && xQueueReceive(playbackEventQueue, &event, 0) == pdTRUE) {
+        if (event.type == I2S_EVENT_TX_Q_OVF) {
+            metricsAdd(METRIC_I2S_TX_UNDERRUNS);
+        }
+    }
+}
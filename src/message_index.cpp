@@ -0,0 +1,241 @@
+#include "message_index.h"
+
+#include <time.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "storage.h"
+
+const uint16_t messageRecordMagic = 0xB71D;
+
+// Compact once the file holds this many more records than there are live messages
+const size_t messageIndexSlack = 64;
+
+static MessageRecord liveRecords[messageIndexCapacity];
+static size_t liveCount = 0;
+static size_t fileRecordCount = 0;
+static SemaphoreHandle_t indexMutex = NULL;
+
+// FNV-1a over everything but the checksum field itself
+static uint32_t messageRecordChecksum(const MessageRecord &record) {
+    const uint8_t *bytes = (const uint8_t *)&record;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(MessageRecord, checksum); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static bool isFinalState(uint8_t state) {
+    return state == MESSAGE_SENT || state == MESSAGE_PLAYED || state == MESSAGE_DELETED;
+}
+
+static uint32_t indexTimestamp() {
+    time_t now = time(nullptr);
+    // Before NTP has set the clock, fall back to seconds since boot
+    return now > 1600000000 ? (uint32_t)now : millis() / 1000;
+}
+
+static int findLiveRecord(uint8_t direction, uint32_t id) {
+    for (size_t i = 0; i < liveCount; i++) {
+        if (liveRecords[i].id == id && liveRecords[i].direction == direction) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Fold one record into the in-memory table
+static void applyRecord(const MessageRecord &record) {
+    int pos = findLiveRecord(record.direction, record.id);
+    if (isFinalState(record.state)) {
+        if (pos >= 0) {
+            liveRecords[pos] = liveRecords[liveCount - 1];
+            liveCount--;
+        }
+    } else if (pos >= 0) {
+        liveRecords[pos] = record;
+    } else if (liveCount < messageIndexCapacity) {
+        liveRecords[liveCount++] = record;
+    } else {
+        Serial.printf("Message index full, dropping message %u.\n", (unsigned)record.id);
+    }
+}
+
+// Rewrite the file with only the live records, then swap it in
+static bool compactMessageIndex() {
+    fs::FS &state = storageForState();
+    File tempFile = state.open(messageIndexTempPath, FILE_WRITE);
+    if (!tempFile) {
+        Serial.println("Failed to open temporary index for compaction.");
+        return false;
+    }
+    size_t bytes = liveCount * sizeof(MessageRecord);
+    bool written = tempFile.write((const uint8_t *)liveRecords, bytes) == bytes;
+    tempFile.close();
+    if (!written) {
+        Serial.println("Failed to write compacted index.");
+        state.remove(messageIndexTempPath);
+        return false;
+    }
+
+    // If power fails between these two steps, messageIndexBegin() finishes the rename
+    state.remove(messageIndexPath);
+    if (!state.rename(messageIndexTempPath, messageIndexPath)) {
+        Serial.println("Failed to replace index with compacted copy.");
+        return false;
+    }
+
+    Serial.printf("Message index compacted: %u -> %u records.\n", (unsigned)fileRecordCount, (unsigned)liveCount);
+    fileRecordCount = liveCount;
+    return true;
+}
+
+bool messageIndexBegin() {
+    indexMutex = xSemaphoreCreateMutex();
+
+    fs::FS &state = storageForState();
+    if (!state.exists(messageIndexPath) && state.exists(messageIndexTempPath)) {
+        state.rename(messageIndexTempPath, messageIndexPath);
+    }
+
+    // An index from before the flash tier is read from the card once; the compaction
+    // below writes it to flash
+    bool migrating = &state != &cardStorage && !state.exists(messageIndexPath) && storageHasCard() &&
+                     cardStorage.exists(messageIndexPath);
+
+    unsigned long startTime = millis();
+    bool needsCompaction = migrating;
+    File indexFile = (migrating ? cardStorage : state).open(messageIndexPath, FILE_READ);
+    if (indexFile) {
+        MessageRecord batch[16];
+        while (true) {
+            size_t bytesRead = indexFile.read((uint8_t *)batch, sizeof(batch));
+            size_t count = bytesRead / sizeof(MessageRecord);
+            for (size_t i = 0; i < count; i++) {
+                if (batch[i].magic != messageRecordMagic || batch[i].checksum != messageRecordChecksum(batch[i])) {
+                    needsCompaction = true;
+                    continue;
+                }
+                applyRecord(batch[i]);
+                fileRecordCount++;
+            }
+            if (bytesRead < sizeof(batch)) {
+                // A torn final write leaves a partial record; rewrite so appends stay aligned
+                needsCompaction |= bytesRead % sizeof(MessageRecord) != 0;
+                break;
+            }
+        }
+        indexFile.close();
+    }
+
+    Serial.printf("Message index loaded in %lu ms: %u live message(s) from %u record(s).\n",
+                  millis() - startTime, (unsigned)liveCount, (unsigned)fileRecordCount);
+
+    if (needsCompaction || fileRecordCount > liveCount + messageIndexSlack) {
+        bool compacted = compactMessageIndex();
+        if (compacted && migrating) {
+            cardStorage.remove(messageIndexPath);
+            Serial.println("Message index moved from the SD card to flash.");
+        }
+        return compacted;
+    }
+    return true;
+}
+
+// Caller holds indexMutex
+static bool putRecord(MessageRecord record) {
+    record.magic = messageRecordMagic;
+    record.updatedAt = indexTimestamp();
+    int pos = findLiveRecord(record.direction, record.id);
+    if (pos >= 0) {
+        record.createdAt = liveRecords[pos].createdAt;
+    } else if (record.createdAt == 0) {
+        record.createdAt = record.updatedAt;
+    }
+    record.checksum = messageRecordChecksum(record);
+
+    bool written = false;
+    File indexFile = storageForState().open(messageIndexPath, FILE_APPEND);
+    if (indexFile) {
+        written = indexFile.write((const uint8_t *)&record, sizeof(record)) == sizeof(record);
+        indexFile.close();
+    }
+    if (!written) {
+        Serial.printf("Failed to append index record for message %u.\n", (unsigned)record.id);
+    } else {
+        fileRecordCount++;
+    }
+
+    // The in-memory state follows the change even if the write failed, so the running
+    // device behaves consistently; only the state after a reboot is affected
+    applyRecord(record);
+
+    if (fileRecordCount > liveCount + messageIndexSlack) {
+        compactMessageIndex();
+    }
+    return written;
+}
+
+bool messageIndexPut(MessageRecord record) {
+    xSemaphoreTake(indexMutex, portMAX_DELAY);
+    bool written = putRecord(record);
+    xSemaphoreGive(indexMutex);
+    return written;
+}
+
+bool messageIndexAdd(MessageRecord record) {
+    xSemaphoreTake(indexMutex, portMAX_DELAY);
+    bool full = findLiveRecord(record.direction, record.id) < 0 && liveCount >= messageIndexCapacity;
+    if (full) {
+        Serial.printf("Message index full, refusing message %u.\n", (unsigned)record.id);
+    } else {
+        putRecord(record);
+    }
+    xSemaphoreGive(indexMutex);
+    return !full;
+}
+
+bool messageIndexGet(uint8_t direction, uint32_t id, MessageRecord &record) {
+    xSemaphoreTake(indexMutex, portMAX_DELAY);
+    int pos = findLiveRecord(direction, id);
+    if (pos >= 0) {
+        record = liveRecords[pos];
+    }
+    xSemaphoreGive(indexMutex);
+    return pos >= 0;
+}
+
+bool messageIndexSetState(uint8_t direction, uint32_t id, uint8_t state) {
+    MessageRecord record = {};
+    if (!messageIndexGet(direction, id, record)) {
+        record.direction = direction;
+        record.id = id;
+    }
+    record.state = state;
+    return messageIndexPut(record);
+}
+
+size_t messageIndexList(uint8_t direction, uint8_t state, uint32_t *ids, size_t maxIds) {
+    xSemaphoreTake(indexMutex, portMAX_DELAY);
+    size_t count = 0;
+    for (size_t i = 0; i < liveCount && maxIds > 0; i++) {
+        if (liveRecords[i].direction != direction || liveRecords[i].state != state) {
+            continue;
+        }
+        // Insertion sort by id, which is also creation order. The table itself is in no
+        // particular order, so once ids is full a newer id is skipped and an older one
+        // pushes out the newest.
+        if (count == maxIds && liveRecords[i].id > ids[count - 1]) {
+            continue;
+        }
+        size_t pos = count < maxIds ? count++ : count - 1;
+        while (pos > 0 && ids[pos - 1] > liveRecords[i].id) {
+            ids[pos] = ids[pos - 1];
+            pos--;
+        }
+        ids[pos] = liveRecords[i].id;
+    }
+    xSemaphoreGive(indexMutex);
+    return count;
+}
@@ -0,0 +1,259 @@
+#include "metrics.h"
+
+#include <WiFi.h>
+#include <ESPAsyncWebServer.h>
+#include <esp_heap_caps.h>
+#include <stdarg.h>
+#include <freertos/FreeRTOS.h>
+
+#include "audio_pool.h"
+#include "config.h"
+#include "inbox.h"
+#include "outbox.h"
+#include "uploader.h"
+
+// Upper bounds of the latency buckets in ms; the last bucket is +Inf
+static const uint32_t latencyBucketsMs[] = {5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000};
+const size_t latencyBucketCount = sizeof(latencyBucketsMs) / sizeof(latencyBucketsMs[0]) + 1;
+
+// SD write latencies are kept in a ring so percentiles reflect recent behaviour
+const size_t sdWriteSamples = 256;
+
+struct LatencyHistogram {
+    uint32_t buckets[latencyBucketCount];
+    uint32_t count;
+    uint64_t sumMs;
+};
+
+struct MetricsState {
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    LatencyHistogram stages[STAGE_COUNT];
+    uint32_t sdWriteUs[sdWriteSamples];
+    uint32_t sdWriteCount;
+    uint64_t sdWriteSumUs;
+    float captureRmsDbfs;
+    float capturePeakDbfs;
+    int16_t captureDcOffset;
+    uint32_t captureZeroRunMs;
+};
+
+static MetricsState metrics = {};
+static portMUX_TYPE metricsLock = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *const counterNames[METRIC_COUNTER_COUNT][2] = {
+    {"brushtalk_bytes_total", "stage=\"recorded\""},
+    {"brushtalk_bytes_total", "stage=\"uploaded\""},
+    {"brushtalk_bytes_total", "stage=\"downloaded\""},
+    {"brushtalk_bytes_total", "stage=\"played\""},
+    {"brushtalk_uploads_total", "result=\"ok\""},
+    {"brushtalk_uploads_total", "result=\"failed\""},
+    {"brushtalk_downloads_total", "result=\"ok\""},
+    {"brushtalk_downloads_total", "result=\"failed\""},
+    {"brushtalk_i2s_queue_overflows_total", "direction=\"rx\""},
+    {"brushtalk_i2s_queue_overflows_total", "direction=\"tx\""},
+    {"brushtalk_lan_transfers_total", "direction=\"sent\""},
+    {"brushtalk_lan_transfers_total", "direction=\"received\""},
+    {"brushtalk_wifi_connects_total", "result=\"fast\""},
+    {"brushtalk_wifi_connects_total", "result=\"full\""},
+    {"brushtalk_wifi_connects_total", "result=\"failed\""},
+    {"brushtalk_ram_messages_total", "event=\"held\""},
+    {"brushtalk_ram_messages_total", "event=\"persisted\""},
+    {"brushtalk_intercom_frames_total", "event=\"sent\""},
+    {"brushtalk_intercom_frames_total", "event=\"dropped\""},
+    {"brushtalk_intercom_frames_total", "event=\"received\""},
+    {"brushtalk_intercom_frames_total", "event=\"late\""},
+    {"brushtalk_intercom_frames_total", "event=\"concealed\""},
+    {"brushtalk_noise_suppression_microseconds_total", "time=\"cpu\""},
+    {"brushtalk_noise_suppression_microseconds_total", "time=\"audio\""},
+    {"brushtalk_capture_samples_total", "kind=\"all\""},
+    {"brushtalk_capture_samples_total", "kind=\"clipped\""},
+    {"brushtalk_capture_problems_total", "problem=\"clipped\""},
+    {"brushtalk_capture_problems_total", "problem=\"silent\""},
+    {"brushtalk_capture_problems_total", "problem=\"dead_mic\""},
+    {"brushtalk_capture_problems_total", "problem=\"dc_offset\""},
+    {"brushtalk_metrics_truncated_total", ""},
+};
+
+static const char *const stageNames[STAGE_COUNT] = {
+    "record_finalize", "check", "download", "upload", "playback_start", "wifi_connect", "intercom"
+};
+
+void metricsAdd(MetricCounter counter, uint32_t amount) {
+    portENTER_CRITICAL(&metricsLock);
+    metrics.counters[counter] += amount;
+    portEXIT_CRITICAL(&metricsLock);
+}
+
+void metricsObserve(MetricStage stage, uint32_t milliseconds) {
+    size_t bucket = 0;
+    while (bucket < latencyBucketCount - 1 && milliseconds > latencyBucketsMs[bucket]) {
+        bucket++;
+    }
+    portENTER_CRITICAL(&metricsLock);
+    LatencyHistogram &histogram = metrics.stages[stage];
+    histogram.buckets[bucket]++;
+    histogram.count++;
+    histogram.sumMs += milliseconds;
+    portEXIT_CRITICAL(&metricsLock);
+}
+
+void metricsObserveSdWrite(uint32_t microseconds) {
+    portENTER_CRITICAL(&metricsLock);
+    metrics.sdWriteUs[metrics.sdWriteCount % sdWriteSamples] = microseconds;
+    metrics.sdWriteCount++;
+    metrics.sdWriteSumUs += microseconds;
+    portEXIT_CRITICAL(&metricsLock);
+}
+
+void metricsSetCaptureLevels(float rmsDbfs, float peakDbfs, int16_t dcOffset, uint32_t longestZeroRunMs) {
+    portENTER_CRITICAL(&metricsLock);
+    metrics.captureRmsDbfs = rmsDbfs;
+    metrics.capturePeakDbfs = peakDbfs;
+    metrics.captureDcOffset = dcOffset;
+    metrics.captureZeroRunMs = longestZeroRunMs;
+    portEXIT_CRITICAL(&metricsLock);
+}
+
+// Appends formatted text to a fixed buffer and notes when something didn't fit
+struct PageWriter {
+    char *buffer;
+    size_t size;
+    size_t length;
+    bool truncated;
+
+    void printf(const char *format, ...) __attribute__((format(printf, 2, 3))) {
+        if (truncated) {
+            return;
+        }
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(buffer + length, size - length, format, args);
+        va_end(args);
+        if (written < 0 || (size_t)written >= size - length) {
+            truncated = true;
+            return;
+        }
+        length += written;
+    }
+};
+
+static void sortSamples(uint32_t *samples, size_t count) {
+    // Insertion sort; at most sdWriteSamples entries, rendered on demand
+    for (size_t i = 1; i < count; i++) {
+        uint32_t value = samples[i];
+        size_t j = i;
+        while (j > 0 && samples[j - 1] > value) {
+            samples[j] = samples[j - 1];
+            j--;
+        }
+        samples[j] = value;
+    }
+}
+
+size_t metricsRender(char *buffer, size_t size) {
+    // Copy under the lock, format without it; static so nothing lands on the caller's stack
+    static MetricsState snapshot;
+    portENTER_CRITICAL(&metricsLock);
+    snapshot = metrics;
+    portEXIT_CRITICAL(&metricsLock);
+
+    PageWriter page = {buffer, size, 0, false};
+    buffer[0] = '\0';
+
+    page.printf("# TYPE brushtalk_info gauge\nbrushtalk_info{device=\"%s\"} 1\n", deviceName.c_str());
+
+    const char *lastName = "";
+    for (size_t i = 0; i < METRIC_COUNTER_COUNT; i++) {
+        if (strcmp(counterNames[i][0], lastName) != 0) {
+            lastName = counterNames[i][0];
+            page.printf("# TYPE %s counter\n", lastName);
+        }
+        if (counterNames[i][1][0] == '\0') {
+            page.printf("%s %llu\n", counterNames[i][0], (unsigned long long)snapshot.counters[i]);
+        } else {
+            page.printf("%s{%s} %llu\n", counterNames[i][0], counterNames[i][1], (unsigned long long)snapshot.counters[i]);
+        }
+    }
+
+    page.printf("# TYPE brushtalk_stage_latency_ms histogram\n");
+    for (size_t stage = 0; stage < STAGE_COUNT; stage++) {
+        const LatencyHistogram &histogram = snapshot.stages[stage];
+        uint32_t cumulative = 0;
+        for (size_t bucket = 0; bucket < latencyBucketCount - 1; bucket++) {
+            cumulative += histogram.buckets[bucket];
+            page.printf("brushtalk_stage_latency_ms_bucket{stage=\"%s\",le=\"%u\"} %u\n", stageNames[stage],
+                        (unsigned)latencyBucketsMs[bucket], (unsigned)cumulative);
+        }
+        page.printf("brushtalk_stage_latency_ms_bucket{stage=\"%s\",le=\"+Inf\"} %u\n", stageNames[stage], (unsigned)histogram.count);
+        page.printf("brushtalk_stage_latency_ms_sum{stage=\"%s\"} %llu\n", stageNames[stage], (unsigned long long)histogram.sumMs);
+        page.printf("brushtalk_stage_latency_ms_count{stage=\"%s\"} %u\n", stageNames[stage], (unsigned)histogram.count);
+    }
+
+    size_t samples = min((size_t)snapshot.sdWriteCount, sdWriteSamples);
+    sortSamples(snapshot.sdWriteUs, samples);
+    page.printf("# TYPE brushtalk_sd_write_latency_us summary\n");
+    if (samples > 0) {
+        const struct { const char *label; uint8_t percent; } quantiles[] = {{"0.5", 50}, {"0.9", 90}, {"0.99", 99}};
+        for (const auto &quantile : quantiles) {
+            page.printf("brushtalk_sd_write_latency_us{quantile=\"%s\"} %u\n", quantile.label,
+                        (unsigned)snapshot.sdWriteUs[(samples - 1) * quantile.percent / 100]);
+        }
+        page.printf("brushtalk_sd_write_latency_us{quantile=\"1\"} %u\n", (unsigned)snapshot.sdWriteUs[samples - 1]);
+    }
+    page.printf("brushtalk_sd_write_latency_us_sum %llu\n", (unsigned long long)snapshot.sdWriteSumUs);
+    page.printf("brushtalk_sd_write_latency_us_count %u\n", (unsigned)snapshot.sdWriteCount);
+
+    page.printf("# TYPE brushtalk_last_capture_level_dbfs gauge\n");
+    page.printf("brushtalk_last_capture_level_dbfs{stat=\"rms\"} %.1f\n", snapshot.captureRmsDbfs);
+    page.printf("brushtalk_last_capture_level_dbfs{stat=\"peak\"} %.1f\n", snapshot.capturePeakDbfs);
+    page.printf("# TYPE brushtalk_last_capture_dc_offset gauge\nbrushtalk_last_capture_dc_offset %d\n", snapshot.captureDcOffset);
+    page.printf("# TYPE brushtalk_last_capture_zero_run_ms gauge\nbrushtalk_last_capture_zero_run_ms %u\n",
+                (unsigned)snapshot.captureZeroRunMs);
+
+    page.printf("# TYPE brushtalk_heap_free_bytes gauge\nbrushtalk_heap_free_bytes %u\n",
+                (unsigned)heap_caps_get_free_size(MALLOC_CAP_8BIT));
+    page.printf("# TYPE brushtalk_heap_min_free_bytes gauge\nbrushtalk_heap_min_free_bytes %u\n",
+                (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+    page.printf("# TYPE brushtalk_heap_largest_free_block_bytes gauge\nbrushtalk_heap_largest_free_block_bytes %u\n",
+                (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+    page.printf("# TYPE brushtalk_upload_goodput_estimate_kbps gauge\nbrushtalk_upload_goodput_estimate_kbps %.1f\n",
+                max(uploadGoodputEstimateKbps(), 0.0f));
+    page.printf("# TYPE brushtalk_wifi_rssi_dbm gauge\nbrushtalk_wifi_rssi_dbm %d\n",
+                WiFi.status() == WL_CONNECTED ? (int)WiFi.RSSI() : 0);
+    page.printf("# TYPE brushtalk_inbox_messages gauge\nbrushtalk_inbox_messages %u\n", (unsigned)inboxCount());
+    page.printf("# TYPE brushtalk_outbox_messages gauge\nbrushtalk_outbox_messages %u\n", (unsigned)outboxPendingCount());
+    page.printf("# TYPE brushtalk_audio_pool_blocks gauge\n");
+    page.printf("brushtalk_audio_pool_blocks{state=\"in_use\"} %u\n", (unsigned)audioPoolInUse());
+    page.printf("brushtalk_audio_pool_blocks{state=\"peak\"} %u\n", (unsigned)audioPoolPeak());
+    page.printf("brushtalk_audio_pool_blocks{state=\"total\"} %u\n", (unsigned)audioPoolBlocks);
+    page.printf("# TYPE brushtalk_uptime_seconds gauge\nbrushtalk_uptime_seconds %lu\n", millis() / 1000);
+
+    // The page ends after the last line that fit whole; the counter shows up on the next scrape
+    if (page.truncated) {
+        buffer[page.length] = '\0';
+        metricsAdd(METRIC_METRICS_TRUNCATED);
+        Serial.printf("Metrics page truncated at %u bytes, raise metricsPageSize.\n", (unsigned)page.length);
+    }
+    return page.length;
+}
+
+static AsyncWebServer metricsServer(metricsPort);
+static char metricsPage[metricsPageSize];
+static volatile bool metricsPageBusy = false;
+
+void metricsBegin() {
+    metricsServer.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request) {
+        // The page buffer is sent straight from memory, so it stays reserved until the
+        // response is done; a scrape arriving meanwhile is turned away
+        if (metricsPageBusy) {
+            request->send(503, "text/plain", "busy");
+            return;
+        }
+        metricsPageBusy = true;
+        size_t length = metricsRender(metricsPage, sizeof(metricsPage));
+        request->onDisconnect([]() { metricsPageBusy = false; });
+        request->send(request->beginResponse_P(200, "text/plain; version=0.0.4", (const uint8_t *)metricsPage, length));
+    });
+    metricsServer.begin();
+    Serial.printf("Metrics served on port %u at /metrics.\n", metricsPort);
+}
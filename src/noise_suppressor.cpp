@@ -0,0 +1,162 @@
+#include "noise_suppressor.h"
+
+#include <math.h>
+#include <string.h>
+
+// cos and sin of 2 pi i / noiseMaxFftSize in Q30; smaller transforms take every n-th entry.
+// The products need 64 bits anyway, and Q15 twiddles lose a few LSB per transform.
+static int32_t twiddleCos[noiseMaxFftSize / 2];
+static int32_t twiddleSin[noiseMaxFftSize / 2];
+static bool twiddlesReady = false;
+
+static void buildTwiddles() {
+    if (twiddlesReady) {
+        return;
+    }
+    for (size_t i = 0; i < noiseMaxFftSize / 2; i++) {
+        double angle = 2.0 * M_PI * i / noiseMaxFftSize;
+        twiddleCos[i] = (int32_t)lround(1073741824.0 * cos(angle));
+        twiddleSin[i] = (int32_t)lround(1073741824.0 * sin(angle));
+    }
+    twiddlesReady = true;
+}
+
+void fixedFft(int32_t *data, size_t size, bool inverse) {
+    buildTwiddles();
+
+    // Bit-reversed order, so the butterflies can work in place
+    for (size_t i = 1, j = 0; i < size; i++) {
+        size_t bit = size >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            int32_t re = data[2 * i];
+            int32_t im = data[2 * i + 1];
+            data[2 * i] = data[2 * j];
+            data[2 * i + 1] = data[2 * j + 1];
+            data[2 * j] = re;
+            data[2 * j + 1] = im;
+        }
+    }
+
+    // Every stage value is a partial sum of the input, so for 16-bit input and size up to
+    // 1024 it stays below 2^30 either way and no stage needs scaling
+    for (size_t length = 2; length <= size; length <<= 1) {
+        size_t half = length >> 1;
+        size_t stride = noiseMaxFftSize / length;
+        for (size_t k = 0; k < half; k++) {
+            int32_t wr = twiddleCos[k * stride];
+            int32_t wi = inverse ? twiddleSin[k * stride] : -twiddleSin[k * stride];
+            for (size_t start = k; start < size; start += length) {
+                int32_t *a = data + 2 * start;
+                int32_t *b = data + 2 * (start + half);
+                int32_t tr = (int32_t)(((int64_t)b[0] * wr - (int64_t)b[1] * wi) >> 30);
+                int32_t ti = (int32_t)(((int64_t)b[0] * wi + (int64_t)b[1] * wr) >> 30);
+                b[0] = a[0] - tr;
+                b[1] = a[1] - ti;
+                a[0] += tr;
+                a[1] += ti;
+            }
+        }
+    }
+}
+
+void NoiseSuppressor::begin(uint32_t sampleRate) {
+    // Doubling while 10 ms lies above the midpoint to the next power of two
+    size_t tenMs = sampleRate / 100;
+    hop = 64;
+    while (hop < noiseMaxFftSize / 2 && hop * 3 / 2 < tenMs) {
+        hop *= 2;
+    }
+    fftSize = hop * 2;
+    fftBits = 0;
+    while ((1u << fftBits) < fftSize) {
+        fftBits++;
+    }
+
+    // sin(pi n / N) is the square root of the periodic Hann window; analysis and synthesis
+    // together give Hann, whose half-overlapping copies sum to one
+    for (size_t n = 0; n < fftSize; n++) {
+        window[n] = (int16_t)lround(32767.0 * sin(M_PI * n / fftSize));
+    }
+    memset(input, 0, sizeof(input));
+    memset(output, 0, sizeof(output));
+    memset(overlap, 0, sizeof(overlap));
+    memset(noisePower, 0, sizeof(noisePower));
+    memset(cleanPower, 0, sizeof(cleanPower));
+    position = 0;
+    framesSeen = 0;
+}
+
+void NoiseSuppressor::process(int16_t *samples, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        int16_t sample = samples[i];
+        samples[i] = output[position];
+        input[hop + position] = sample;
+        if (++position == hop) {
+            processFrame();
+            position = 0;
+        }
+    }
+}
+
+void NoiseSuppressor::processFrame() {
+    for (size_t n = 0; n < fftSize; n++) {
+        spectrum[2 * n] = ((int32_t)input[n] * window[n]) >> 15;
+        spectrum[2 * n + 1] = 0;
+    }
+    fixedFft(spectrum, fftSize, false);
+
+    // The input is real, so bins above N/2 mirror the ones below and share their gain
+    size_t bins = fftSize / 2 + 1;
+    bool learning = framesSeen < noiseLearnFrames;
+    for (size_t k = 0; k < bins; k++) {
+        float re = spectrum[2 * k];
+        float im = spectrum[2 * k + 1];
+        float power = re * re + im * im;
+
+        float &noise = noisePower[k];
+        if (learning) {
+            noise += (power - noise) / (framesSeen + 1);
+        } else if (power < noiseSpeechRatio * noise) {
+            noise += noiseTrackWeight * (power - noise);
+        } else {
+            noise *= noiseCreep;
+        }
+
+        float posterior = power / (noise > 1.0f ? noise : 1.0f);
+        float prior = noiseDecisionWeight * cleanPower[k] / (noise > 1.0f ? noise : 1.0f) +
+                      (1.0f - noiseDecisionWeight) * (posterior > 1.0f ? posterior - 1.0f : 0.0f);
+        float gain = prior / (1.0f + prior);
+        if (gain < noiseGainFloor) {
+            gain = noiseGainFloor;
+        }
+        cleanPower[k] = gain * gain * power;
+
+        int32_t gainQ15 = (int32_t)(gain * 32767.0f);
+        spectrum[2 * k] = (int32_t)(((int64_t)spectrum[2 * k] * gainQ15) >> 15);
+        spectrum[2 * k + 1] = (int32_t)(((int64_t)spectrum[2 * k + 1] * gainQ15) >> 15);
+        if (k > 0 && k < fftSize / 2) {
+            size_t mirror = fftSize - k;
+            spectrum[2 * mirror] = (int32_t)(((int64_t)spectrum[2 * mirror] * gainQ15) >> 15);
+            spectrum[2 * mirror + 1] = (int32_t)(((int64_t)spectrum[2 * mirror + 1] * gainQ15) >> 15);
+        }
+    }
+    framesSeen++;
+
+    fixedFft(spectrum, fftSize, true);
+
+    // Synthesis window and overlap-add; the first half completes the previous frame
+    for (size_t n = 0; n < fftSize; n++) {
+        int32_t value = (int32_t)(((int64_t)(spectrum[2 * n] >> fftBits) * window[n]) >> 15);
+        if (n < hop) {
+            int32_t sum = overlap[n] + value;
+            output[n] = sum > 32767 ? 32767 : (sum < -32768 ? -32768 : sum);
+        } else {
+            overlap[n - hop] = value;
+        }
+    }
+    memmove(input, input + hop, hop * sizeof(int16_t));
+}
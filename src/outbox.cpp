@@ -0,0 +1,362 @@
+#include "outbox.h"
+
+#include <WiFi.h>
+#include <Preferences.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include "config.h"
+#include "http_connection.h"
+#include "lan_peer.h"
+#include "lan_protocol.h"
+#include "message_index.h"
+#include "metrics.h"
+#include "ram_message.h"
+#include "storage.h"
+#include "uploader.h"
+
+// FIFO of queued recording ids, oldest first, so messages arrive in the order they were made.
+// Size and attempt count live in the message index.
+static uint32_t outboxQueue[outboxCapacity];
+static size_t outboxHead = 0;
+static size_t outboxCount = 0;
+static SemaphoreHandle_t outboxMutex = NULL;
+static TaskHandle_t outboxTask = NULL;
+
+// The queued recording that is only held in RAM, if any, and when it was queued
+static uint32_t heldRecordingId = 0;
+static unsigned long heldRecordingSinceMs = 0;
+
+// Paths of a queued message and its side files; path holds outboxPathSize bytes
+static char *outboxPath(uint32_t id, const char *extension, char *path) {
+    snprintf(path, outboxPathSize, "%s/%u.%s", outboxDir, (unsigned)id, extension);
+    return path;
+}
+
+char *outboxAudioPath(uint32_t id, char *path) {
+    return outboxPath(id, "wav", path);
+}
+
+// The resumable upload session of a message that failed part way, if any
+static char *outboxSessionPath(uint32_t id, char *path) {
+    return outboxPath(id, "ses", path);
+}
+
+// Peers still waiting for a message that already reached some of them over the LAN
+static char *outboxRecipientsPath(uint32_t id, char *path) {
+    return outboxPath(id, "rcp", path);
+}
+
+// Small one-line side files next to a queued message. Returns false if there is none.
+static bool readOutboxNote(const char *path, char *note, size_t size) {
+    note[0] = '\0';
+    fs::FS &state = storageForState();
+    if (!state.exists(path)) {
+        return false;
+    }
+    File noteFile = state.open(path, FILE_READ);
+    if (!noteFile) {
+        return false;
+    }
+    size_t length = noteFile.readBytesUntil('\n', note, size - 1);
+    note[length] = '\0';
+    noteFile.close();
+    return true;
+}
+
+static void writeOutboxNote(const char *path, const char *note) {
+    File noteFile = storageForState().open(path, FILE_WRITE);
+    if (!noteFile) {
+        Serial.printf("Failed to write %s.\n", path);
+        return;
+    }
+    noteFile.print(note);
+    noteFile.close();
+}
+
+// Recordings live in their RAM slot or on whichever tier their size put them on
+static void removeOutboxAudio(uint32_t id) {
+    RamMessage *ramMessage = ramMessageFind(RAM_OUTBOUND, id);
+    if (ramMessage != NULL) {
+        ramMessageRelease(ramMessage);
+        return;
+    }
+    char audioPath[outboxPathSize];
+    outboxAudioPath(id, audioPath);
+    storageHolding(audioPath).remove(audioPath);
+}
+
+// A recording held in RAM only goes to storage once delivering it failed or can't even
+// be tried. Afterwards it is retried from there like any other message.
+static void storeOutboxAudio(uint32_t id) {
+    RamMessage *ramMessage = ramMessageFind(RAM_OUTBOUND, id);
+    if (ramMessage != NULL) {
+        char audioPath[outboxPathSize];
+        ramMessagePersist(ramMessage, outboxAudioPath(id, audioPath));
+    }
+}
+
+// Store the recording held in RAM once the link is down or it has waited too long,
+// e.g. behind other messages or a backoff
+static void storeHeldRecording(bool linkDown) {
+    xSemaphoreTake(outboxMutex, portMAX_DELAY);
+    uint32_t id = heldRecordingId;
+    bool due = id != 0 && (linkDown || millis() - heldRecordingSinceMs >= outboxRamHoldMs);
+    if (due) {
+        heldRecordingId = 0;
+    }
+    xSemaphoreGive(outboxMutex);
+    if (due) {
+        storeOutboxAudio(id); // Nothing to do if it was delivered meanwhile
+    }
+}
+
+static bool pushOutboxEntry(uint32_t id) {
+    if (outboxCount == outboxCapacity) {
+        return false;
+    }
+    outboxQueue[(outboxHead + outboxCount) % outboxCapacity] = id;
+    outboxCount++;
+    return true;
+}
+
+bool outboxBegin() {
+    outboxMutex = xSemaphoreCreateMutex();
+
+    if (!storageMakeDir(outboxDir)) {
+        Serial.println("Failed to create outbox directory.");
+        return false;
+    }
+
+    // Recordings interrupted by a reset never got a valid header; drop them
+    uint32_t ids[outboxCapacity];
+    size_t count = messageIndexList(MESSAGE_OUTBOUND, MESSAGE_RECORDING, ids, outboxCapacity);
+    for (size_t i = 0; i < count; i++) {
+        removeOutboxAudio(ids[i]);
+        messageIndexSetState(MESSAGE_OUTBOUND, ids[i], MESSAGE_DELETED);
+    }
+
+    // Pick up recordings that were still waiting when the device was switched off
+    count = messageIndexList(MESSAGE_OUTBOUND, MESSAGE_QUEUED, ids, outboxCapacity);
+    for (size_t i = 0; i < count; i++) {
+        pushOutboxEntry(ids[i]);
+    }
+
+    Serial.printf("Outbox ready, %u message(s) pending.\n", (unsigned)outboxCount);
+    return true;
+}
+
+uint32_t outboxReserveId(uint8_t codec) {
+    Preferences preferences;
+    preferences.begin("outbox", false);
+    uint32_t id = preferences.getUInt("nextId", 1);
+    preferences.putUInt("nextId", id + 1);
+    preferences.end();
+
+    MessageRecord record = {};
+    record.direction = MESSAGE_OUTBOUND;
+    record.id = id;
+    record.state = MESSAGE_RECORDING;
+    record.codec = codec;
+    return messageIndexAdd(record) ? id : 0;
+}
+
+bool outboxEnqueue(uint32_t id, size_t size, uint32_t crc) {
+    MessageRecord record = {};
+    messageIndexGet(MESSAGE_OUTBOUND, id, record);
+    record.direction = MESSAGE_OUTBOUND;
+    record.id = id;
+    record.state = MESSAGE_QUEUED;
+    record.size = size;
+    record.crc = crc;
+    if (!messageIndexPut(record)) {
+        Serial.printf("Message %u could not be recorded in the index; it may be lost on reboot.\n", (unsigned)id);
+    }
+
+    bool heldInRam = ramMessageFind(RAM_OUTBOUND, id) != NULL;
+    xSemaphoreTake(outboxMutex, portMAX_DELAY);
+    bool queued = pushOutboxEntry(id);
+    if (queued && heldInRam) {
+        heldRecordingId = id;
+        heldRecordingSinceMs = millis();
+    }
+    xSemaphoreGive(outboxMutex);
+    if (!queued) {
+        storeOutboxAudio(id);
+        Serial.printf("Outbox full, message %u stays in storage for a later boot.\n", (unsigned)id);
+    }
+
+    Serial.printf("Message %u (%u bytes) queued for upload.\n", (unsigned)id, (unsigned)size);
+    if (outboxTask != NULL) {
+        xTaskNotifyGive(outboxTask);
+    }
+    return true;
+}
+
+size_t outboxPendingCount() {
+    xSemaphoreTake(outboxMutex, portMAX_DELAY);
+    size_t count = outboxCount;
+    xSemaphoreGive(outboxMutex);
+    return count;
+}
+
+static bool peekOutboxHead(uint32_t &id) {
+    xSemaphoreTake(outboxMutex, portMAX_DELAY);
+    bool available = outboxCount > 0;
+    if (available) {
+        id = outboxQueue[outboxHead];
+    }
+    xSemaphoreGive(outboxMutex);
+    return available;
+}
+
+static void popOutboxHead() {
+    xSemaphoreTake(outboxMutex, portMAX_DELAY);
+    outboxHead = (outboxHead + 1) % outboxCapacity;
+    outboxCount--;
+    xSemaphoreGive(outboxMutex);
+}
+
+// The message reached everyone; forget it
+static void finishOutboxHead(uint32_t id) {
+    char path[outboxPathSize];
+    messageIndexSetState(MESSAGE_OUTBOUND, id, MESSAGE_SENT);
+    removeOutboxAudio(id);
+    storageForState().remove(outboxSessionPath(id, path));
+    storageForState().remove(outboxRecipientsPath(id, path));
+    popOutboxHead();
+    Serial.printf("Message %u delivered, %u left in outbox.\n", (unsigned)id, (unsigned)outboxPendingCount());
+}
+
+// Push a message to each listed peer that is reachable on the LAN. The peers that still
+// need it go into remaining, comma separated.
+static void deliverOverLan(uint32_t id, RamMessage *ramMessage, const char *remoteName, uint32_t crc,
+                           const char *recipients, char *remaining) {
+    char peers[outboxRecipientsSize];
+    char audioPath[outboxPathSize];
+    strlcpy(peers, recipients, sizeof(peers));
+    remaining[0] = '\0';
+    char *position = NULL;
+    for (char *peer = strtok_r(peers, ",", &position); peer != NULL; peer = strtok_r(NULL, ",", &position)) {
+        bool sent = ramMessage != NULL ? lanPeerSendBuffer(peer, ramMessage->data, ramMessage->length, remoteName, crc)
+                                       : lanPeerSend(peer, outboxAudioPath(id, audioPath), remoteName, crc);
+        if (!sent) {
+            if (remaining[0] != '\0') {
+                strlcat(remaining, ",", outboxRecipientsSize);
+            }
+            strlcat(remaining, peer, outboxRecipientsSize);
+        }
+    }
+}
+
+// Full jitter: wait a random time between zero and the exponential backoff window
+static unsigned long outboxBackoffMs(uint32_t attempts) {
+    unsigned long window = outboxBackoffCapMs;
+    if (attempts < 16) {
+        window = min(outboxBackoffCapMs, outboxBackoffBaseMs << attempts);
+    }
+    return esp_random() % (window + 1);
+}
+
+static void outboxUploaderTask(void *parameter) {
+    // Static so they stay off the stack, which TLS needs most of
+    static char recipients[outboxRecipientsSize];
+    static char remaining[outboxRecipientsSize];
+    bool wasConnected = false;
+    unsigned long lastFailureMs = 0;
+    unsigned long backoffMs = 0;
+
+    while (true) {
+        // Woken early by outboxEnqueue, otherwise poll connectivity once a second
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+
+        bool connected = WiFi.status() == WL_CONNECTED;
+        if (connected && !wasConnected) {
+            backoffMs = 0; // Connectivity is back, don't sit out the old backoff
+        }
+        wasConnected = connected;
+        storeHeldRecording(!connected);
+        if (!connected || millis() - lastFailureMs < backoffMs) {
+            continue;
+        }
+
+        uint32_t id;
+        if (!peekOutboxHead(id)) {
+            continue;
+        }
+
+        // A recording that was only held in RAM doesn't survive a reset
+        char audioPath[outboxPathSize];
+        outboxAudioPath(id, audioPath);
+        MessageRecord record = {};
+        RamMessage *ramMessage = ramMessageFind(RAM_OUTBOUND, id);
+        if (!messageIndexGet(MESSAGE_OUTBOUND, id, record) ||
+            (ramMessage == NULL && !storageHolding(audioPath).exists(audioPath))) {
+            Serial.printf("Message %u is missing from storage, dropping it.\n", (unsigned)id);
+            messageIndexSetState(MESSAGE_OUTBOUND, id, MESSAGE_DELETED);
+            popOutboxHead();
+            continue;
+        }
+
+        Serial.printf("Uploading queued message %u (attempt %u)...\n", (unsigned)id, (unsigned)record.attempts + 1);
+        char notePath[outboxPathSize];
+        char remoteName[lanMaxNameLength + 1];
+        snprintf(remoteName, sizeof(remoteName), "%s_%u.wav", deviceName.c_str(), (unsigned)id);
+        char sessionLocation[httpLocationSize];
+        readOutboxNote(outboxSessionPath(id, notePath), sessionLocation, sizeof(sessionLocation));
+        if (!readOutboxNote(outboxRecipientsPath(id, notePath), recipients, sizeof(recipients))) {
+            if (strlcpy(recipients, devicePeers.c_str(), sizeof(recipients)) >= sizeof(recipients)) {
+                Serial.println("Peer list too long, sending to the first peers only.");
+            }
+        }
+
+        // Peers on the same network get the message directly. Only before a server session
+        // exists, since that session was created for a fixed set of recipients.
+        if (sessionLocation[0] == '\0' && recipients[0] != '\0') {
+            deliverOverLan(id, ramMessage, remoteName, record.crc, recipients, remaining);
+            if (remaining[0] == '\0') {
+                finishOutboxHead(id);
+                backoffMs = 0;
+                continue;
+            }
+            if (strcmp(remaining, recipients) != 0) {
+                strlcpy(recipients, remaining, sizeof(recipients));
+                writeOutboxNote(outboxRecipientsPath(id, notePath), recipients);
+            }
+        }
+
+        UploadStats stats;
+        bool uploaded = ramMessage != NULL
+            ? uploadBufferResumable(ramMessage->data, ramMessage->length, remoteName, deviceName.c_str(), recipients,
+                                    record.crc, stats, sessionLocation)
+            : uploadFileResumable(audioPath, remoteName, deviceName.c_str(), recipients, record.crc, stats,
+                                  sessionLocation);
+        metricsAdd(METRIC_BYTES_UPLOADED, stats.bytesSent);
+        metricsAdd(uploaded ? METRIC_UPLOADS_OK : METRIC_UPLOADS_FAILED);
+        metricsObserve(STAGE_UPLOAD, stats.elapsedMs);
+
+        if (uploaded) {
+            finishOutboxHead(id);
+            backoffMs = 0;
+            continue;
+        }
+
+        // Keep the message and the session, so the next attempt resumes instead of starting over
+        storeOutboxAudio(id);
+        if (sessionLocation[0] != '\0') {
+            writeOutboxNote(outboxSessionPath(id, notePath), sessionLocation);
+        }
+        record.attempts++;
+        messageIndexPut(record);
+
+        lastFailureMs = millis();
+        backoffMs = outboxBackoffMs(record.attempts);
+        Serial.printf("Upload of message %u failed, next attempt in %lu ms.\n", (unsigned)id, backoffMs);
+    }
+}
+
+void outboxStartUploader() {
+    // TLS needs a generous stack; pinned to the protocol core so the loop keeps recording
+    xTaskCreatePinnedToCore(outboxUploaderTask, "outbox", 10240, NULL, 1, &outboxTask, 0);
+}
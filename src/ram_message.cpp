@@ -0,0 +1,98 @@
+#include "ram_message.h"
+
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+
+#include "metrics.h"
+#include "storage.h"
+
+static RamMessage ramSlots[RAM_SLOT_COUNT];
+static size_t slotCapacity = 0;
+static portMUX_TYPE slotLock = portMUX_INITIALIZER_UNLOCKED;
+
+bool ramMessageBegin(size_t slotBytes) {
+    if (!psramFound()) {
+        Serial.println("No PSRAM, so no RAM message slots; all messages go to storage.");
+        return false;
+    }
+    // Both slots in one allocation, taken before the heap fragments
+    size_t capacity = slotBytes;
+    uint8_t *memory = (uint8_t *)heap_caps_malloc(capacity * RAM_SLOT_COUNT, MALLOC_CAP_SPIRAM);
+    if (memory == NULL) {
+        Serial.println("Failed to allocate the RAM message slots; all messages go to storage.");
+        return false;
+    }
+
+    for (size_t i = 0; i < RAM_SLOT_COUNT; i++) {
+        ramSlots[i].data = memory + i * capacity;
+        ramSlots[i].length = 0;
+        ramSlots[i].id = 0;
+    }
+    slotCapacity = capacity;
+    Serial.printf("RAM message slots ready: %u x %u KB in PSRAM.\n", (unsigned)RAM_SLOT_COUNT,
+                  (unsigned)(capacity / 1024));
+    return true;
+}
+
+size_t ramMessageCapacity() {
+    return slotCapacity;
+}
+
+RamMessage *ramMessageClaim(RamSlot slot, uint32_t id, size_t size) {
+    if (size > slotCapacity || id == 0) {
+        return NULL;
+    }
+    RamMessage *message = &ramSlots[slot];
+    portENTER_CRITICAL(&slotLock);
+    bool claimed = message->id == 0;
+    if (claimed) {
+        message->id = id;
+        message->length = 0;
+    }
+    portEXIT_CRITICAL(&slotLock);
+    if (!claimed) {
+        return NULL;
+    }
+    metricsAdd(METRIC_RAM_MESSAGES);
+    return message;
+}
+
+RamMessage *ramMessageFind(RamSlot slot, uint32_t id) {
+    portENTER_CRITICAL(&slotLock);
+    bool held = id != 0 && ramSlots[slot].id == id;
+    portEXIT_CRITICAL(&slotLock);
+    return held ? &ramSlots[slot] : NULL;
+}
+
+void ramMessageRelease(RamMessage *message) {
+    if (message == NULL) {
+        return;
+    }
+    portENTER_CRITICAL(&slotLock);
+    message->id = 0;
+    message->length = 0;
+    portEXIT_CRITICAL(&slotLock);
+}
+
+bool ramMessagePersist(RamMessage *message, const char *path) {
+    File file = storageForSize(message->length).open(path, FILE_WRITE);
+    if (!file) {
+        Serial.printf("Failed to open %s to store message %u.\n", path, (unsigned)message->id);
+        return false;
+    }
+    unsigned long writeStart = micros();
+    size_t written = file.write(message->data, message->length);
+    file.close();
+    metricsObserveSdWrite(micros() - writeStart);
+    if (written != message->length) {
+        Serial.printf("Failed to store message %u (%u of %u bytes written).\n", (unsigned)message->id,
+                      (unsigned)written, (unsigned)message->length);
+        storageHolding(path).remove(path);
+        return false;
+    }
+
+    Serial.printf("Message %u moved from RAM to %s.\n", (unsigned)message->id, path);
+    metricsAdd(METRIC_RAM_MESSAGES_PERSISTED);
+    ramMessageRelease(message);
+    return true;
+}
@@ -0,0 +1,37 @@
+#include "recording_format.h"
+
+// From best to smallest: 706, 256, 64 and 32 kbit/s
+static const struct {
+    bool adpcm;
+    uint32_t sampleRate;
+} recordingFormats[] = {
+    {false, 44100},
+    {false, 16000},
+    {true, 16000},
+    {true, 8000},
+};
+const size_t recordingFormatCount = sizeof(recordingFormats) / sizeof(recordingFormats[0]);
+
+static WavInfo recordingFormat(size_t index) {
+    return recordingFormats[index].adpcm ? wavImaAdpcmFormat(recordingFormats[index].sampleRate)
+                                         : wavPcm16Format(recordingFormats[index].sampleRate);
+}
+
+size_t recordingBytes(const WavInfo &format, unsigned long durationMs) {
+    return wavMaxHeaderBytes + (uint64_t)wavBytesPerSecond(format) * durationMs / 1000;
+}
+
+WavInfo chooseRecordingFormat(unsigned long durationMs, float goodputKbps) {
+    if (goodputKbps < 0.0f) {
+        return recordingFormat(0);
+    }
+    for (size_t i = 0; i < recordingFormatCount - 1; i++) {
+        WavInfo format = recordingFormat(i);
+        // bits per kbit/s is milliseconds
+        float uploadMs = (float)recordingBytes(format, durationMs) * 8.0f / max(goodputKbps, 0.001f);
+        if (uploadMs <= recordingUploadTargetMs) {
+            return format;
+        }
+    }
+    return recordingFormat(recordingFormatCount - 1);
+}
@@ -0,0 +1,200 @@
+#include "storage.h"
+
+#include <LittleFS.h>
+#include <SD.h>
+#include <SD_MMC.h>
+#include <SPI.h>
+
+#include "audio_pool.h"
+#include "crc32.h"
+
+fs::FS flashStorage = fs::FS(fs::FSImplPtr());
+fs::FS cardStorage = fs::FS(fs::FSImplPtr());
+
+static bool flashMounted = false;
+static bool cardMounted = false;
+
+#if BRUSHTALK_SD_MMC
+// SDMMC settings to try, fastest first
+static const struct {
+    bool oneBit;
+    int frequencyKhz;
+    const char *description;
+} sdMmcModes[] = {
+    {false, SDMMC_FREQ_HIGHSPEED, "SDMMC 4-bit 40 MHz"},
+    {false, SDMMC_FREQ_DEFAULT, "SDMMC 4-bit 20 MHz"},
+    {true, SDMMC_FREQ_HIGHSPEED, "SDMMC 1-bit 40 MHz"},
+    {true, SDMMC_FREQ_DEFAULT, "SDMMC 1-bit 20 MHz"},
+};
+const size_t sdMmcModeCount = sizeof(sdMmcModes) / sizeof(sdMmcModes[0]);
+#endif
+
+// SPI clocks to try, fastest first; 4 MHz is the library default and always the last resort
+static const uint8_t spiClocksMhz[] = {40, 26, 20, 10, 4};
+
+// Deterministic filler for the probe, so the read-back can be checked without a copy
+static void fillProbeBlock(uint8_t *data, size_t length, uint32_t seed) {
+    uint32_t state = seed * 2654435761u + 1;
+    for (size_t i = 0; i < length; i += sizeof(uint32_t)) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        memcpy(data + i, &state, sizeof(state));
+    }
+}
+
+// Write and read back a test file through the mounted card. Returns false if the card
+// doesn't hold the data at this bus setting.
+static bool probeCard(AudioBlock *block, float &writeMBps, float &readMBps) {
+    size_t blockCount = storageProbeBytes / audioBlockBytes;
+    uint32_t expectedCrc = 0;
+
+    File probeFile = cardStorage.open(storageProbePath, FILE_WRITE);
+    if (!probeFile) {
+        return false;
+    }
+    unsigned long startUs = micros();
+    bool ok = true;
+    for (size_t i = 0; i < blockCount && ok; i++) {
+        fillProbeBlock(block->data, audioBlockBytes, i);
+        expectedCrc = crc32Update(expectedCrc, block->data, audioBlockBytes);
+        ok = probeFile.write(block->data, audioBlockBytes) == audioBlockBytes;
+    }
+    probeFile.close(); // Included in the timing; the last sectors are only flushed here
+    unsigned long writeUs = micros() - startUs;
+
+    uint32_t readCrc = 0;
+    probeFile = cardStorage.open(storageProbePath, FILE_READ);
+    ok = ok && probeFile;
+    startUs = micros();
+    for (size_t i = 0; i < blockCount && ok; i++) {
+        ok = probeFile.read(block->data, audioBlockBytes) == audioBlockBytes;
+        readCrc = crc32Update(readCrc, block->data, audioBlockBytes);
+    }
+    unsigned long readUs = micros() - startUs;
+    if (probeFile) {
+        probeFile.close();
+    }
+    cardStorage.remove(storageProbePath);
+
+    // Bytes per microsecond equals MB/s
+    writeMBps = (float)storageProbeBytes / max(writeUs, 1UL);
+    readMBps = (float)storageProbeBytes / max(readUs, 1UL);
+    return ok && readCrc == expectedCrc;
+}
+
+// Keep the card mounted if it passes the probe, otherwise unmount it again
+static bool tryCard(fs::FS &card, bool mounted, const char *description, AudioBlock *block, void (*unmount)()) {
+    if (!mounted) {
+        return false;
+    }
+    cardStorage = card;
+    float writeMBps = 0.0f;
+    float readMBps = 0.0f;
+    if (!probeCard(block, writeMBps, readMBps)) {
+        Serial.printf("SD card on %s failed the read-back check.\n", description);
+        cardStorage = fs::FS(fs::FSImplPtr());
+        unmount();
+        return false;
+    }
+    Serial.printf("SD card on %s: write %.2f MB/s, read %.2f MB/s.\n", description, writeMBps, readMBps);
+    return true;
+}
+
+#if BRUSHTALK_SD_MMC
+static void unmountSdMmc() {
+    SD_MMC.end();
+}
+#endif
+
+static void unmountSd() {
+    SD.end();
+}
+
+static bool mountCard(uint8_t csPin) {
+    AudioBlock *block = audioBlockAcquire(pdMS_TO_TICKS(1000));
+    if (block == NULL) {
+        Serial.println("No free audio buffer for the storage probe.");
+        return false;
+    }
+
+    bool ready = false;
+#if BRUSHTALK_SD_MMC
+    for (size_t i = 0; i < sdMmcModeCount && !ready; i++) {
+        bool mounted = SD_MMC.begin("/sdcard", sdMmcModes[i].oneBit, false, sdMmcModes[i].frequencyKhz);
+        ready = tryCard(SD_MMC, mounted, sdMmcModes[i].description, block, unmountSdMmc);
+    }
+#endif
+    for (size_t i = 0; i < sizeof(spiClocksMhz) && !ready; i++) {
+        if (spiClocksMhz[i] > BRUSHTALK_SD_SPI_MAX_MHZ) {
+            continue;
+        }
+        char description[32];
+        snprintf(description, sizeof(description), "SPI %u MHz", spiClocksMhz[i]);
+        bool mounted = SD.begin(csPin, SPI, spiClocksMhz[i] * 1000000UL);
+        ready = tryCard(SD, mounted, description, block, unmountSd);
+    }
+
+    audioBlockRelease(block);
+    return ready;
+}
+
+static size_t flashFreeBytes() {
+    size_t total = LittleFS.totalBytes();
+    size_t used = LittleFS.usedBytes();
+    return total > used ? total - used : 0;
+}
+
+bool storageBegin(uint8_t csPin) {
+    // The partition is formatted the first time, so a new device needs no preparation
+    flashMounted = LittleFS.begin(true);
+    if (flashMounted) {
+        flashStorage = LittleFS;
+        Serial.printf("Flash storage: %u of %u KB free.\n", (unsigned)(flashFreeBytes() / 1024),
+                      (unsigned)(LittleFS.totalBytes() / 1024));
+    } else {
+        Serial.println("Failed to mount the flash partition.");
+    }
+
+    cardMounted = mountCard(csPin);
+    if (!cardMounted) {
+        Serial.println("No usable SD card, storing everything in flash.");
+    }
+    return flashMounted || cardMounted;
+}
+
+bool storageHasCard() {
+    return cardMounted;
+}
+
+fs::FS &storageForSize(size_t size) {
+    if (!cardMounted) {
+        return flashStorage;
+    }
+    if (flashMounted && size <= storageFlashMaxMessage && flashFreeBytes() >= size + storageFlashReserve) {
+        return flashStorage;
+    }
+    return cardStorage;
+}
+
+fs::FS &storageHolding(const char *path) {
+    if (flashMounted && (!cardMounted || flashStorage.exists(path))) {
+        return flashStorage;
+    }
+    return cardStorage;
+}
+
+fs::FS &storageForState() {
+    return flashMounted ? flashStorage : cardStorage;
+}
+
+bool storageMakeDir(const char *path) {
+    bool made = true;
+    if (flashMounted && !flashStorage.exists(path)) {
+        made &= flashStorage.mkdir(path);
+    }
+    if (cardMounted && !cardStorage.exists(path)) {
+        made &= cardStorage.mkdir(path);
+    }
+    return made;
+}
@@ -0,0 +1,233 @@
+#include "uploader.h"
+
+#include <WiFiClientSecure.h>
+
+#include "audio_pool.h"
+#include "config.h"
+#include "http_connection.h"
+#include "storage.h"
+
+static float goodputEstimateKbps = -1.0f; // Written by the outbox task only
+
+// What is being uploaded: a file in storage, or a message held in RAM (data not NULL)
+struct UploadSource {
+    File file;
+    const uint8_t *data;
+    size_t size;
+};
+
+// Create an upload session and put its location into sessionLocation. Returns false on failure.
+static bool createUploadSession(HttpConnection &http, size_t fileSize, uint32_t fileCrc, const char *remoteName,
+                                const char *deviceType, const char *recipients, char *sessionLocation) {
+    http.begin("POST", "/uploads");
+    http.header("Upload-Length", (uint32_t)fileSize);
+    http.header("X-Filename", remoteName);
+    http.header("X-Device-Type", deviceType);
+    if (recipients[0] != '\0') {
+        http.header("X-Recipients", recipients);
+    }
+    if (fileCrc != 0) {
+        char crcHeader[9];
+        snprintf(crcHeader, sizeof(crcHeader), "%08x", (unsigned)fileCrc);
+        http.header("X-Content-CRC32", crcHeader);
+    }
+
+    HttpResponse response;
+    int httpResponseCode = http.send() && http.readResponse(response) ? response.status : -1;
+    http.end();
+
+    if (httpResponseCode != 201 || response.location[0] == '\0') {
+        Serial.printf("Failed to create upload session, HTTP response code: %d\n", httpResponseCode);
+        return false;
+    }
+    strlcpy(sessionLocation, response.location, httpLocationSize);
+    Serial.printf("Upload session created: %s\n", sessionLocation);
+    return true;
+}
+
+// Ask the server how many bytes of the session it already holds. Returns -1 on failure.
+static long queryUploadOffset(HttpConnection &http, const char *sessionLocation, int &httpResponseCode) {
+    HttpResponse response;
+    httpResponseCode = http.request("HEAD", response, sessionLocation);
+    http.end();
+    long serverOffset = httpResponseCode == 200 ? response.uploadOffset : -1;
+
+    Serial.printf("Server offset query: HTTP %d, offset %ld\n", httpResponseCode, serverOffset);
+    return serverOffset;
+}
+
+// Send length bytes of the source starting at offset. Returns the offset reported by the
+// server (also on a 409 mismatch, so the caller can jump to it), or -1 on failure.
+static long sendChunk(HttpConnection &http, const char *sessionLocation, UploadSource &source, size_t offset,
+                      size_t length) {
+    AudioBlock *block = NULL;
+    if (source.data == NULL) {
+        if (!source.file.seek(offset)) {
+            Serial.printf("Failed to seek to offset %u in upload file.\n", (unsigned)offset);
+            return -1;
+        }
+        block = audioBlockAcquire(pdMS_TO_TICKS(1000));
+        if (block == NULL) {
+            Serial.println("No free audio buffer for the upload.");
+            return -1;
+        }
+    }
+
+    http.begin("PATCH", sessionLocation);
+    http.header("Content-Type", "application/offset+octet-stream");
+    http.header("Upload-Offset", (uint32_t)offset);
+    bool sent = http.send(length);
+
+    if (source.data != NULL) {
+        // Straight from the RAM slot, no copy
+        sent = sent && http.write(source.data + offset, length);
+    } else {
+        // File blocks go to the connection as they are read
+        size_t remaining = length;
+        while (sent && remaining > 0) {
+            block->length = source.file.read(block->data, min(remaining, audioBlockBytes));
+            sent = block->length > 0 && http.write(block->data, block->length);
+            remaining -= block->length;
+        }
+        audioBlockRelease(block);
+    }
+
+    HttpResponse response;
+    int httpResponseCode = sent && http.readResponse(response) ? response.status : -1;
+    http.end();
+    long serverOffset = -1;
+    if (httpResponseCode == 204 || httpResponseCode == 409) {
+        serverOffset = response.uploadOffset;
+    }
+
+    if (httpResponseCode == 422) {
+        Serial.println("Server rejected the assembled file: CRC32 mismatch.");
+    } else if (httpResponseCode != 204) {
+        Serial.printf("Chunk at offset %u failed with HTTP response code: %d\n", (unsigned)offset, httpResponseCode);
+    }
+    return serverOffset;
+}
+
+static bool uploadResumable(UploadSource &source, const char *remoteName, const char *deviceType,
+                            const char *recipients, uint32_t fileCrc, UploadStats &stats, char *sessionLocation) {
+    stats = UploadStats();
+    stats.fileSize = source.size;
+    if (stats.fileSize == 0) {
+        Serial.println("File is empty, upload aborted.");
+        return false;
+    }
+
+    WiFiClientSecure client;
+    client.setInsecure();
+    client.setTimeout(15000);
+    HttpConnection http(client);
+
+    unsigned long startTime = millis();
+    unsigned long backoffTotalMs = 0;
+    size_t offset = 0;
+    long startOffset = -1; // Server offset before this call sent anything, once known
+    // An existing session may already hold part of the file
+    bool needsResync = sessionLocation[0] != '\0';
+    bool success = false;
+
+    while (true) {
+        bool requestFailed = false;
+
+        if (sessionLocation[0] == '\0') {
+            offset = 0;
+            requestFailed = !createUploadSession(http, stats.fileSize, fileCrc, remoteName, deviceType, recipients,
+                                                 sessionLocation);
+            startOffset = 0;
+        } else if (needsResync) {
+            int httpResponseCode = 0;
+            long serverOffset = queryUploadOffset(http, sessionLocation, httpResponseCode);
+            if (httpResponseCode == 404) {
+                Serial.println("Upload session no longer exists, starting over.");
+                sessionLocation[0] = '\0';
+                requestFailed = true;
+            } else if (serverOffset < 0 || (size_t)serverOffset > stats.fileSize) {
+                requestFailed = true;
+            } else {
+                offset = serverOffset;
+                needsResync = false;
+                if (startOffset < 0) {
+                    startOffset = serverOffset; // Resumed; these bytes came in earlier calls
+                }
+            }
+        }
+
+        if (!requestFailed) {
+            if (offset >= stats.fileSize) {
+                success = true;
+                break;
+            }
+
+            size_t chunkLength = min(uploadChunkSize, stats.fileSize - offset);
+            long serverOffset = sendChunk(http, sessionLocation, source, offset, chunkLength);
+            stats.bytesSent += chunkLength;
+            if (serverOffset == (long)(offset + chunkLength)) {
+                offset = serverOffset;
+                continue;
+            }
+            // Either a mismatch the server told us about or a dropped request; resync first
+            needsResync = true;
+            requestFailed = true;
+        }
+
+        stats.retries++;
+        if (stats.retries > uploadMaxRetries) {
+            Serial.printf("Giving up after %u retries.\n", (unsigned)uploadMaxRetries);
+            break;
+        }
+        unsigned long backoffMs = 500UL << min(stats.retries, (uint32_t)5);
+        Serial.printf("Retrying upload in %lu ms (retry %u)...\n", backoffMs, (unsigned)stats.retries);
+        delay(backoffMs);
+        backoffTotalMs += backoffMs;
+    }
+
+    stats.bytesAcknowledged = startOffset >= 0 && offset > (size_t)startOffset ? offset - startOffset : 0;
+    stats.elapsedMs = millis() - startTime;
+    stats.transferMs = stats.elapsedMs - backoffTotalMs;
+    if (stats.transferMs > 0) {
+        // bits per millisecond equals kbit/s
+        stats.goodputKbps = (float)stats.bytesAcknowledged * 8.0f / (float)stats.transferMs;
+    }
+    if (stats.bytesAcknowledged > 0 && (!success || stats.bytesAcknowledged >= uploadEstimateMinBytes)) {
+        goodputEstimateKbps = goodputEstimateKbps < 0.0f
+            ? stats.goodputKbps
+            : goodputEstimateKbps + uploadGoodputWeight * (stats.goodputKbps - goodputEstimateKbps);
+    }
+
+    Serial.printf("Upload %s: %u/%u bytes acknowledged, %u bytes sent, %u retries, %lu ms (%lu transferring), "
+                  "goodput %.1f kbit/s\n", success ? "completed" : "failed",
+                  (unsigned)stats.bytesAcknowledged, (unsigned)stats.fileSize, (unsigned)stats.bytesSent,
+                  (unsigned)stats.retries, stats.elapsedMs, stats.transferMs, stats.goodputKbps);
+    return success;
+}
+
+bool uploadFileResumable(const char *filePath, const char *remoteName, const char *deviceType,
+                         const char *recipients, uint32_t fileCrc, UploadStats &stats, char *sessionLocation) {
+    UploadSource source = {};
+    source.file = storageHolding(filePath).open(filePath, FILE_READ);
+    if (!source.file) {
+        stats = UploadStats();
+        Serial.println("Failed to open file for reading. Check SD card and file path.");
+        return false;
+    }
+    source.size = source.file.size();
+    bool success = uploadResumable(source, remoteName, deviceType, recipients, fileCrc, stats, sessionLocation);
+    source.file.close();
+    return success;
+}
+
+bool uploadBufferResumable(const uint8_t *data, size_t size, const char *remoteName, const char *deviceType,
+                           const char *recipients, uint32_t fileCrc, UploadStats &stats, char *sessionLocation) {
+    UploadSource source = {};
+    source.data = data;
+    source.size = size;
+    return uploadResumable(source, remoteName, deviceType, recipients, fileCrc, stats, sessionLocation);
+}
+
+float uploadGoodputEstimateKbps() {
+    return goodputEstimateKbps;
+}
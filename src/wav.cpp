@@ -0,0 +1,207 @@
+#include "wav.h"
+
+static uint16_t readLe16(const uint8_t *bytes) {
+    return bytes[0] | (bytes[1] << 8);
+}
+
+static uint32_t readLe32(const uint8_t *bytes) {
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static uint8_t *writeLe16(uint8_t *bytes, uint16_t value) {
+    bytes[0] = value & 0xFF;
+    bytes[1] = value >> 8;
+    return bytes + 2;
+}
+
+static uint8_t *writeLe32(uint8_t *bytes, uint32_t value) {
+    writeLe16(bytes, value & 0xFFFF);
+    writeLe16(bytes + 2, value >> 16);
+    return bytes + 4;
+}
+
+static uint8_t *writeTag(uint8_t *bytes, const char *tag) {
+    memcpy(bytes, tag, 4);
+    return bytes + 4;
+}
+
+WavInfo wavPcm16Format(uint32_t sampleRate) {
+    WavInfo info = {};
+    info.format = wavFormatPcm;
+    info.channels = 1;
+    info.sampleRate = sampleRate;
+    info.bitsPerSample = 16;
+    info.blockAlign = 2;
+    return info;
+}
+
+WavInfo wavImaAdpcmFormat(uint32_t sampleRate) {
+    WavInfo info = {};
+    info.format = wavFormatImaAdpcm;
+    info.channels = 1;
+    info.sampleRate = sampleRate;
+    info.bitsPerSample = 4;
+    // Small blocks at low rates keep the per-block header overhead in proportion
+    info.blockAlign = sampleRate <= 11025 ? 256 : 512;
+    info.samplesPerBlock = (info.blockAlign - 4) * 2 + 1;
+    return info;
+}
+
+uint32_t wavBytesPerSecond(const WavInfo &info) {
+    if (info.format == wavFormatImaAdpcm) {
+        return (uint64_t)info.sampleRate * info.blockAlign / info.samplesPerBlock;
+    }
+    return info.sampleRate * info.blockAlign;
+}
+
+size_t wavWriteHeader(const WavInfo &info, uint8_t *out) {
+    bool adpcm = info.format == wavFormatImaAdpcm;
+    uint32_t formatBytes = adpcm ? 20 : 16;
+    uint32_t headerBytes = 12 + 8 + formatBytes + (adpcm ? 12 : 0) + (info.hasLoudness ? 12 : 0) + (info.hasQuality ? 28 : 0) + 8;
+
+    uint8_t *position = writeTag(out, "RIFF");
+    position = writeLe32(position, headerBytes - 8 + info.dataSize + info.trailerSize);
+    position = writeTag(position, "WAVE");
+
+    position = writeTag(position, "fmt ");
+    position = writeLe32(position, formatBytes);
+    position = writeLe16(position, info.format);
+    position = writeLe16(position, info.channels);
+    position = writeLe32(position, info.sampleRate);
+    position = writeLe32(position, wavBytesPerSecond(info) * info.channels);
+    position = writeLe16(position, info.blockAlign);
+    position = writeLe16(position, info.bitsPerSample);
+    if (adpcm) {
+        position = writeLe16(position, 2); // Size of the extension
+        position = writeLe16(position, info.samplesPerBlock);
+
+        // Sample count; a short final block holds 2 * (bytes - 4) + 1 samples
+        uint32_t lastBlockBytes = info.dataSize % info.blockAlign;
+        uint32_t sampleCount = info.dataSize / info.blockAlign * info.samplesPerBlock;
+        if (lastBlockBytes >= 4) {
+            sampleCount += 2 * (lastBlockBytes - 4) + 1;
+        }
+        position = writeTag(position, "fact");
+        position = writeLe32(position, 4);
+        position = writeLe32(position, sampleCount);
+    }
+
+    // Our own chunks; other readers skip them
+    if (info.hasLoudness) {
+        position = writeTag(position, "loud");
+        position = writeLe32(position, 4);
+        position = writeLe16(position, info.loudnessCentiLufs);
+        position = writeLe16(position, info.gainCentiDb);
+    }
+    if (info.hasQuality) {
+        const WavQuality &quality = info.quality;
+        position = writeTag(position, "qlty");
+        position = writeLe32(position, 20);
+        position = writeLe32(position, quality.sampleCount);
+        position = writeLe32(position, quality.clippedSamples);
+        position = writeLe32(position, quality.longestZeroRunMs);
+        position = writeLe16(position, quality.peak);
+        position = writeLe16(position, quality.dcOffset);
+        position = writeLe16(position, quality.rmsCentiDbfs);
+        position = writeLe16(position, quality.problems);
+    }
+
+    position = writeTag(position, "data");
+    position = writeLe32(position, info.dataSize);
+    return position - out;
+}
+
+size_t wavWriteTrailingChunk(const WavInfo &info, const char *tag, const uint8_t *body, uint32_t bodySize, uint8_t *out) {
+    uint8_t *position = out + ((info.dataSize & 1) ? 1 : 0);
+    memmove(position + 8, body, bodySize);
+    out[0] = 0;
+    position = writeTag(position, tag);
+    position = writeLe32(position, bodySize);
+    position += bodySize;
+    if (bodySize & 1) {
+        *position++ = 0;
+    }
+    return position - out;
+}
+
+// Reads a message held in memory the way File reads one in storage
+struct MemoryReader {
+    const uint8_t *data;
+    size_t length;
+    size_t offset;
+
+    size_t read(uint8_t *buffer, size_t size) {
+        size = min(size, length - offset);
+        memcpy(buffer, data + offset, size);
+        offset += size;
+        return size;
+    }
+    size_t position() const { return offset; }
+    size_t size() const { return length; }
+    bool seek(uint32_t position) {
+        offset = min((size_t)position, length);
+        return position <= length;
+    }
+};
+
+template <typename Reader>
+static bool parseHeader(Reader &file, WavInfo &info) {
+    uint8_t riff[12];
+    if (file.read(riff, sizeof(riff)) != sizeof(riff) || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0) {
+        return false;
+    }
+
+    bool hasFormat = false;
+    info.hasLoudness = false;
+    info.hasQuality = false;
+    uint8_t chunkHeader[8];
+    while (file.read(chunkHeader, sizeof(chunkHeader)) == sizeof(chunkHeader)) {
+        uint32_t chunkSize = readLe32(chunkHeader + 4);
+        uint32_t nextChunk = file.position() + chunkSize + (chunkSize & 1);
+
+        if (memcmp(chunkHeader, "fmt ", 4) == 0) {
+            uint8_t format[20] = {};
+            size_t formatBytes = min(chunkSize, (uint32_t)sizeof(format));
+            if (chunkSize < 16 || file.read(format, formatBytes) != formatBytes) {
+                return false;
+            }
+            info.format = readLe16(format);
+            info.channels = readLe16(format + 2);
+            info.sampleRate = readLe32(format + 4);
+            info.blockAlign = readLe16(format + 12);
+            info.bitsPerSample = readLe16(format + 14);
+            info.samplesPerBlock = formatBytes >= 20 ? readLe16(format + 18) : 0;
+            hasFormat = true;
+        } else if (memcmp(chunkHeader, "loud", 4) == 0 && chunkSize >= 4) {
+            uint8_t loudness[4];
+            if (file.read(loudness, sizeof(loudness)) != sizeof(loudness)) {
+                return false;
+            }
+            info.loudnessCentiLufs = (int16_t)readLe16(loudness);
+            info.gainCentiDb = (int16_t)readLe16(loudness + 2);
+            info.hasLoudness = true;
+        } else if (memcmp(chunkHeader, "data", 4) == 0) {
+            // Clamp in case the header was written before the recording finished
+            info.dataSize = min(chunkSize, (uint32_t)(file.size() - file.position()));
+            return hasFormat;
+        }
+
+        if (!file.seek(nextChunk)) {
+            return false;
+        }
+    }
+    return false;
+}
+
+bool wavReadHeader(File &file, WavInfo &info) {
+    return parseHeader(file, info);
+}
+
+bool wavReadHeader(const uint8_t *data, size_t length, WavInfo &info, size_t &dataOffset) {
+    MemoryReader reader = {data, length, 0};
+    if (!parseHeader(reader, info)) {
+        return false;
+    }
+    dataOffset = reader.position();
+    return true;
+}
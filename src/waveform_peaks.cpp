@@ -0,0 +1,87 @@
+#include "waveform_peaks.h"
+
+// The top byte of a sample, rounded outwards so a point never looks quieter than it is
+static int8_t floorByte(int16_t sample) {
+    return sample >> 8;
+}
+
+static int8_t ceilByte(int16_t sample) {
+    int32_t value = ((int32_t)sample + 255) >> 8;
+    return value > 127 ? 127 : value;
+}
+
+void WaveformPeaks::begin(uint32_t sampleRate) {
+    rate = sampleRate;
+    sampleCount = 0;
+    samplesPerPoint = sampleRate * peakIntervalMs / 1000;
+    pointPosition = 0;
+    intervalMs = peakIntervalMs;
+    points = 0;
+}
+
+void WaveformPeaks::add(const int16_t *samples, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        int16_t sample = samples[i];
+        if (pointPosition == 0) {
+            pointMin = sample;
+            pointMax = sample;
+        } else {
+            pointMin = sample < pointMin ? sample : pointMin;
+            pointMax = sample > pointMax ? sample : pointMax;
+        }
+        if (++pointPosition == samplesPerPoint) {
+            finishPoint();
+        }
+    }
+    sampleCount += count;
+}
+
+void WaveformPeaks::finishPoint() {
+    if (points == peakMaxPoints) {
+        // Out of points: merge neighbours, halving the resolution
+        for (size_t i = 0; i < points / 2; i++) {
+            int8_t low = minimum[2 * i] < minimum[2 * i + 1] ? minimum[2 * i] : minimum[2 * i + 1];
+            int8_t high = maximum[2 * i] > maximum[2 * i + 1] ? maximum[2 * i] : maximum[2 * i + 1];
+            minimum[i] = low;
+            maximum[i] = high;
+        }
+        points /= 2;
+        samplesPerPoint *= 2;
+        intervalMs *= 2;
+        // The point just gathered covers half the new interval and stays open for the rest
+        return;
+    }
+    minimum[points] = floorByte(pointMin);
+    maximum[points] = ceilByte(pointMax);
+    points++;
+    pointPosition = 0;
+}
+
+static uint8_t *writeLe16(uint8_t *bytes, uint16_t value) {
+    bytes[0] = value & 0xFF;
+    bytes[1] = value >> 8;
+    return bytes + 2;
+}
+
+static uint8_t *writeLe32(uint8_t *bytes, uint32_t value) {
+    writeLe16(bytes, value & 0xFFFF);
+    writeLe16(bytes + 2, value >> 16);
+    return bytes + 4;
+}
+
+size_t WaveformPeaks::write(uint8_t *out) const {
+    bool partial = pointPosition > 0;
+    uint8_t *position = writeLe32(out, sampleCount);
+    position = writeLe32(position, rate);
+    position = writeLe16(position, intervalMs);
+    position = writeLe16(position, points + (partial ? 1 : 0));
+    for (size_t i = 0; i < points; i++) {
+        *position++ = (uint8_t)minimum[i];
+        *position++ = (uint8_t)maximum[i];
+    }
+    if (partial) {
+        *position++ = (uint8_t)floorByte(pointMin);
+        *position++ = (uint8_t)ceilByte(pointMax);
+    }
+    return position - out;
+}
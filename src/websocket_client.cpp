@@ -0,0 +1,222 @@
+#include "websocket_client.h"
+
+enum WebSocketOpcode : uint8_t {
+    WS_OP_TEXT = 0x1,
+    WS_OP_BINARY = 0x2,
+    WS_OP_CLOSE = 0x8,
+    WS_OP_PING = 0x9,
+    WS_OP_PONG = 0xA
+};
+
+static const char base64Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Sec-WebSocket-Key: 16 random bytes, base64 encoded into 24 characters
+static void makeHandshakeKey(char *key) {
+    uint8_t nonce[18] = {}; // Two zero bytes on the end fill the last group; its last two characters become padding
+    for (size_t i = 0; i < 16; i += sizeof(uint32_t)) {
+        uint32_t value = esp_random();
+        memcpy(nonce + i, &value, sizeof(value));
+    }
+    for (size_t i = 0; i < 6; i++) {
+        uint32_t group = (nonce[i * 3] << 16) | (nonce[i * 3 + 1] << 8) | nonce[i * 3 + 2];
+        for (size_t j = 0; j < 4; j++) {
+            key[i * 4 + j] = base64Alphabet[(group >> (18 - 6 * j)) & 0x3F];
+        }
+    }
+    key[22] = '=';
+    key[23] = '=';
+    key[24] = '\0';
+}
+
+bool WebSocketClient::connect(const char *host, uint16_t port, const char *path) {
+    return client.connect(host, port) && handshake(host, path);
+}
+
+bool WebSocketClient::connect(IPAddress ip, uint16_t port, const char *path) {
+    return client.connect(ip, port, webSocketTimeoutMs) && handshake(ip.toString().c_str(), path);
+}
+
+bool WebSocketClient::handshake(const char *host, const char *path) {
+    char key[25];
+    makeHandshakeKey(key);
+    client.printf("GET %s HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                  "Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n\r\n", path, host, key);
+
+    // Status line, then headers up to the empty line; only the status matters here
+    char line[64];
+    size_t length = 0;
+    bool statusLine = true;
+    unsigned long startTime = millis();
+    while (millis() - startTime < webSocketTimeoutMs) {
+        if (!client.available()) {
+            if (!client.connected()) {
+                break;
+            }
+            delay(2);
+            continue;
+        }
+        char c = client.read();
+        if (c != '\n') {
+            if (c != '\r' && length < sizeof(line) - 1) {
+                line[length++] = c;
+            }
+            continue;
+        }
+        line[length] = '\0';
+        if (statusLine) {
+            if (strncmp(line, "HTTP/1.1 101", 12) != 0) {
+                Serial.printf("WebSocket upgrade of %s refused: %s\n", path, line);
+                break;
+            }
+            statusLine = false;
+        } else if (length == 0) {
+            return true;
+        }
+        length = 0;
+    }
+    client.stop();
+    return false;
+}
+
+bool WebSocketClient::connected() {
+    return client.connected();
+}
+
+void WebSocketClient::close() {
+    if (client.connected()) {
+        sendFrame(WS_OP_CLOSE, NULL, 0);
+    }
+    client.stop();
+}
+
+bool WebSocketClient::sendBinary(const uint8_t *data, size_t length) {
+    return sendFrame(WS_OP_BINARY, data, length);
+}
+
+bool WebSocketClient::sendText(const char *text) {
+    return sendFrame(WS_OP_TEXT, (const uint8_t *)text, strlen(text));
+}
+
+bool WebSocketClient::sendFrame(uint8_t opcode, const uint8_t *data, size_t length) {
+    // Header and masked payload go out in one write, so each frame is one TCP segment
+    uint8_t frame[256];
+    size_t headerLength = length < 126 ? 6 : 8;
+    if (headerLength + length > sizeof(frame)) {
+        return false;
+    }
+    frame[0] = 0x80 | opcode; // FIN, never fragmented
+    if (length < 126) {
+        frame[1] = 0x80 | length;
+    } else {
+        frame[1] = 0x80 | 126;
+        frame[2] = length >> 8;
+        frame[3] = length & 0xFF;
+    }
+    uint32_t mask = esp_random();
+    uint8_t *maskKey = frame + headerLength - 4;
+    memcpy(maskKey, &mask, sizeof(mask));
+    for (size_t i = 0; i < length; i++) {
+        frame[headerLength + i] = data[i] ^ maskKey[i & 3];
+    }
+    return client.write(frame, headerLength + length) == headerLength + length;
+}
+
+bool WebSocketClient::readExactly(uint8_t *data, size_t length) {
+    unsigned long startTime = millis();
+    while (length > 0) {
+        int available = client.available();
+        if (available <= 0) {
+            if (!client.connected() || millis() - startTime >= webSocketTimeoutMs) {
+                return false;
+            }
+            delay(1);
+            continue;
+        }
+        int bytesRead = client.read(data, min((size_t)available, length));
+        if (bytesRead <= 0) {
+            return false;
+        }
+        data += bytesRead;
+        length -= bytesRead;
+    }
+    return true;
+}
+
+bool WebSocketClient::skip(size_t length) {
+    uint8_t scratch[64];
+    while (length > 0) {
+        size_t chunk = min(length, sizeof(scratch));
+        if (!readExactly(scratch, chunk)) {
+            return false;
+        }
+        length -= chunk;
+    }
+    return true;
+}
+
+int WebSocketClient::poll(uint8_t *buffer, size_t size, bool &binary) {
+    if (client.available() < 2) {
+        return client.connected() ? 0 : -1;
+    }
+
+    // A frame has started; the rest of it follows within a segment or two
+    uint8_t header[2];
+    if (!readExactly(header, sizeof(header))) {
+        client.stop();
+        return -1;
+    }
+    uint8_t opcode = header[0] & 0x0F;
+    bool masked = (header[1] & 0x80) != 0;
+    uint64_t length = header[1] & 0x7F;
+    uint8_t extended[8];
+    if (length == 126) {
+        if (!readExactly(extended, 2)) {
+            client.stop();
+            return -1;
+        }
+        length = (extended[0] << 8) | extended[1];
+    } else if (length == 127) {
+        if (!readExactly(extended, 8)) {
+            client.stop();
+            return -1;
+        }
+        length = 0;
+        for (size_t i = 0; i < 8; i++) {
+            length = (length << 8) | extended[i];
+        }
+    }
+    uint8_t maskKey[4] = {0, 0, 0, 0};
+    if (masked && !readExactly(maskKey, sizeof(maskKey))) {
+        client.stop();
+        return -1;
+    }
+
+    // Servers don't mask, but a control frame's payload is echoed either way
+    bool control = (opcode & 0x08) != 0;
+    if (length > size || (control && length > 125)) {
+        return skip(length) ? 0 : -1;
+    }
+    if (!readExactly(buffer, length)) {
+        client.stop();
+        return -1;
+    }
+    for (size_t i = 0; masked && i < length; i++) {
+        buffer[i] ^= maskKey[i & 3];
+    }
+
+    switch (opcode) {
+        case WS_OP_PING:
+            sendFrame(WS_OP_PONG, buffer, length);
+            return 0;
+        case WS_OP_CLOSE:
+            sendFrame(WS_OP_CLOSE, NULL, 0);
+            client.stop();
+            return -1;
+        case WS_OP_TEXT:
+        case WS_OP_BINARY:
+            binary = opcode == WS_OP_BINARY;
+            return (int)length;
+        default:
+            return 0; // Pongs, and continuations, which the relay never sends
+    }
+}
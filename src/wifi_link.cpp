@@ -0,0 +1,150 @@
+#include "wifi_link.h"
+
+#include <WiFi.h>
+#include <Preferences.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "metrics.h"
+
+const uint32_t wifiCacheMagic = 0xB7F1CA5E;
+
+// Where and how the last connection was made
+struct WifiCache {
+    uint32_t magic;
+    uint8_t bssid[6];
+    int32_t channel;
+    uint32_t ip;
+    uint32_t gateway;
+    uint32_t subnet;
+    uint32_t dns;
+};
+
+// RTC memory survives deep sleep and soft resets without a flash read; NVS covers power cycles
+RTC_DATA_ATTR static WifiCache wifiCache;
+
+static const char *wifiSsid = NULL;
+static const char *wifiPassword = NULL;
+static TaskHandle_t wifiTask = NULL;
+
+static void loadWifiCache() {
+    if (wifiCache.magic == wifiCacheMagic) {
+        return;
+    }
+    Preferences preferences;
+    preferences.begin("wifi", true);
+    if (preferences.getBytes("link", &wifiCache, sizeof(wifiCache)) != sizeof(wifiCache) || wifiCache.magic != wifiCacheMagic) {
+        memset(&wifiCache, 0, sizeof(wifiCache));
+    }
+    preferences.end();
+}
+
+// Remember the current connection; NVS is only written when something changed
+static void saveWifiCache() {
+    WifiCache current = {};
+    current.magic = wifiCacheMagic;
+    memcpy(current.bssid, WiFi.BSSID(), sizeof(current.bssid));
+    current.channel = WiFi.channel();
+    current.ip = WiFi.localIP();
+    current.gateway = WiFi.gatewayIP();
+    current.subnet = WiFi.subnetMask();
+    current.dns = WiFi.dnsIP();
+    if (memcmp(&current, &wifiCache, sizeof(current)) == 0) {
+        return;
+    }
+    wifiCache = current;
+
+    Preferences preferences;
+    preferences.begin("wifi", false);
+    preferences.putBytes("link", &wifiCache, sizeof(wifiCache));
+    preferences.end();
+}
+
+// Wait for an IP address, giving up early once the driver reports a definite failure
+static bool waitForConnection(unsigned long timeoutMs) {
+    unsigned long startTime = millis();
+    while (millis() - startTime < timeoutMs) {
+        wl_status_t status = WiFi.status();
+        if (status == WL_CONNECTED) {
+            return true;
+        }
+        if (status == WL_CONNECT_FAILED || status == WL_NO_SSID_AVAIL) {
+            return false;
+        }
+        vTaskDelay(pdMS_TO_TICKS(20));
+    }
+    return false;
+}
+
+static bool connectWifi() {
+    unsigned long startTime = millis();
+    bool connected = false;
+    bool fastPath = wifiCache.magic == wifiCacheMagic;
+
+    if (fastPath) {
+        // Known access point and lease: no scan, no DHCP round trips
+        WiFi.config(IPAddress(wifiCache.ip), IPAddress(wifiCache.gateway), IPAddress(wifiCache.subnet),
+                    IPAddress(wifiCache.dns));
+        WiFi.begin(wifiSsid, wifiPassword, wifiCache.channel, wifiCache.bssid, true);
+        connected = waitForConnection(wifiFastConnectTimeoutMs);
+        if (!connected) {
+            Serial.println("Fast Wi-Fi connect failed, scanning.");
+            WiFi.disconnect();
+            wifiCache.magic = 0; // The access point moved or went away; NVS is corrected on success
+        }
+    }
+
+    if (!connected) {
+        fastPath = false;
+        WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE); // Back to DHCP
+        WiFi.begin(wifiSsid, wifiPassword);
+        connected = waitForConnection(wifiFullConnectTimeoutMs);
+    }
+
+    unsigned long elapsedMs = millis() - startTime;
+    if (!connected) {
+        WiFi.disconnect();
+        metricsAdd(METRIC_WIFI_CONNECT_FAILURES);
+        Serial.printf("Failed to connect to Wi-Fi network %s after %lu ms.\n", wifiSsid, elapsedMs);
+        return false;
+    }
+
+    metricsAdd(fastPath ? METRIC_WIFI_FAST_CONNECTS : METRIC_WIFI_FULL_CONNECTS);
+    metricsObserve(STAGE_WIFI_CONNECT, elapsedMs);
+    saveWifiCache();
+    Serial.printf("Connected to Wi-Fi in %lu ms (%s), IP %s, channel %d.\n", elapsedMs, fastPath ? "cached" : "scan",
+                  WiFi.localIP().toString().c_str(), (int)WiFi.channel());
+    return true;
+}
+
+static void wifiSupervisorTask(void *parameter) {
+    uint32_t failures = 0;
+    while (true) {
+        if (WiFi.status() == WL_CONNECTED) {
+            vTaskDelay(pdMS_TO_TICKS(500));
+            continue;
+        }
+        if (connectWifi()) {
+            failures = 0;
+            continue;
+        }
+        // Back off while the network is away, but keep trying
+        failures++;
+        unsigned long pauseMs = min(wifiRetryCapMs, 1000UL << min(failures, (uint32_t)6));
+        vTaskDelay(pdMS_TO_TICKS(pauseMs));
+    }
+}
+
+void wifiLinkBegin(const char *ssid, const char *password) {
+    wifiSsid = ssid;
+    wifiPassword = password;
+    loadWifiCache();
+
+    // The supervisor owns reconnects; the driver's own would always scan. Credentials
+    // are passed on every begin, so they needn't be written to flash either.
+    WiFi.persistent(false);
+    WiFi.mode(WIFI_STA);
+    WiFi.setAutoReconnect(false);
+
+    xTaskCreatePinnedToCore(wifiSupervisorTask, "wifi", 4096, NULL, 1, &wifiTask, 0);
+}
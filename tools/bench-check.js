@@ -0,0 +1,82 @@
+// Measures /check latency with many devices polling at once.
+// Usage: node tools/bench-check.js [devices=300] [pollsPerDevice=20] [intervalMs=250] [queuedFiles=5]
+// Each simulated device polls every intervalMs; use 0 to poll back to back and measure saturation.
+const { spawn } = require('child_process');
+const http = require('http');
+const os = require('os');
+const path = require('path');
+const fs = require('fs');
+
+const deviceCount = parseInt(process.argv[2] || '300', 10);
+const pollsPerDevice = parseInt(process.argv[3] || '20', 10);
+const intervalMs = parseInt(process.argv[4] || '250', 10);
+const queuedFiles = parseInt(process.argv[5] || '5', 10);
+const port = 18000 + Math.floor(Math.random() * 1000);
+
+// Scratch uploads directory with a few pending messages per device
+const uploadsDir = fs.mkdtempSync(path.join(os.tmpdir(), 'brushtalk-bench-'));
+for (const device of ['device1', 'device2']) {
+    fs.mkdirSync(path.join(uploadsDir, device), { recursive: true });
+    for (let i = 0; i < queuedFiles; i++) {
+        fs.writeFileSync(path.join(uploadsDir, device, `${device}_${i}.wav`), Buffer.alloc(1024));
+    }
+}
+
+const server = spawn(process.execPath, [path.join(__dirname, '..', 'server.js')], {
+    env: { ...process.env, PORT: String(port), BRUSHTALK_UPLOADS_DIR: uploadsDir },
+    stdio: ['ignore', 'pipe', 'inherit']
+});
+
+const waitForServer = () => new Promise((resolve) => {
+    server.stdout.on('data', (data) => {
+        if (data.toString().includes('Server running')) {
+            resolve();
+        }
+    });
+});
+
+const check = (agent, device) => new Promise((resolve, reject) => {
+    const start = process.hrtime.bigint();
+    http.get({ port, path: `/check/${device}`, agent }, (res) => {
+        res.resume();
+        res.on('end', () => resolve(Number(process.hrtime.bigint() - start) / 1e6));
+    }).on('error', reject);
+});
+
+const sleep = (ms) => new Promise((resolve) => setTimeout(resolve, ms));
+
+// Each simulated device keeps its own connection and polls on its own schedule,
+// starting at a random point in the interval like a real fleet would
+const runDevice = async (index, latencies) => {
+    const agent = new http.Agent({ keepAlive: true, maxSockets: 1 });
+    const device = index % 2 === 0 ? 'device1' : 'device2';
+    await sleep(Math.random() * intervalMs);
+    for (let i = 0; i < pollsPerDevice; i++) {
+        const latency = await check(agent, device);
+        // The first request includes connection setup, which a polling device pays once
+        if (i > 0) {
+            latencies.push(latency);
+        }
+        await sleep(Math.max(0, intervalMs - latency));
+    }
+    agent.destroy();
+};
+
+const percentile = (sorted, p) => sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+
+(async () => {
+    await waitForServer();
+    const latencies = [];
+    const start = Date.now();
+    await Promise.all(Array.from({ length: deviceCount }, (_, i) => runDevice(i, latencies)));
+    const elapsedMs = Date.now() - start;
+
+    latencies.sort((a, b) => a - b);
+    console.log(`${deviceCount} devices x ${pollsPerDevice} checks every ${intervalMs} ms, ${queuedFiles} queued file(s) per device`);
+    console.log(`throughput: ${(latencies.length / (elapsedMs / 1000)).toFixed(0)} checks/s`);
+    console.log(`latency ms: p50 ${percentile(latencies, 0.5).toFixed(2)}  p95 ${percentile(latencies, 0.95).toFixed(2)}  ` +
+        `p99 ${percentile(latencies, 0.99).toFixed(2)}  max ${latencies[latencies.length - 1].toFixed(2)}`);
+
+    server.kill();
+    fs.rmSync(uploadsDir, { recursive: true, force: true });
+})();
@@ -0,0 +1,157 @@
+// Host-native peer for the direct LAN transfer protocol, so two instances can exchange
+// messages over loopback on Linux without any hardware.
+//
+// Build: g++ -std=c++17 -O2 -Iinclude tools/lan_peer_host.cpp src/lan_protocol.cpp src/crc32.cpp -o lan_peer
+// Usage: lan_peer listen <port> <inboxDir>          receive messages until killed
+//        lan_peer send <host> <port> <sender> <file> push one file, exit 0 if stored
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "crc32.h"
+#include "lan_protocol.h"
+
+// Stores incoming messages the way the device inbox does: temp file, renamed when complete
+class DirectorySink : public LanMessageSink {
+public:
+    explicit DirectorySink(const std::string &dir) : dir(dir) {}
+
+    LanStatus begin(const LanHeader &header) override {
+        finalPath = dir + "/" + header.name;
+        tempPath = finalPath + ".tmp";
+        file = fopen(tempPath.c_str(), "wb");
+        printf("Receiving %s from %s (%u bytes)\n", header.name, header.sender, (unsigned)header.size);
+        return file ? LAN_STORED : LAN_STORAGE_ERROR;
+    }
+
+    bool write(const uint8_t *data, size_t length) override {
+        return fwrite(data, 1, length, file) == length;
+    }
+
+    LanStatus finish(bool complete) override {
+        bool closed = fclose(file) == 0;
+        file = nullptr;
+        if (!complete || !closed || rename(tempPath.c_str(), finalPath.c_str()) != 0) {
+            remove(tempPath.c_str());
+            return LAN_STORAGE_ERROR;
+        }
+        return LAN_STORED;
+    }
+
+private:
+    std::string dir;
+    std::string tempPath;
+    std::string finalPath;
+    FILE *file = nullptr;
+};
+
+static int listenForPeers(int port, const std::string &dir) {
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (bind(server, (sockaddr *)&address, sizeof(address)) != 0 || listen(server, 4) != 0) {
+        perror("listen");
+        return 1;
+    }
+    printf("Listening on port %d, storing into %s\n", port, dir.c_str());
+    fflush(stdout);
+
+    while (true) {
+        int connection = accept(server, nullptr, nullptr);
+        if (connection < 0) {
+            continue;
+        }
+        DirectorySink sink(dir);
+        LanReceiver receiver(sink);
+        uint8_t buffer[1460]; // Roughly what one lwIP segment delivers on the device
+        while (!receiver.done()) {
+            ssize_t received = recv(connection, buffer, sizeof(buffer), 0);
+            if (received <= 0) {
+                receiver.abort();
+                break;
+            }
+            receiver.feed(buffer, received);
+        }
+        uint8_t status = receiver.status();
+        send(connection, &status, 1, MSG_NOSIGNAL);
+        printf("Transfer of %s finished with status '%c'\n", receiver.header().name, status);
+        fflush(stdout);
+        close(connection);
+    }
+}
+
+static int sendToPeer(const char *host, const char *port, const char *sender, const char *filePath) {
+    FILE *file = fopen(filePath, "rb");
+    if (!file) {
+        perror(filePath);
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    LanHeader header = {};
+    snprintf(header.sender, sizeof(header.sender), "%s", sender);
+    const char *slash = strrchr(filePath, '/');
+    snprintf(header.name, sizeof(header.name), "%s", slash ? slash + 1 : filePath);
+    header.size = size;
+    uint8_t buffer[4096];
+    for (size_t n; (n = fread(buffer, 1, sizeof(buffer), file)) > 0;) {
+        header.crc = crc32Update(header.crc, buffer, n);
+    }
+    fseek(file, 0, SEEK_SET);
+
+    addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *peer = nullptr;
+    if (getaddrinfo(host, port, &hints, &peer) != 0) {
+        fprintf(stderr, "Cannot resolve %s\n", host);
+        return 1;
+    }
+    int connection = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(connection, peer->ai_addr, peer->ai_addrlen) != 0) {
+        perror("connect");
+        return 1;
+    }
+    freeaddrinfo(peer);
+
+    size_t headerLength = lanEncodeHeader(header, buffer, sizeof(buffer));
+    bool sent = headerLength > 0 && send(connection, buffer, headerLength, MSG_NOSIGNAL) == (ssize_t)headerLength;
+    for (size_t n; sent && (n = fread(buffer, 1, sizeof(buffer), file)) > 0;) {
+        sent = send(connection, buffer, n, MSG_NOSIGNAL) == (ssize_t)n;
+    }
+    fclose(file);
+
+    uint8_t status = 0;
+    if (recv(connection, &status, 1, MSG_WAITALL) != 1) {
+        fprintf(stderr, "No reply from peer\n");
+    }
+    close(connection);
+    printf("Peer answered '%c' for %s (%ld bytes, CRC32 %08x)\n", status ? status : '?', header.name, size,
+           (unsigned)header.crc);
+    return status == LAN_STORED ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc == 4 && strcmp(argv[1], "listen") == 0) {
+        return listenForPeers(atoi(argv[2]), argv[3]);
+    }
+    if (argc == 6 && strcmp(argv[1], "send") == 0) {
+        return sendToPeer(argv[2], argv[3], argv[4], argv[5]);
+    }
+    fprintf(stderr, "Usage: %s listen <port> <inboxDir> | send <host> <port> <sender> <file>\n", argv[0]);
+    return 2;
+}
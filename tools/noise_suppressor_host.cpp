@@ -0,0 +1,345 @@
+// Host reference for the noise suppressor. The device code runs unchanged next to a
+// double-precision implementation of the same algorithm, for regression checks and for
+// listening to what the suppressor does to real recordings.
+//
+// Build: g++ -std=c++17 -O2 -Iinclude tools/noise_suppressor_host.cpp src/noise_suppressor.cpp -o noise_suppressor
+// Usage: noise_suppressor test               self-checks, exit 0 if all pass
+//        noise_suppressor <in.wav> <out.wav> suppress a 16-bit mono PCM file
+
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "noise_suppressor.h"
+
+// The algorithm of NoiseSuppressor in doubles, with a textbook FFT
+class ReferenceSuppressor {
+public:
+    explicit ReferenceSuppressor(uint32_t sampleRate) {
+        size_t tenMs = sampleRate / 100;
+        hop = 64;
+        while (hop < noiseMaxFftSize / 2 && hop * 3 / 2 < tenMs) {
+            hop *= 2;
+        }
+        size = hop * 2;
+        window.resize(size);
+        for (size_t n = 0; n < size; n++) {
+            window[n] = sin(M_PI * n / size);
+        }
+        input.assign(size, 0.0);
+        overlap.assign(hop, 0.0);
+        noise.assign(size / 2 + 1, 0.0);
+        clean.assign(size / 2 + 1, 0.0);
+    }
+
+    std::vector<double> process(const std::vector<int16_t> &samples) {
+        std::vector<double> result;
+        std::vector<double> pending(hop, 0.0); // Output of the last frame, handed out one hop late
+        size_t position = 0;
+        for (int16_t sample : samples) {
+            result.push_back(pending[position]);
+            input[hop + position] = sample;
+            if (++position == hop) {
+                frame(pending);
+                position = 0;
+            }
+        }
+        return result;
+    }
+
+private:
+    static void fft(std::vector<std::complex<double>> &data, bool inverse) {
+        size_t n = data.size();
+        for (size_t i = 1, j = 0; i < n; i++) {
+            size_t bit = n >> 1;
+            for (; j & bit; bit >>= 1) {
+                j ^= bit;
+            }
+            j ^= bit;
+            if (i < j) {
+                std::swap(data[i], data[j]);
+            }
+        }
+        for (size_t length = 2; length <= n; length <<= 1) {
+            double angle = (inverse ? 2.0 : -2.0) * M_PI / length;
+            for (size_t start = 0; start < n; start += length) {
+                for (size_t k = 0; k < length / 2; k++) {
+                    std::complex<double> w = std::polar(1.0, angle * k);
+                    std::complex<double> t = w * data[start + k + length / 2];
+                    data[start + k + length / 2] = data[start + k] - t;
+                    data[start + k] += t;
+                }
+            }
+        }
+    }
+
+    void frame(std::vector<double> &out) {
+        std::vector<std::complex<double>> spectrum(size);
+        for (size_t n = 0; n < size; n++) {
+            spectrum[n] = input[n] * window[n];
+        }
+        fft(spectrum, false);
+        bool learning = framesSeen < noiseLearnFrames;
+        for (size_t k = 0; k <= size / 2; k++) {
+            double power = std::norm(spectrum[k]);
+            if (learning) {
+                noise[k] += (power - noise[k]) / (framesSeen + 1);
+            } else if (power < noiseSpeechRatio * noise[k]) {
+                noise[k] += noiseTrackWeight * (power - noise[k]);
+            } else {
+                noise[k] *= noiseCreep;
+            }
+            double floor = std::max(noise[k], 1.0);
+            double posterior = power / floor;
+            double prior = noiseDecisionWeight * clean[k] / floor + (1.0 - noiseDecisionWeight) * std::max(posterior - 1.0, 0.0);
+            double gain = std::max(prior / (1.0 + prior), (double)noiseGainFloor);
+            clean[k] = gain * gain * power;
+            spectrum[k] *= gain;
+            if (k > 0 && k < size / 2) {
+                spectrum[size - k] *= gain;
+            }
+        }
+        framesSeen++;
+        fft(spectrum, true);
+        for (size_t n = 0; n < size; n++) {
+            double value = spectrum[n].real() / size * window[n];
+            if (n < hop) {
+                out[n] = overlap[n] + value;
+            } else {
+                overlap[n - hop] = value;
+            }
+        }
+        std::copy(input.begin() + hop, input.end(), input.begin());
+    }
+
+    size_t hop;
+    size_t size;
+    uint32_t framesSeen = 0;
+    std::vector<double> window, input, overlap, noise, clean;
+};
+
+static double energy(const std::vector<double> &signal, size_t from, size_t to) {
+    double sum = 0.0;
+    for (size_t i = from; i < to; i++) {
+        sum += signal[i] * signal[i];
+    }
+    return sum / std::max<size_t>(to - from, 1);
+}
+
+static double decibels(double ratio) {
+    return 10.0 * log10(std::max(ratio, 1e-12));
+}
+
+// Water-like noise (white, lowpassed a little), with speech-like harmonic bursts from
+// speechStart on: a 140 Hz voice with formant-ish amplitude, switching on and off
+static void makeTestSignal(uint32_t rate, size_t length, size_t speechStart, std::vector<double> &speech,
+                           std::vector<double> &noise) {
+    std::mt19937 random(1234);
+    std::normal_distribution<double> gaussian(0.0, 1.0);
+    speech.assign(length, 0.0);
+    noise.assign(length, 0.0);
+    double state = 0.0;
+    for (size_t i = 0; i < length; i++) {
+        state = 0.7 * state + 0.3 * gaussian(random);
+        noise[i] = 1500.0 * state;
+        double t = (double)i / rate;
+        bool voiced = i >= speechStart && fmod(t, 0.6) < 0.4;
+        if (voiced) {
+            for (int harmonic = 1; harmonic <= 20 && harmonic * 140.0 < rate / 2; harmonic++) {
+                double formant = exp(-pow((harmonic * 140.0 - 700.0) / 600.0, 2)) + 0.5 * exp(-pow((harmonic * 140.0 - 1800.0) / 500.0, 2));
+                speech[i] += 6000.0 * formant / harmonic * sin(2.0 * M_PI * 140.0 * harmonic * t);
+            }
+        }
+    }
+}
+
+static bool check(bool ok, const char *what) {
+    printf("%s %s\n", ok ? "PASS" : "FAIL", what);
+    return ok;
+}
+
+static bool testFft() {
+    std::mt19937 random(42);
+    std::uniform_int_distribution<int> sample(-32768, 32767);
+    bool ok = true;
+    for (size_t size = 128; size <= noiseMaxFftSize; size *= 2) {
+        std::vector<int32_t> data(2 * size);
+        std::vector<std::complex<double>> exact(size);
+        for (size_t i = 0; i < size; i++) {
+            data[2 * i] = sample(random);
+            data[2 * i + 1] = 0;
+            exact[i] = data[2 * i];
+        }
+        std::vector<int32_t> original(data);
+        fixedFft(data.data(), size, false);
+        double worst = 0.0;
+        for (size_t k = 0; k < size; k++) {
+            std::complex<double> sum = 0.0;
+            for (size_t n = 0; n < size; n++) {
+                sum += exact[n] * std::polar(1.0, -2.0 * M_PI * k * n / size);
+            }
+            worst = std::max(worst, std::abs(sum - std::complex<double>(data[2 * k], data[2 * k + 1])));
+        }
+        fixedFft(data.data(), size, true);
+        double roundTrip = 0.0;
+        for (size_t i = 0; i < size; i++) {
+            roundTrip = std::max(roundTrip, std::fabs((double)data[2 * i] / size - original[2 * i]));
+        }
+        // Errors relative to full scale of the transform, size * 32768
+        double relative = worst / (size * 32768.0);
+        printf("  fft %4zu: worst bin error %.2e of full scale, round trip within %.2f LSB\n", size, relative, roundTrip);
+        ok &= relative < 1e-4 && roundTrip < 4.0;
+    }
+    return check(ok, "fixed-point FFT matches the DFT");
+}
+
+static bool testSuppressor(uint32_t rate) {
+    size_t length = rate * 4;
+    size_t speechStart = rate; // First second is noise only
+    std::vector<double> speech, noise;
+    makeTestSignal(rate, length, speechStart, speech, noise);
+    std::vector<int16_t> samples(length);
+    for (size_t i = 0; i < length; i++) {
+        samples[i] = (int16_t)std::max(-32768.0, std::min(32767.0, std::round(speech[i] + noise[i])));
+    }
+
+    NoiseSuppressor *suppressor = new NoiseSuppressor();
+    suppressor->begin(rate);
+    size_t hop = suppressor->hopSize();
+    size_t delay = suppressor->latency();
+    std::vector<int16_t> processed(samples);
+    auto startTime = std::chrono::steady_clock::now();
+    for (size_t offset = 0; offset < length; offset += 1024) { // Pool-block sized calls, like the recorder
+        suppressor->process(processed.data() + offset, std::min<size_t>(1024, length - offset));
+    }
+    double elapsedUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - startTime).count();
+    delete suppressor;
+
+    ReferenceSuppressor reference(rate);
+    std::vector<double> expected = reference.process(samples);
+    std::vector<double> fixed(processed.begin(), processed.end());
+
+    // Fixed point against the double reference
+    std::vector<double> difference(length);
+    for (size_t i = 0; i < length; i++) {
+        difference[i] = fixed[i] - expected[i];
+    }
+    double matchDb = decibels(energy(expected, 0, length) / energy(difference, 0, length));
+
+    // Noise-only stretch after the estimate settled, and speech kept, both aligned for the delay
+    size_t settled = rate / 2;
+    double noiseCutDb = decibels(energy(noise, settled, speechStart) / energy(fixed, settled + delay, speechStart + delay));
+    std::vector<double> speechDelayed(length, 0.0), noiseDelayed(length, 0.0);
+    for (size_t i = delay; i < length; i++) {
+        speechDelayed[i] = speech[i - delay];
+        noiseDelayed[i] = noise[i - delay];
+    }
+    std::vector<double> residual(length);
+    std::vector<double> noisyResidual(length);
+    for (size_t i = 0; i < length; i++) {
+        residual[i] = fixed[i] - speechDelayed[i];
+        noisyResidual[i] = speechDelayed[i] + noiseDelayed[i] - speechDelayed[i];
+    }
+    double snrBefore = decibels(energy(speechDelayed, speechStart + delay, length) / energy(noisyResidual, speechStart + delay, length));
+    double snrAfter = decibels(energy(speechDelayed, speechStart + delay, length) / energy(residual, speechStart + delay, length));
+    double usPer10Ms = elapsedUs / (length * 100.0 / rate);
+
+    printf("  %u Hz, hop %zu: matches reference to %.1f dB, noise cut %.1f dB, speech SNR %.1f -> %.1f dB, %.1f us per 10 ms\n",
+           (unsigned)rate, hop, matchDb, noiseCutDb, snrBefore, snrAfter, usPer10Ms);
+    char what[96];
+    snprintf(what, sizeof(what), "suppressor at %u Hz", (unsigned)rate);
+    return check(matchDb > 40.0 && noiseCutDb > 12.0 && snrAfter > snrBefore, what);
+}
+
+static bool readWav(const char *path, std::vector<int16_t> &samples, uint32_t &rate) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    std::vector<uint8_t> data;
+    uint8_t buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        data.insert(data.end(), buffer, buffer + count);
+    }
+    fclose(file);
+    if (data.size() < 12 || memcmp(data.data(), "RIFF", 4) != 0 || memcmp(data.data() + 8, "WAVE", 4) != 0) {
+        return false;
+    }
+    bool pcm16Mono = false;
+    for (size_t offset = 12; offset + 8 <= data.size();) {
+        uint32_t size;
+        memcpy(&size, data.data() + offset + 4, 4);
+        const uint8_t *body = data.data() + offset + 8;
+        if (memcmp(data.data() + offset, "fmt ", 4) == 0 && size >= 16) {
+            uint16_t format, channels, bits;
+            memcpy(&format, body, 2);
+            memcpy(&channels, body + 2, 2);
+            memcpy(&rate, body + 4, 4);
+            memcpy(&bits, body + 14, 2);
+            pcm16Mono = format == 1 && channels == 1 && bits == 16;
+        } else if (memcmp(data.data() + offset, "data", 4) == 0 && pcm16Mono) {
+            size = std::min<size_t>(size, data.size() - offset - 8);
+            samples.resize(size / 2);
+            memcpy(samples.data(), body, samples.size() * 2);
+            return true;
+        }
+        offset += 8 + size + (size & 1);
+    }
+    return false;
+}
+
+static bool writeWav(const char *path, const std::vector<int16_t> &samples, uint32_t rate) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    uint32_t dataSize = samples.size() * 2;
+    uint32_t riffSize = 36 + dataSize;
+    uint32_t fmtSize = 16;
+    uint16_t format = 1, channels = 1, blockAlign = 2, bits = 16;
+    uint32_t byteRate = rate * 2;
+    fwrite("RIFF", 1, 4, file);
+    fwrite(&riffSize, 4, 1, file);
+    fwrite("WAVEfmt ", 1, 8, file);
+    fwrite(&fmtSize, 4, 1, file);
+    fwrite(&format, 2, 1, file);
+    fwrite(&channels, 2, 1, file);
+    fwrite(&rate, 4, 1, file);
+    fwrite(&byteRate, 4, 1, file);
+    fwrite(&blockAlign, 2, 1, file);
+    fwrite(&bits, 2, 1, file);
+    fwrite("data", 1, 4, file);
+    fwrite(&dataSize, 4, 1, file);
+    fwrite(samples.data(), 2, samples.size(), file);
+    return fclose(file) == 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc == 2 && strcmp(argv[1], "test") == 0) {
+        bool ok = testFft();
+        for (uint32_t rate : {8000u, 16000u, 44100u}) {
+            ok &= testSuppressor(rate);
+        }
+        return ok ? 0 : 1;
+    }
+    if (argc == 3) {
+        std::vector<int16_t> samples;
+        uint32_t rate = 0;
+        if (!readWav(argv[1], samples, rate)) {
+            fprintf(stderr, "%s is not a 16-bit mono PCM WAV file\n", argv[1]);
+            return 1;
+        }
+        NoiseSuppressor *suppressor = new NoiseSuppressor();
+        suppressor->begin(rate);
+        suppressor->process(samples.data(), samples.size());
+        delete suppressor;
+        return writeWav(argv[2], samples, rate) ? 0 : 1;
+    }
+    fprintf(stderr, "Usage: %s test | %s <in.wav> <out.wav>\n", argv[0], argv[0]);
+    return 2;
+}